@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# Copyright (c) 2020-2022, Barcelona Supercomputing Center
+#                          Centro Nacional de Supercomputacion
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+# Performance regression benchmark, run by `make bench`. Every engine of
+# BENCH_ENGINES runs every BENCH_PARTICLES x BENCH_TIMESTEPS case BENCH_REPEATS
+# times in BENCH_DIR, and the median and median absolute deviation of the
+# execution time and of the effective throughput are compared with the medians
+# stored in BENCH_BASELINE. It fails when a run does not verify or when a median
+# throughput is more than BENCH_THRESHOLD percent below its baseline.
+#
+# Every run is verified, the approximate engines report n/a. The references of
+# input/ are used where they exist, the other cases get one from a run of the
+# direct engine, made once in BENCH_DIR. Without a baseline file, or with
+# BENCH_RECORD=1, the medians of this run are saved as the new baseline.
+
+PROGRAM=${PROGRAM:-./nbody-seq}
+BENCH_ENGINES=${BENCH_ENGINES:-ompss direct symmetric bh bins cutoff}
+BENCH_PARTICLES=${BENCH_PARTICLES:-8192 16384}
+BENCH_TIMESTEPS=${BENCH_TIMESTEPS:-1 10}
+BENCH_REPEATS=${BENCH_REPEATS:-3}
+BENCH_THRESHOLD=${BENCH_THRESHOLD:-10}
+BENCH_BASELINE=${BENCH_BASELINE:-bench.baseline}
+BENCH_DIR=${BENCH_DIR:-bench}
+BENCH_FLAGS=${BENCH_FLAGS:-}
+BENCH_RECORD=${BENCH_RECORD:-0}
+
+top=$(pwd)
+case "$PROGRAM" in /*) ;; *) PROGRAM="$top/$PROGRAM" ;; esac
+case "$BENCH_BASELINE" in /*) ;; *) BENCH_BASELINE="$top/$BENCH_BASELINE" ;; esac
+
+mkdir -p "$BENCH_DIR/input" || exit 1
+cd "$BENCH_DIR" || exit 1
+results=$(mktemp) || exit 1
+trap 'rm -f "$results"' EXIT
+
+# Median of the values on stdin
+median() {
+   sort -g | awk '{ v[NR] = $1 } END { printf "%g\n", NR % 2 ? v[(NR + 1)/2] : (v[NR/2] + v[NR/2 + 1])/2 }'
+}
+
+# Median and median absolute deviation of the values given as arguments
+stats() {
+   m=$(printf '%s\n' "$@" | median)
+   echo "$m $(printf '%s\n' "$@" | awk -v m="$m" '{ print ($1 > m ? $1 - m : m - $1) }' | median)"
+}
+
+status=0
+for n in $BENCH_PARTICLES; do
+   for steps in $BENCH_TIMESTEPS; do
+      ref="particles-$n-2048-$steps.ref"
+      if [ ! -f "input/$ref" ]; then
+         if [ -f "$top/input/$ref" ]; then
+            cp "$top/input/$ref" input/
+         else
+            "$PROGRAM" -s -e direct $BENCH_FLAGS "$n" "$steps" > /dev/null &&
+               cp "particles-$n-2048-$steps.out" "input/$ref" || exit 1
+         fi
+      fi
+
+      for engine in $BENCH_ENGINES; do
+         times=""; rates=""; failed=0; r=0
+         while [ $r -lt "$BENCH_REPEATS" ]; do
+            out=$("$PROGRAM" -e "$engine" $BENCH_FLAGS "$n" "$steps")
+            echo "$out" | grep -Eq "Verification: (successful|n/a)" || failed=1
+            times="$times $(echo "$out" | awk '/Execution time/ { print $4 }')"
+            rates="$rates $(echo "$out" | awk '/Effective throughput/ { print $4 }')"
+            r=$((r + 1))
+         done
+         set -- $(stats $times) $(stats $rates)
+         echo "$engine $n $steps $1 $2 $3 $4 $failed" >> "$results"
+      done
+   done
+done
+
+record=$BENCH_RECORD
+[ -f "$BENCH_BASELINE" ] || record=1
+
+printf '%-10s %9s %6s %11s %7s %11s %7s %11s %8s  %s\n' engine particles steps 'time (s)' 'mad %' \
+   'gpairs/s' 'mad %' baseline change status
+awk -v threshold="$BENCH_THRESHOLD" -v record="$record" '
+   FILENAME != "-" && FNR == NR && !record { base[$1 " " $2 " " $3] = $4; next }
+   {
+      key = $1 " " $2 " " $3; st = "ok"; b = base[key]; change = "-"
+      if ($8) st = "FAIL (verification)"
+      if (b != "" && b > 0) {
+         c = 100.0*($6 - b)/b; change = sprintf("%+.1f%%", c)
+         if (c < -threshold && !$8) st = "FAIL (regression)"
+      }
+      if (st != "ok") failed = 1
+      printf "%-10s %9d %6d %11.4f %7.1f %11.4f %7.1f %11s %8s  %s\n", $1, $2, $3, $4,
+         ($4 > 0 ? 100.0*$5/$4 : 0), $6, ($6 > 0 ? 100.0*$7/$6 : 0), b == "" ? "-" : sprintf("%.4f", b), change, st
+   }
+   END { exit failed }' $([ "$record" = 1 ] || echo "$BENCH_BASELINE") - < "$results" || status=1
+
+if [ "$record" = 1 ]; then
+   if [ $status -ne 0 ]; then
+      echo "Not recording a baseline from a failing run"
+   else
+      awk '{ print $1, $2, $3, $6 }' "$results" > "$BENCH_BASELINE"
+      echo "Baseline saved to $BENCH_BASELINE"
+   fi
+fi
+exit $status
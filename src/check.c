@@ -0,0 +1,331 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "nbody.h"
+#include "engine.h"
+
+extern int silent;
+
+#define CHECK_ULP_BUCKETS 33 /* 0, then [2^(k-1), 2^k) for k = 1..32 */
+#define CHECK_MAX_PERCENT 0.6
+#define CHECK_MAX_ERROR   0.000008
+#define CHECK_MAX_VELOCITY_ERROR 0.00001  /* mean relative error of the velocity vectors */
+
+typedef struct {
+   double error;                          /* sum of the percent errors, as nbody_check always did */
+   double max;                            /* max relative error of an axis */
+   size_t count;                          /* particles with some axis differing */
+   double velocity_error;                 /* sum of the relative errors of the velocity vectors */
+   double velocity_max;
+   size_t ulp[6][CHECK_ULP_BUCKETS];      /* position x, y, z then velocity x, y, z */
+   float  *errors;                        /* relative error of each differing particle */
+   size_t num_errors;
+   size_t max_errors;
+} check_stats_t;
+
+typedef struct {
+   const particles_block_t *local;
+   const particles_block_t *ref;
+   size_t                  n_blocks;      /* blocks checked */
+   size_t                  count;         /* real particles, the padding of the last block is not checked */
+   size_t                  stride;        /* block stride, more than one when sampling */
+   size_t                  fail_count;    /* fail fast past this many differing particles */
+   int                     fail_fast;
+   size_t                  differing;     /* shared, only updated in fail fast mode */
+   int                     stopped;
+   unsigned char           *bad_blocks;
+   check_stats_t           *stats;
+} check_args_t;
+
+static inline uint32_t check_ulp(const float a, const float b)
+{
+   union { float f; int32_t i; } ua = { a }, ub = { b };
+   /* Map the sign-magnitude floats to ordered integers */
+   const int64_t ia = ua.i < 0 ? (int64_t)INT32_MIN - ua.i : ua.i;
+   const int64_t ib = ub.i < 0 ? (int64_t)INT32_MIN - ub.i : ub.i;
+   const int64_t d  = ia > ib ? ia - ib : ib - ia;
+   return d > UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+}
+
+static inline int check_bucket(const uint32_t ulp)
+{
+   return ulp == 0 ? 0 : 32 - __builtin_clz(ulp);
+}
+
+/* Per element pass, branch free so it vectorizes: number of particles of the
+ * block with differing positions and their summed percent error, and the summed
+ * and max relative error of the velocities. Positions hardly move in a short run
+ * of the default system, the velocities are what shows a wrong force. */
+static size_t check_block(const particles_block_t * const a, const particles_block_t * const b, const int n,
+      check_stats_t * const stats)
+{
+   size_t count = 0;
+   double sum = 0.0, vsum = 0.0, vmax = stats->velocity_max;
+   int e;
+   for (e = 0; e < n; e++) {
+      const int differ = (a->position_x[e] != b->position_x[e]) | (a->position_y[e] != b->position_y[e]) |
+         (a->position_z[e] != b->position_z[e]);
+      const double err = fabs(((a->position_x[e] - b->position_x[e])*100.0)/b->position_x[e]) +
+         fabs(((a->position_y[e] - b->position_y[e])*100.0)/b->position_y[e]) +
+         fabs(((a->position_z[e] - b->position_z[e])*100.0)/b->position_z[e]);
+      const double dx = (double)a->velocity_x[e] - b->velocity_x[e];
+      const double dy = (double)a->velocity_y[e] - b->velocity_y[e];
+      const double dz = (double)a->velocity_z[e] - b->velocity_z[e];
+      const double norm = (double)b->velocity_x[e]*b->velocity_x[e] + (double)b->velocity_y[e]*b->velocity_y[e] +
+         (double)b->velocity_z[e]*b->velocity_z[e];
+      const double verr = sqrt((dx*dx + dy*dy + dz*dz)/(norm > 0.0 ? norm : 1.0));
+      count += differ;
+      sum   += differ ? err : 0.0;
+      vsum  += verr;
+      vmax   = verr > vmax ? verr : vmax;
+   }
+   stats->error          += sum;
+   stats->velocity_error += vsum;
+   stats->velocity_max    = vmax;
+   return count;
+}
+
+/* Detailed pass, only for blocks with differences */
+static void check_details(const particles_block_t * const a, const particles_block_t * const b, const int n,
+      check_stats_t * const stats)
+{
+   int e, d;
+   for (e = 0; e < n; e++) {
+      const float pa[3] = { a->position_x[e], a->position_y[e], a->position_z[e] };
+      const float pb[3] = { b->position_x[e], b->position_y[e], b->position_z[e] };
+      double rel = 0.0;
+      int differ = 0;
+
+      stats->ulp[3][check_bucket(check_ulp(a->velocity_x[e], b->velocity_x[e]))]++;
+      stats->ulp[4][check_bucket(check_ulp(a->velocity_y[e], b->velocity_y[e]))]++;
+      stats->ulp[5][check_bucket(check_ulp(a->velocity_z[e], b->velocity_z[e]))]++;
+      for (d = 0; d < 3; d++) {
+         const uint32_t ulp = check_ulp(pa[d], pb[d]);
+         const double axis = pa[d] == pb[d] ? 0.0 : fabs((double)(pa[d] - pb[d])/pb[d]);
+         stats->ulp[d][check_bucket(ulp)]++;
+         if (axis > stats->max) stats->max = axis;
+         rel += axis;
+         differ |= ulp != 0;
+      }
+
+      if (!differ) continue;
+      if (stats->num_errors == stats->max_errors) {
+         stats->max_errors = 2*stats->max_errors + 1024;
+         stats->errors = realloc(stats->errors, stats->max_errors*sizeof(float));
+         assert(stats->errors != NULL);
+      }
+      stats->errors[stats->num_errors++] = rel/3.0;
+   }
+}
+
+static void check_worker(void * arg, const int tid, const int nthreads)
+{
+   check_args_t * const args = arg;
+   check_stats_t * const stats = &args->stats[tid];
+   size_t begin, end, i, d;
+
+   nbody_pool_range(args->n_blocks, 1, tid, nthreads, &begin, &end);
+   for (i = begin; i < end; i++) {
+      if (args->fail_fast && __atomic_load_n(&args->stopped, __ATOMIC_RELAXED)) break;
+
+      const size_t block = i*args->stride;
+      if (block*BLOCK_SIZE >= args->count) break;
+      const int n = args->count - block*BLOCK_SIZE < BLOCK_SIZE ? args->count - block*BLOCK_SIZE : BLOCK_SIZE;
+      const double velocity_error = stats->velocity_error;
+      const size_t count = check_block(&args->local[block], &args->ref[block], n, stats);
+
+      if (count == 0 && stats->velocity_error == velocity_error) {
+         for (d = 0; d < 6; d++) stats->ulp[d][0] += n;
+         continue;
+      }
+      stats->count += count;
+      args->bad_blocks[block] = 1;
+      check_details(&args->local[block], &args->ref[block], n, stats);
+
+      if (args->fail_fast && __atomic_add_fetch(&args->differing, count, __ATOMIC_RELAXED) > args->fail_count) {
+         __atomic_store_n(&args->stopped, 1, __ATOMIC_RELAXED);
+      }
+   }
+}
+
+static int check_compare_float(const void * a, const void * b)
+{
+   const float fa = *(const float *)a, fb = *(const float *)b;
+   return (fa > fb) - (fa < fb);
+}
+
+/* Relative error below which a fraction p of the checked particles are, the
+ * ones without differences counting as zero */
+static double check_percentile(const float * errors, const size_t num_errors, const size_t checked, const double p)
+{
+   const size_t rank = (size_t)(p*(checked - 1));
+   const size_t zeros = checked - num_errors;
+   return rank < zeros ? 0.0 : errors[rank - zeros];
+}
+
+static void check_report(const char * fname, const char * ref, const nbody_t * const nbody, const check_args_t * const args,
+      const check_stats_t * const total, const size_t checked, const double criterion, const double * percentiles,
+      const int result)
+{
+   static const char * const axes[] = { "x", "y", "z", "vx", "vy", "vz" };
+   size_t i;
+   int d, k;
+
+   FILE * const f = fopen(fname, "w");
+   assert(f != NULL);
+
+   fprintf(f, "{\n  \"reference\": \"%s\",\n  \"rank\": %d,\n  \"particles\": %zu,\n  \"checked\": %zu,\n",
+         ref, nbody_comm_rank(), nbody->count, checked);
+   fprintf(f, "  \"sampled\": %s,\n  \"stopped_early\": %s,\n  \"differing\": %zu,\n",
+         args->stride > 1 ? "true" : "false", args->stopped ? "true" : "false", total->count);
+   fprintf(f, "  \"criterion_percent_error\": %e,\n", total->count > 0 ? criterion : 0.0);
+   fprintf(f, "  \"relative_error\": { \"mean\": %e, \"max\": %e, \"p50\": %e, \"p90\": %e, \"p99\": %e, \"p999\": %e },\n",
+         checked > 0 ? total->error/100.0/(3.0*checked) : 0.0, total->max,
+         percentiles[0], percentiles[1], percentiles[2], percentiles[3]);
+   fprintf(f, "  \"velocity_error\": { \"mean\": %e, \"max\": %e },\n",
+         checked > 0 ? total->velocity_error/checked : 0.0, total->velocity_max);
+   fprintf(f, "  \"ulp_histogram\": {\n");
+   for (d = 0; d < 6; d++) {
+      fprintf(f, "    \"%s\": [", axes[d]);
+      for (k = 0; k < CHECK_ULP_BUCKETS; k++) fprintf(f, "%s%zu", k ? ", " : "", total->ulp[d][k]);
+      fprintf(f, "]%s\n", d < 5 ? "," : "");
+   }
+   fprintf(f, "  },\n  \"differing_blocks\": [");
+   for (i = 0, k = 0; i < (size_t)nbody->num_particles; i++) {
+      if (args->bad_blocks[i]) fprintf(f, "%s%zu", k++ ? ", " : "", i);
+   }
+   fprintf(f, "],\n  \"result\": \"%s\"\n}\n", result > 0 ? "successful" : (result == 0 ? "n/a" : "fail"));
+   assert(fclose(f) == 0);
+}
+
+int nbody_check(const nbody_t *nbody, const nbody_opts_t * const opts)
+{
+   char fname[1024];
+   sprintf(fname, "./input/%s.ref", nbody->file.name);
+
+   if ( access( fname, F_OK ) != 0 ) return 0;
+
+   const int fd = open (fname, O_RDONLY, 0);
+   assert(fd >= 0);
+
+   particle_ptr_t particles = mmap(NULL, nbody->file.size, PROT_READ, MAP_SHARED, fd, nbody->file.offset);
+   assert(particles != MAP_FAILED);
+   assert(close(fd) == 0);
+
+   const size_t n_blocks = nbody->num_particles;
+   const size_t samples  = opts->check_samples > 0 ? ((size_t)opts->check_samples + BLOCK_SIZE - 1)/BLOCK_SIZE : n_blocks;
+   const size_t stride   = samples < n_blocks ? n_blocks/samples : 1;
+   const size_t checked_blocks = (n_blocks + stride - 1)/stride;
+
+   check_args_t args = { nbody->local, particles, checked_blocks, nbody->count, stride,
+      (size_t)(checked_blocks*BLOCK_SIZE*CHECK_MAX_PERCENT/100.0), opts->check_fail_fast, 0, 0,
+      calloc(n_blocks, 1), calloc(opts->threads, sizeof(check_stats_t)) };
+   assert(args.bad_blocks != NULL && args.stats != NULL);
+
+   nbody_pool_init(opts->threads);
+   nbody_pool_run(check_worker, &args);
+   nbody_pool_fini();
+
+   /* Merge the per thread statistics */
+   check_stats_t total;
+   memset(&total, 0, sizeof(total));
+   int t, d, k;
+   for (t = 0; t < opts->threads; t++) {
+      const check_stats_t * const s = &args.stats[t];
+      total.error += s->error;
+      total.count += s->count;
+      total.velocity_error += s->velocity_error;
+      if (s->max > total.max) total.max = s->max;
+      if (s->velocity_max > total.velocity_max) total.velocity_max = s->velocity_max;
+      for (d = 0; d < 6; d++) for (k = 0; k < CHECK_ULP_BUCKETS; k++) total.ulp[d][k] += s->ulp[d][k];
+      total.num_errors += s->num_errors;
+   }
+   total.errors = malloc((total.num_errors + 1)*sizeof(float));
+   assert(total.errors != NULL);
+   for (t = 0, total.num_errors = 0; t < opts->threads; t++) {
+      memcpy(total.errors + total.num_errors, args.stats[t].errors, args.stats[t].num_errors*sizeof(float));
+      total.num_errors += args.stats[t].num_errors;
+      free(args.stats[t].errors);
+   }
+   qsort(total.errors, total.num_errors, sizeof(float), check_compare_float);
+
+   size_t checked = 0;
+   for (k = 0; k < CHECK_ULP_BUCKETS; k++) checked += total.ulp[0][k];
+
+   const double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+   double percentiles[4];
+   for (k = 0; k < 4; k++) {
+      percentiles[k] = checked > 0 ? check_percentile(total.errors, total.num_errors, checked, quantiles[k]) : 0.0;
+   }
+
+   /* Approximate engines and reduced precision sources are far from the all-pairs
+    * reference by design, their errors are reported but not judged */
+   const nbody_engine_t * const engine = nbody_find_engine(opts->engine);
+   const int approximate = (engine != NULL && engine->approximate) || strcmp(opts->precision, "fp32") != 0;
+   const double relative_error = total.error/(3.0*total.count);
+   const double velocity_error = checked > 0 ? total.velocity_error/checked : 0.0;
+   const int result = approximate ? 0 : args.stopped || (total.count*100.0)/checked > CHECK_MAX_PERCENT ||
+      relative_error > CHECK_MAX_ERROR || velocity_error > CHECK_MAX_VELOCITY_ERROR ? -1 : 1;
+
+   if (!silent) {
+      printf("> Checked %zu of %zu particles%s%s: %zu differ, relative error mean %e, max %e, p99 %e\n",
+            checked, nbody->count, stride > 1 ? " (sampled)" : "", args.stopped ? " (stopped early)" : "",
+            total.count, checked > 0 ? total.error/100.0/(3.0*checked) : 0.0, total.max, percentiles[2]);
+      printf("> Velocity relative error mean %e, max %e%s\n", velocity_error, total.velocity_max,
+            approximate ? " (approximate, not verified)" : "");
+      if (total.count > 0 || total.velocity_max > 0.0) {
+         size_t i;
+         printf("> ULP distance (x, y, z, vx, vy, vz):");
+         for (k = 0; k < CHECK_ULP_BUCKETS; k++) {
+            if (total.ulp[0][k] + total.ulp[1][k] + total.ulp[2][k] +
+                  total.ulp[3][k] + total.ulp[4][k] + total.ulp[5][k] == 0) continue;
+            printf(" %s%llu: %zu %zu %zu %zu %zu %zu,", k > 1 ? "<" : "", k > 1 ? 1ull << k : (unsigned long long)k,
+                  total.ulp[0][k], total.ulp[1][k], total.ulp[2][k], total.ulp[3][k], total.ulp[4][k], total.ulp[5][k]);
+         }
+         printf("\n> Differing blocks:");
+         for (i = 0, k = 0; i < n_blocks && k < 16; i++) {
+            if (args.bad_blocks[i]) printf(" %zu", i), k++;
+         }
+         printf("%s\n", k == 16 ? " ..." : "");
+      }
+   }
+
+   if (opts->check_report != NULL) {
+      check_report(opts->check_report, fname, nbody, &args, &total, checked, relative_error, percentiles, result);
+   }
+
+   free(total.errors);
+   free(args.bad_blocks);
+   free(args.stats);
+   assert(munmap((void *)particles, nbody->file.size) == 0);
+
+   if (result < 0) {
+      silent?:printf("> Relative error[%zu]: %f, velocity %e\n", total.count, relative_error, velocity_error);
+   } else if (result > 0) {
+      silent?:printf("> Result validation: OK\n");
+   }
+   return result;
+}
@@ -0,0 +1,234 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "nbody.h"
+
+extern int silent;
+
+#define CHECKPOINT_MAGIC "NBCKPT1"
+#define CHECKPOINT_SLOTS 2
+
+/* Every checkpoint file is this header followed by the particle blocks of one
+ * rank. Writes alternate between two slots, so a crash in the middle of one
+ * leaves the previous checkpoint intact. */
+typedef struct {
+   char     magic[8];
+   uint32_t block_size;
+   uint32_t num_blocks;
+   uint32_t rank;
+   uint32_t ranks;
+   int32_t  step;
+   int32_t  timesteps;
+   uint64_t checksum;
+} checkpoint_header_t;
+
+/* The compute threads only copy the particles into the staging buffer, the
+ * writer thread checksums and writes them in the background */
+static struct {
+   pthread_t           writer;
+   pthread_mutex_t     lock;
+   pthread_cond_t      cond;
+   int                 pending;
+   int                 quit;
+   int                 slot;
+   int                 written;
+   double              stalled;
+   particles_block_t   *staging;
+   size_t              size;
+   checkpoint_header_t header;
+   char                name[sizeof(((nbody_file_t *)0)->name)];
+} ckpt = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* FNV-1a over 64 bit words, the size is always a multiple of the page size */
+static uint64_t checkpoint_checksum(const void * data, const size_t size)
+{
+   const uint64_t * const words = data;
+   uint64_t hash = 14695981039346656037ULL;
+   size_t i;
+   for (i = 0; i < size/sizeof(uint64_t); i++) {
+      hash = (hash ^ words[i])*1099511628211ULL;
+   }
+   return hash;
+}
+
+/* <name>.<rank>.ckpt<slot>, the rank and the slot take at most 11 characters each */
+#define CHECKPOINT_FNAME_MAX (sizeof(ckpt.name) + 32)
+
+static void checkpoint_name(char * fname, const size_t len, const char * name, const int slot)
+{
+   const int n = snprintf(fname, len, "%s.%d.ckpt%d", name, nbody_comm_rank(), slot);
+   assert(n >= 0 && (size_t)n < len);
+}
+
+static int checkpoint_write_all(const int fd, const void * data, size_t size)
+{
+   const char * p = data;
+   while (size > 0) {
+      const ssize_t n = write(fd, p, size);
+      if (n <= 0) return -1;
+      p += n; size -= n;
+   }
+   return 0;
+}
+
+static void checkpoint_write(void)
+{
+   char fname[CHECKPOINT_FNAME_MAX], tmp[CHECKPOINT_FNAME_MAX + 4];
+   checkpoint_name(fname, sizeof(fname), ckpt.name, ckpt.slot);
+   snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+
+   ckpt.header.checksum = checkpoint_checksum(ckpt.staging, ckpt.size);
+
+   const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+   assert(fd >= 0);
+   assert(checkpoint_write_all(fd, &ckpt.header, sizeof(ckpt.header)) == 0);
+   assert(checkpoint_write_all(fd, ckpt.staging, ckpt.size) == 0);
+   assert(fsync(fd) == 0);
+   assert(close(fd) == 0);
+   assert(rename(tmp, fname) == 0);
+
+   ckpt.slot = (ckpt.slot + 1)%CHECKPOINT_SLOTS;
+   ckpt.written++;
+}
+
+static void * checkpoint_writer(void * arg)
+{
+   pthread_mutex_lock(&ckpt.lock);
+   for (;;) {
+      while (!ckpt.pending && !ckpt.quit) pthread_cond_wait(&ckpt.cond, &ckpt.lock);
+      if (!ckpt.pending) break;
+
+      pthread_mutex_unlock(&ckpt.lock);
+      checkpoint_write();
+      pthread_mutex_lock(&ckpt.lock);
+
+      ckpt.pending = 0;
+      pthread_cond_broadcast(&ckpt.cond);
+   }
+   pthread_mutex_unlock(&ckpt.lock);
+   return NULL;
+}
+
+void nbody_checkpoint_init(nbody_t * const nbody)
+{
+   ckpt.size    = nbody->num_particles*sizeof(particles_block_t);
+   ckpt.staging = nbody_alloc(ckpt.size);
+   ckpt.pending = 0;
+   ckpt.quit    = 0;
+   ckpt.slot    = 0;
+   ckpt.written = 0;
+   ckpt.stalled = 0.0;
+   snprintf(ckpt.name, sizeof(ckpt.name), "%s", nbody->file.name);
+   assert(pthread_create(&ckpt.writer, NULL, checkpoint_writer, NULL) == 0);
+}
+
+void nbody_checkpoint(nbody_t * const nbody, const int step)
+{
+   const double start = wall_time();
+
+   /* Only the previous checkpoint still being written can stall us */
+   pthread_mutex_lock(&ckpt.lock);
+   while (ckpt.pending) pthread_cond_wait(&ckpt.cond, &ckpt.lock);
+
+   memcpy(ckpt.staging, nbody->local, ckpt.size);
+   memcpy(ckpt.header.magic, CHECKPOINT_MAGIC, sizeof(ckpt.header.magic));
+   ckpt.header.block_size = BLOCK_SIZE;
+   ckpt.header.num_blocks = nbody->num_particles;
+   ckpt.header.rank       = nbody_comm_rank();
+   ckpt.header.ranks      = nbody_comm_size();
+   ckpt.header.step       = step;
+   ckpt.header.timesteps  = nbody->timesteps;
+   ckpt.pending = 1;
+
+   pthread_cond_broadcast(&ckpt.cond);
+   pthread_mutex_unlock(&ckpt.lock);
+
+   ckpt.stalled += wall_time() - start;
+}
+
+void nbody_checkpoint_fini(void)
+{
+   pthread_mutex_lock(&ckpt.lock);
+   ckpt.quit = 1;
+   pthread_cond_broadcast(&ckpt.cond);
+   pthread_mutex_unlock(&ckpt.lock);
+   assert(pthread_join(ckpt.writer, NULL) == 0);
+
+   silent?:printf("> Checkpoints written: %d, compute stalled (secs): %f\n", ckpt.written, ckpt.stalled);
+   nbody_dealloc(ckpt.staging, ckpt.size);
+}
+
+/* Reads a checkpoint slot into particles, returns its step or -1 if it is
+ * missing, belongs to another run or does not match its checksum */
+static int checkpoint_read(nbody_t * const nbody, const int slot, particles_block_t * const particles)
+{
+   char fname[CHECKPOINT_FNAME_MAX];
+   checkpoint_header_t header;
+   const size_t size = nbody->num_particles*sizeof(particles_block_t);
+
+   checkpoint_name(fname, sizeof(fname), nbody->file.name, slot);
+   const int fd = open(fname, O_RDONLY, 0);
+   if (fd < 0) return -1;
+
+   int step = -1;
+   if (read(fd, &header, sizeof(header)) == sizeof(header) &&
+         memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+         header.block_size == BLOCK_SIZE && header.num_blocks == (uint32_t)nbody->num_particles &&
+         header.rank == (uint32_t)nbody_comm_rank() && header.ranks == (uint32_t)nbody_comm_size() &&
+         header.timesteps == nbody->timesteps && header.step > 0 && header.step < nbody->timesteps &&
+         pread(fd, particles, size, sizeof(header)) == (ssize_t)size &&
+         checkpoint_checksum(particles, size) == header.checksum) {
+      step = header.step;
+   }
+   assert(close(fd) == 0);
+   return step;
+}
+
+int nbody_restart(nbody_t * const nbody)
+{
+   const size_t size = nbody->num_particles*sizeof(particles_block_t);
+   particles_block_t * const particles = nbody_alloc(size);
+   int steps[CHECKPOINT_SLOTS], slot, best = -1;
+
+   for (slot = 0; slot < CHECKPOINT_SLOTS; slot++) {
+      steps[slot] = checkpoint_read(nbody, slot, particles);
+      if (steps[slot] > 0 && (best < 0 || steps[slot] > steps[best])) best = slot;
+   }
+
+   /* All the ranks resume from the newest step every one of them has */
+   const int step = nbody_comm_min(best < 0 ? 0 : steps[best]);
+   for (slot = 0; step > 0 && slot < CHECKPOINT_SLOTS && steps[slot] != step; slot++);
+
+   if (step > 0) {
+      assert(slot < CHECKPOINT_SLOTS && checkpoint_read(nbody, slot, particles) == step);
+      memcpy(nbody->local, particles, size);
+      silent?:printf("> Restarting from the checkpoint of step %d\n", step);
+   } else {
+      silent?:printf("> No valid checkpoint found, starting from step 0\n");
+   }
+   nbody_dealloc(particles, size);
+   return step;
+}
@@ -0,0 +1,441 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef USE_MPI
+#  include <mpi.h>
+#endif
+#include "nbody.h"
+
+/* Rank layer for the distributed mode. With USE_MPI the ranks are the MPI ones,
+ * otherwise nbody_comm_init forks the requested number of processes, which talk
+ * through a shared anonymous mapping created before the fork: one slab sized
+ * mailbox per rank, guarded by a process shared mutex and condition.
+ *
+ * The shared waits are bounded: whenever one times out, rank 0 reaps the
+ * children that died and the others check that rank 0 is still their parent.
+ * A rank that dies before nbody_comm_fini aborts the whole run instead of
+ * leaving the others blocked on it.
+ *
+ * exchange_particles_start hands the ring shift to a progress thread, created
+ * on the first exchange and kept until nbody_comm_fini, which runs the blocking
+ * transfer while the caller computes; exchange_particles_wait waits for it to
+ * finish. Only the progress thread calls the transport while an exchange is in
+ * flight, so MPI_THREAD_SERIALIZED is enough. */
+
+static int comm_rank = 0, comm_size = 1;
+
+typedef struct {
+   const particles_block_t * sendbuf;
+   particles_block_t       * recvbuf;
+   size_t                    bytes;
+   int                       step;
+   int                       pending;  /* started and not waited for yet */
+   int                       posted;   /* handed to the progress thread */
+   int                       done;     /* transfer finished */
+   int                       running;  /* the progress thread exists */
+   int                       quit;
+   pthread_mutex_t           lock;
+   pthread_cond_t            cond;
+   pthread_t                 thread;
+} comm_exchange_t;
+
+static comm_exchange_t exchange = {
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+   .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void comm_progress_stop(void);
+
+#ifndef USE_MPI
+
+typedef struct {
+   pthread_mutex_t   lock;
+   pthread_cond_t    cond;
+   long              arrived;    /* ranks in the current barrier */
+   long              generation; /* barriers completed */
+   size_t            slab;       /* bytes of a mailbox */
+   pid_t             pids[256];
+   int               finished[256]; /* rank reached nbody_comm_fini */
+   double            values[256];
+   long              posted[256];   /* slabs published by each rank */
+   long              consumed[256]; /* slabs of each rank read by the next one */
+} comm_shared_t;
+
+static comm_shared_t * shared;
+static size_t          shared_size;
+static int             reaped[256];   /* children already waited for by rank 0 */
+static int             exits[256];    /* their wait status */
+
+/* Rank 0 kills the remaining children and exits, the others just exit */
+static void comm_abort(const int rank)
+{
+   int r;
+
+   if (comm_rank == 0) {
+      fprintf(stderr, "> Error: rank %d died, aborting the run\n", rank);
+      for (r = 1; r < comm_size; r++) {
+         if (!reaped[r]) kill(shared->pids[r], SIGKILL);
+      }
+      for (r = 1; r < comm_size; r++) {
+         if (!reaped[r]) waitpid(shared->pids[r], NULL, 0);
+      }
+   }
+   fflush(NULL);
+   _exit(1);
+}
+
+/* Called with the lock held after a wait timed out */
+static void comm_check(void)
+{
+   int r;
+
+   if (comm_rank != 0) {
+      if (getppid() != shared->pids[0]) comm_abort(0);
+      return;
+   }
+   for (r = 1; r < comm_size; r++) {
+      if (!reaped[r] && waitpid(shared->pids[r], &exits[r], WNOHANG) == shared->pids[r]) {
+         reaped[r] = 1;
+         if (!shared->finished[r]) comm_abort(r);
+      }
+   }
+}
+
+static void comm_lock(void)
+{
+   /* The owner died holding it, the checks below or rank 0 will end the run */
+   if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+      pthread_mutex_consistent(&shared->lock);
+      comm_check();
+   }
+}
+
+static void comm_unlock(void)
+{
+   pthread_mutex_unlock(&shared->lock);
+}
+
+/* Waits on the shared condition for at most a second, callers loop on their predicate */
+static void comm_wait(void)
+{
+   struct timespec deadline;
+   int err;
+
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_sec += 1;
+   err = pthread_cond_timedwait(&shared->cond, &shared->lock, &deadline);
+   if (err == EOWNERDEAD) pthread_mutex_consistent(&shared->lock);
+   if (err != 0) comm_check();
+}
+
+static char * comm_mailbox(const int rank)
+{
+   const size_t header = roundup(sizeof(comm_shared_t), (size_t)PAGE_SIZE);
+   return (char *)shared + header + rank*shared->slab;
+}
+
+static void comm_sendrecv(const void * sendbuf, void * recvbuf, const size_t bytes)
+{
+   const int prev = (comm_rank - 1 + comm_size)%comm_size;
+   long seq;
+
+   assert(bytes <= shared->slab);
+
+   /* Our previous slab has to be read by the next rank before overwriting it */
+   comm_lock();
+   while (shared->consumed[comm_rank] < shared->posted[comm_rank]) {
+      comm_wait();
+   }
+   seq = shared->posted[comm_rank] + 1;
+   comm_unlock();
+
+   memcpy(comm_mailbox(comm_rank), sendbuf, bytes);
+
+   comm_lock();
+   shared->posted[comm_rank] = seq;
+   pthread_cond_broadcast(&shared->cond);
+   while (shared->posted[prev] < seq) {
+      comm_wait();
+   }
+   comm_unlock();
+
+   memcpy(recvbuf, comm_mailbox(prev), bytes);
+
+   comm_lock();
+   shared->consumed[prev] = seq;
+   pthread_cond_broadcast(&shared->cond);
+   comm_unlock();
+}
+
+int nbody_comm_init(int * argc, char *** argv, const int ranks, const size_t slab)
+{
+   pthread_mutexattr_t mattr;
+   pthread_condattr_t cattr;
+   int r;
+
+   assert(ranks >= 1 && ranks <= 256);
+   comm_size = ranks;
+   if (ranks == 1) return 1;
+
+   shared_size = roundup(sizeof(comm_shared_t), (size_t)PAGE_SIZE) + ranks*slab;
+   shared = mmap(NULL, shared_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+   assert(shared != MAP_FAILED);
+   shared->slab = slab;
+
+   pthread_mutexattr_init(&mattr);
+   pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+   pthread_condattr_init(&cattr);
+   pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+   assert(pthread_mutex_init(&shared->lock, &mattr) == 0);
+   assert(pthread_cond_init(&shared->cond, &cattr) == 0);
+   shared->pids[0] = getpid();
+
+   /* Flush before forking so buffered output is not printed once per rank */
+   fflush(NULL);
+   for (r = 1; r < ranks; r++) {
+      const pid_t pid = fork();
+      assert(pid >= 0);
+      if (pid == 0) {
+         comm_rank = r;
+         break;
+      }
+      shared->pids[r] = pid;
+   }
+   return ranks;
+}
+
+void nbody_comm_barrier(void)
+{
+   long generation;
+
+   if (comm_size == 1) return;
+
+   comm_lock();
+   generation = shared->generation;
+   if (++shared->arrived == comm_size) {
+      shared->arrived = 0;
+      shared->generation++;
+      pthread_cond_broadcast(&shared->cond);
+   } else {
+      while (shared->generation == generation) {
+         comm_wait();
+      }
+   }
+   comm_unlock();
+}
+
+static double comm_reduce(const double value, const int op)
+{
+   double result = value;
+   int r;
+
+   if (comm_size == 1) return value;
+
+   shared->values[comm_rank] = value;
+   nbody_comm_barrier();
+   for (r = 0; r < comm_size; r++) {
+      const double v = shared->values[r];
+      if (r == 0) result = v;
+      else if (op == 0) result += v;
+      else if (op == 1) result = v > result ? v : result;
+      else result = v < result ? v : result;
+   }
+   nbody_comm_barrier();
+   return result;
+}
+
+double nbody_comm_sum(const double value) { return comm_reduce(value, 0); }
+double nbody_comm_max(const double value) { return comm_reduce(value, 1); }
+double nbody_comm_min(const double value) { return comm_reduce(value, 2); }
+
+int nbody_comm_fini(const int status)
+{
+   int r, result = status;
+
+   comm_progress_stop();
+   if (comm_size == 1) return status;
+
+   if (comm_rank != 0) {
+      shared->finished[comm_rank] = 1;
+      fflush(NULL);
+      _exit(status);
+   }
+
+   for (r = 1; r < comm_size; r++) {
+      if (!reaped[r]) {
+         assert(waitpid(shared->pids[r], &exits[r], 0) == shared->pids[r]);
+         reaped[r] = 1;
+      }
+      if (!WIFEXITED(exits[r]) || WEXITSTATUS(exits[r]) != 0) result = 1;
+   }
+   assert(munmap(shared, shared_size) == 0);
+   return result;
+}
+
+#else /* USE_MPI */
+
+static void comm_sendrecv(const void * sendbuf, void * recvbuf, const size_t bytes)
+{
+   const int next = (comm_rank + 1)%comm_size;
+   const int prev = (comm_rank - 1 + comm_size)%comm_size;
+   const int tag  = exchange.step;
+   size_t done;
+
+   /* Counts are ints, big slabs go in pieces */
+   for (done = 0; done < bytes; ) {
+      const int chunk = bytes - done > (1u << 30) ? (1 << 30) : (int)(bytes - done);
+      assert(MPI_Sendrecv((const char *)sendbuf + done, chunk, MPI_BYTE, next, tag,
+               (char *)recvbuf + done, chunk, MPI_BYTE, prev, tag,
+               MPI_COMM_WORLD, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+      done += chunk;
+   }
+}
+
+int nbody_comm_init(int * argc, char *** argv, const int ranks, const size_t slab)
+{
+   int provided;
+   assert(MPI_Init_thread(argc, argv, MPI_THREAD_SERIALIZED, &provided) == MPI_SUCCESS);
+   assert(provided >= MPI_THREAD_SERIALIZED);
+   assert(MPI_Comm_size(MPI_COMM_WORLD, &comm_size) == MPI_SUCCESS);
+   assert(MPI_Comm_rank(MPI_COMM_WORLD, &comm_rank) == MPI_SUCCESS);
+   return comm_size;
+}
+
+void nbody_comm_barrier(void)
+{
+   assert(MPI_Barrier(MPI_COMM_WORLD) == MPI_SUCCESS);
+}
+
+static double comm_reduce(const double value, MPI_Op op)
+{
+   double result;
+   assert(MPI_Allreduce(&value, &result, 1, MPI_DOUBLE, op, MPI_COMM_WORLD) == MPI_SUCCESS);
+   return result;
+}
+
+double nbody_comm_sum(const double value) { return comm_reduce(value, MPI_SUM); }
+double nbody_comm_max(const double value) { return comm_reduce(value, MPI_MAX); }
+double nbody_comm_min(const double value) { return comm_reduce(value, MPI_MIN); }
+
+int nbody_comm_fini(const int status)
+{
+   const int result = nbody_comm_max(status);
+   comm_progress_stop();
+   MPI_Finalize();
+   return result;
+}
+
+#endif /* USE_MPI */
+
+int nbody_comm_rank(void)
+{
+   return comm_rank;
+}
+
+int nbody_comm_size(void)
+{
+   return comm_size;
+}
+
+static void * comm_progress(void * arg)
+{
+   pthread_mutex_lock(&exchange.lock);
+   for (;;) {
+      while (!exchange.posted && !exchange.quit) {
+         pthread_cond_wait(&exchange.cond, &exchange.lock);
+      }
+      if (!exchange.posted) break;
+      pthread_mutex_unlock(&exchange.lock);
+
+      comm_sendrecv(exchange.sendbuf, exchange.recvbuf, exchange.bytes);
+
+      pthread_mutex_lock(&exchange.lock);
+      exchange.posted = 0;
+      exchange.done   = 1;
+      pthread_cond_broadcast(&exchange.cond);
+   }
+   pthread_mutex_unlock(&exchange.lock);
+   return NULL;
+}
+
+static void comm_progress_stop(void)
+{
+   if (!exchange.running) return;
+   assert(!exchange.pending);
+
+   pthread_mutex_lock(&exchange.lock);
+   exchange.quit = 1;
+   pthread_cond_broadcast(&exchange.cond);
+   pthread_mutex_unlock(&exchange.lock);
+   assert(pthread_join(exchange.thread, NULL) == 0);
+   exchange.running = 0;
+}
+
+/* Ring shift of step i: sendbuf goes to rank+1 and recvbuf gets the one of rank-1 */
+void exchange_particles_start(particles_block_t * const sendbuf, particles_block_t * recvbuf, const int n_blocks,
+                              const int rank, const int rank_size, const int i)
+{
+   assert(!exchange.pending);
+   assert(rank == comm_rank && rank_size == comm_size);
+
+   if (!exchange.running) {
+      assert(pthread_create(&exchange.thread, NULL, comm_progress, NULL) == 0);
+      exchange.running = 1;
+   }
+
+   pthread_mutex_lock(&exchange.lock);
+   exchange.sendbuf = sendbuf;
+   exchange.recvbuf = recvbuf;
+   exchange.bytes   = n_blocks*sizeof(particles_block_t);
+   exchange.step    = i;
+   exchange.posted  = 1;
+   exchange.done    = 0;
+   pthread_cond_broadcast(&exchange.cond);
+   pthread_mutex_unlock(&exchange.lock);
+   exchange.pending = 1;
+}
+
+void exchange_particles_wait(void)
+{
+   assert(exchange.pending);
+
+   pthread_mutex_lock(&exchange.lock);
+   while (!exchange.done) {
+      pthread_cond_wait(&exchange.cond, &exchange.lock);
+   }
+   pthread_mutex_unlock(&exchange.lock);
+   exchange.pending = 0;
+}
+
+void exchange_particles(particles_block_t * const sendbuf, particles_block_t * recvbuf, const int n_blocks,
+                        const int rank, const int rank_size, const int i)
+{
+   exchange_particles_start(sendbuf, recvbuf, n_blocks, rank, rank_size, i);
+   exchange_particles_wait();
+}
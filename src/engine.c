@@ -0,0 +1,236 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <assert.h>
+#include "engine.h"
+
+extern int silent;
+
+/* Default engine: the OmpSs@FPGA task graph in kernel_*.c */
+static double solve_nbody_ompss(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times)
+{
+   nbody_phase(NBODY_PHASE_FORCES);
+   solve_nbody_wrapper(nbody->local, nbody->remote, nbody->forces, nbody->num_particles, nbody->timesteps,
+         conf->time_interval, times);
+
+   const double n = (double)nbody->num_particles*BLOCK_SIZE;
+   return n*n*nbody->timesteps;
+}
+
+static const nbody_engine_t engines[] = {
+   { "ompss",     "OmpSs@FPGA tasks (" RUNTIME_MODE ")",                 solve_nbody_ompss,     0, 0, 0 },
+#ifdef NBODY_HOST_ENGINES
+   { "direct",    "multithreaded all-pairs host engine",                 solve_nbody_direct,    0, 0, 1 },
+   { "symmetric", "all-pairs host engine, each pair evaluated once",     solve_nbody_symmetric, 0, 0, 1 },
+   { "bh",        "Barnes-Hut octree host engine, O(N log N)",           solve_nbody_bh,        0, 1, 0 },
+   { "pm",        "particle-mesh (FFT Poisson) host engine",             solve_nbody_pm,        0, 1, 0 },
+   { "cutoff",    "short-range host engine, cell lists within a cutoff", solve_nbody_cutoff,    0, 1, 1 },
+   { "bins",      "all-pairs host engine, hierarchical timestep bins",   solve_nbody_bins,      0, 0, 1 },
+   { "ring",      "distributed all-pairs engine, ring of ranks",         solve_nbody_ring,      1, 0, 1 },
+#endif
+};
+
+static const int num_engines = sizeof(engines)/sizeof(engines[0]);
+
+const nbody_engine_t * nbody_find_engine(const char * name)
+{
+   int i;
+   for (i = 0; i < num_engines; i++) {
+      if (strcmp(engines[i].name, name) == 0) return &engines[i];
+   }
+   return NULL;
+}
+
+void nbody_list_engines(FILE * stream)
+{
+   int i;
+   for (i = 0; i < num_engines; i++) {
+      fprintf(stream, "    %-10s %s\n", engines[i].name, engines[i].description);
+   }
+}
+
+typedef struct {
+   const particles_block_t * particles;
+   size_t                    n;
+   float                  (* bounds)[6]; /* per thread min/max */
+} bounding_box_args_t;
+
+static void bounding_box_part(void * arg, const int tid, const int nthreads)
+{
+   const bounding_box_args_t * const args = arg;
+   float * const b = args->bounds[tid];
+   size_t begin, end;
+   int i, e0, e1, e;
+
+   b[0] = b[1] = b[2] = FLT_MAX;
+   b[3] = b[4] = b[5] = -FLT_MAX;
+
+   nbody_pool_range(args->n, 1, tid, nthreads, &begin, &end);
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      const particles_block_t * const block = args->particles + i;
+      for (e = e0; e < e1; e++) {
+         b[0] = fminf(b[0], block->position_x[e]); b[3] = fmaxf(b[3], block->position_x[e]);
+         b[1] = fminf(b[1], block->position_y[e]); b[4] = fmaxf(b[4], block->position_y[e]);
+         b[2] = fminf(b[2], block->position_z[e]); b[5] = fmaxf(b[5], block->position_z[e]);
+      }
+   }
+}
+
+void nbody_bounding_box(const particles_block_t * const particles, const size_t n, float * min, float * max)
+{
+   const int nthreads = nbody_pool_size();
+   bounding_box_args_t args = { particles, n, NULL };
+   int t, d;
+
+   args.bounds = malloc(nthreads*sizeof(*args.bounds));
+   assert(args.bounds != NULL);
+   nbody_pool_run(bounding_box_part, &args);
+
+   for (d = 0; d < 3; d++) {
+      min[d] = args.bounds[0][d];
+      max[d] = args.bounds[0][d + 3];
+      for (t = 1; t < nthreads; t++) {
+         min[d] = fminf(min[d], args.bounds[t][d]);
+         max[d] = fmaxf(max[d], args.bounds[t][d + 3]);
+      }
+   }
+   free(args.bounds);
+}
+
+typedef struct {
+   const particles_block_t * particles;
+   const force_block_t     * forces;
+   size_t                    n;
+   int                       samples;
+   double                  * error; /* per sample relative error */
+} force_error_args_t;
+
+static void force_error_samples(void * arg, const int tid, const int nthreads)
+{
+   const force_error_args_t * const args = arg;
+   size_t begin, end, s, k;
+
+   nbody_pool_range(args->samples, 1, tid, nthreads, &begin, &end);
+   for (s = begin; s < end; s++) {
+      const size_t p = s*args->n/args->samples;
+      const particles_block_t * const target = args->particles + p/BLOCK_SIZE;
+      const force_block_t * const forces = args->forces + p/BLOCK_SIZE;
+      const int e = p%BLOCK_SIZE;
+      double fx = 0.0, fy = 0.0, fz = 0.0;
+
+      for (k = 0; k < args->n; k++) {
+         const particles_block_t * const source = args->particles + k/BLOCK_SIZE;
+         const int j = k%BLOCK_SIZE;
+         const double diff_x = (double)source->position_x[j] - target->position_x[e];
+         const double diff_y = (double)source->position_y[j] - target->position_y[e];
+         const double diff_z = (double)source->position_z[j] - target->position_z[e];
+         const double distance_squared = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
+         if (distance_squared == 0.0) continue;
+
+         const double force = target->mass[e] / (distance_squared * sqrt(distance_squared)) * source->weight[j];
+         fx += force * diff_x;
+         fy += force * diff_y;
+         fz += force * diff_z;
+      }
+
+      const double dx = forces->x[e] - fx, dy = forces->y[e] - fy, dz = forces->z[e] - fz;
+      args->error[s] = sqrt((dx*dx + dy*dy + dz*dz)/(fx*fx + fy*fy + fz*fz));
+   }
+}
+
+/* Compares the forces computed by an approximate engine against a double precision
+ * direct sum for `samples` of the first `count` particles, the padding left out. Has to be
+ * called before the update, which clears the forces. */
+void nbody_force_error(const char * label, const particles_block_t * const particles,
+      const force_block_t * const forces, const size_t count, const int samples)
+{
+   force_error_args_t args = { particles, forces, count, samples, NULL };
+   double mean = 0.0, max = 0.0;
+   int s;
+
+   args.error = malloc(samples*sizeof(double));
+   assert(args.error != NULL);
+   nbody_phase(NBODY_PHASE_OTHER);
+   nbody_pool_run(force_error_samples, &args);
+
+   for (s = 0; s < samples; s++) {
+      mean += args.error[s];
+      max = args.error[s] > max ? args.error[s] : max;
+   }
+   mean /= samples;
+   free(args.error);
+
+   silent?:printf("> %s force error on %d samples: mean %e, max %e\n", label, samples, mean, max);
+}
+
+typedef struct {
+   const particles_block_t * particles;
+   size_t                    n;
+   double                  * energy; /* per thread */
+} energy_args_t;
+
+/* Kinetic plus potential energy, sum(m*v^2/2) - sum(i<j, G*m_i*m_j/r_ij), in double */
+static void energy_worker(void * arg, const int tid, const int nthreads)
+{
+   const energy_args_t * const args = arg;
+   const particles_block_t * const particles = args->particles;
+   const size_t n = args->n;
+   size_t p, q;
+   double energy = 0.0;
+
+   /* interleaved, the rows get shorter */
+   for (p = tid; p < n; p += nthreads) {
+      const particles_block_t * const a = particles + p/BLOCK_SIZE;
+      const size_t e = p%BLOCK_SIZE;
+      const double vx = a->velocity_x[e], vy = a->velocity_y[e], vz = a->velocity_z[e];
+      double potential = 0.0;
+
+      for (q = p + 1; q < n; q++) {
+         const particles_block_t * const b = particles + q/BLOCK_SIZE;
+         const size_t f = q%BLOCK_SIZE;
+         const double dx = (double)b->position_x[f] - a->position_x[e];
+         const double dy = (double)b->position_y[f] - a->position_y[e];
+         const double dz = (double)b->position_z[f] - a->position_z[e];
+         const double distance = sqrt(dx*dx + dy*dy + dz*dz);
+         if (distance > 0.0) potential += b->weight[f]/distance;
+      }
+      energy += 0.5*a->mass[e]*(vx*vx + vy*vy + vz*vz) - a->mass[e]*potential;
+   }
+   args->energy[tid] = energy;
+}
+
+double nbody_energy(const nbody_t * const nbody, const int threads)
+{
+   energy_args_t args = { nbody->local, nbody->count, calloc(threads, sizeof(double)) };
+   double energy = 0.0;
+   int t;
+
+   assert(args.energy != NULL);
+
+   nbody_pool_init(threads);
+   nbody_pool_run(energy_worker, &args);
+   for (t = 0; t < nbody_pool_size(); t++) energy += args.energy[t];
+   nbody_pool_fini();
+
+   free(args.energy);
+   return energy;
+}
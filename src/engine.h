@@ -0,0 +1,357 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef engine_h
+#define engine_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include "nbody.h"
+
+/* Host solvers. Each one advances nbody->local for nbody->timesteps steps, fills
+ * times[4] like solve_nbody_wrapper does (start, warm up, execution, flush) and
+ * returns the number of pair interactions it evaluated. */
+typedef double (*nbody_solve_t)(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times);
+
+typedef struct {
+   const char*   name;
+   const char*   description;
+   nbody_solve_t solve;
+   int           distributed; /* supports several ranks */
+   int           approximate; /* does not converge to the all-pairs sum, not verified */
+   int           simd;        /* runs the host kernels picked by nbody_simd_select */
+} nbody_engine_t;
+
+const nbody_engine_t * nbody_find_engine(const char * name);
+void nbody_list_engines(FILE * stream);
+void nbody_bounding_box(const particles_block_t * const particles, const size_t n, float * min, float * max);
+void nbody_force_error(const char * label, const particles_block_t * const particles,
+      const force_block_t * const forces, const size_t count, const int samples);
+double nbody_energy(const nbody_t * const nbody, const int threads);
+
+/* engine_direct.c */
+double solve_nbody_direct(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times);
+double solve_nbody_symmetric(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times);
+/* Parallel update_particles of the first count particles on the pool, usable by any engine */
+void host_update_particles(particles_block_t * const particles, force_block_t * const forces,
+      const int n_blocks, const size_t count, const float time_interval);
+/* Parallel all-pairs forces of the first count particles on the pool, added to forces */
+void host_forces(particles_block_t * const particles, force_block_t * const forces, const int n_blocks,
+      const size_t count);
+/* Schedule of the all-pairs forces: slice or tiled (cache blocked), -1 on bad names */
+int  nbody_schedule_select(const char * name);
+
+/* integrator.c */
+#define NBODY_INTEGRATOR_EULER    0
+#define NBODY_INTEGRATOR_LEAPFROG 1
+#define NBODY_INTEGRATOR_HERMITE  2
+
+/* Returns the NBODY_INTEGRATOR_* of name or -1 */
+int nbody_integrator_find(const char * name);
+/* Direct engine solvers with the other integrators, picked by solve_nbody_direct */
+double solve_nbody_leapfrog(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times);
+double solve_nbody_hermite(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times);
+
+/* engine_bh.c */
+/* Above 2/sqrt(3) the opening radius of a cell, size/theta, no longer covers the
+ * half diagonal of the cell and a target could accept the cell it is in */
+#define NBODY_BH_THETA_MAX 1.1547005f
+double solve_nbody_bh(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times);
+
+/* simd.c */
+typedef void (*nbody_forces_fn_t)(force_block_t * __restrict__ const forces,
+      const particles_block_t * __restrict__ const target, const particles_block_t * __restrict__ const source,
+      const int e0, const int e1, const int s1);
+
+typedef void (*nbody_sym_fn_t)(force_block_t * const fi, force_block_t * const fj,
+      const particles_block_t * const bi, const particles_block_t * const bj, const int diagonal);
+
+/* Force kernels picked by nbody_simd_select: a [e0, e1) target slice against the
+ * [0, s1) particles of a source block, and the symmetric one for the bi/bj block
+ * pair (bi == bj with diagonal set) which updates both fi and fj */
+extern nbody_forces_fn_t nbody_forces_slice;
+extern nbody_sym_fn_t    nbody_forces_sym;
+
+typedef void (*nbody_hermite_fn_t)(force_block_t * __restrict__ const acc, force_block_t * __restrict__ const jerk,
+      const particles_block_t * __restrict__ const target, const particles_block_t * __restrict__ const source,
+      const int e0, const int e1, const int s1);
+
+/* Acceleration and jerk of a [e0, e1) target slice against the [0, s1) particles
+ * of a source block, for the hermite integrator */
+extern nbody_hermite_fn_t nbody_hermite_slice;
+
+/* Particles packed cell after cell by the cutoff engine, each field an array of
+ * every particle so that a cell, and a row of neighbor cells, is contiguous */
+typedef struct {
+   float * position_x;
+   float * position_y;
+   float * position_z;
+   float * weight;
+   float * mass;
+   float * force_x;
+   float * force_y;
+   float * force_z;
+} cell_particles_t;
+
+typedef void (*nbody_cutoff_fn_t)(cell_particles_t * const cells, const int t0, const int t1,
+      const int s0, const int s1, const float cutoff_squared);
+
+/* Forces of the packed [t0, t1) targets from the packed [s0, s1) sources closer
+ * than the cutoff, added to the packed forces */
+extern nbody_cutoff_fn_t nbody_cutoff_slice;
+
+/* tile is the source block size of the SIMD kernels, 0 picks it from the L1 size */
+int  nbody_simd_select(const char * isa, const int newton, const int tile);
+void nbody_simd_describe(char * buf, const size_t len);
+/* ISA of the kernels picked by nbody_simd_select */
+const char * nbody_simd_isa(void);
+
+/* ensemble.c */
+/* Runs the independent systems listed in fname in one process and reports them */
+int nbody_ensemble(const char * fname, const nbody_opts_t * const opts);
+
+/* engine_cutoff.c */
+double solve_nbody_cutoff(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times);
+
+/* engine_bins.c */
+double solve_nbody_bins(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times);
+
+/* engine_pm.c */
+double solve_nbody_pm(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times);
+
+/* engine_ring.c */
+double solve_nbody_ring(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times);
+
+/* precision.c */
+#define NBODY_PRECISION_FP32  0
+#define NBODY_PRECISION_BF16  1
+#define NBODY_PRECISION_FP16  2
+#define NBODY_PRECISION_INT16 3
+
+/* Source side of a block (position and weight) as 16 bit codes, each field
+ * decodes as offset + scale*code in the block's precision */
+typedef struct {
+   uint16_t position_x[NBODY_BLOCK_SIZE];
+   uint16_t position_y[NBODY_BLOCK_SIZE];
+   uint16_t position_z[NBODY_BLOCK_SIZE];
+   uint16_t weight[NBODY_BLOCK_SIZE];
+   float    offset[4];
+   float    scale[4];
+} source_block_t;
+
+/* Returns the NBODY_PRECISION_* of name or -1 */
+int  nbody_precision_find(const char * name);
+const char * nbody_precision_name(const int precision);
+/* Packs the source fields of the blocks in parallel on the pool */
+void nbody_pack_sources(source_block_t * const packed, const particles_block_t * const particles,
+      const int n_blocks, const int precision);
+/* Expands a packed block to fp32 positions and weights, other fields are untouched */
+void nbody_unpack_source(particles_block_t * const block, const source_block_t * const packed,
+      const int precision);
+
+/* reorder.c */
+#define NBODY_CURVE_MORTON  0
+#define NBODY_CURVE_HILBERT 1
+
+/* Returns the NBODY_CURVE_* of name or -1 */
+int nbody_curve_find(const char * name);
+/* Key of a position quantized to 21 bits per axis, its place along the curve */
+uint64_t nbody_curve_key(const int curve, uint32_t x, uint32_t y, uint32_t z);
+/* Stable LSD radix sort of n keys carrying their indexes on the pool, 8 bits a
+ * pass. Passes swap the arrays with the tmp ones, the result is left in keys
+ * and index. */
+void nbody_radix_sort(uint64_t ** keys, uint32_t ** index, uint64_t ** keys_tmp, uint32_t ** index_tmp,
+      const size_t n);
+
+/* Particle reordering of the driver every opts->reorder timesteps. nbody_reorder
+ * sorts the particles along opts->curve, or without sort goes back to the order
+ * of the last sort after nbody_reorder_restore put them in their original order
+ * to write them out. nbody_reorder_fini restores them and reports. */
+void nbody_reorder_init(nbody_t * const nbody, const nbody_opts_t * const opts);
+void nbody_reorder(nbody_t * const nbody, const int threads, const int sort);
+void nbody_reorder_restore(nbody_t * const nbody, const int threads);
+void nbody_reorder_fini(nbody_t * const nbody, const nbody_opts_t * const opts, const double execution);
+
+/* profile.c */
+#define NBODY_PHASE_OTHER  0
+#define NBODY_PHASE_FORCES 1
+#define NBODY_PHASE_UPDATE 2
+#define NBODY_PHASE_BUILD  3   /* trees, grids, sorts and packing of the engines */
+#define NBODY_PHASE_COMM   4
+#define NBODY_PHASE_IO     5   /* checkpoints, trajectories and reordering */
+#define NBODY_PHASES       6
+
+/* Operations of the exact kernel per pair */
+#define NBODY_FLOPS_PER_PAIR 18
+
+extern int nbody_profiling;
+
+/* Starts charging the wall time, and the perf counters with counters set, to
+ * phases and steps */
+void nbody_profile_init(const int counters);
+void nbody_profile_switch(const int phase);
+void nbody_profile_step(void);
+/* The next timestep starts now, not at the last nbody_step */
+void nbody_profile_step_start(void);
+/* Pool hooks: the slots for nthreads before starting them (1 once they are done)
+ * and the counters of a new thread */
+void nbody_profile_pool(const int nthreads);
+void nbody_profile_thread(const int tid);
+/* Writes the JSON report to fname and stops profiling */
+void nbody_profile_report(const char * fname, const char * engine, const size_t particles, const int threads,
+      const double pairs);
+
+/* Everything until the next mark belongs to phase */
+static inline void nbody_phase(const int phase)
+{
+   if (nbody_profiling) nbody_profile_switch(phase);
+}
+
+/* Marks the end of a timestep */
+static inline void nbody_step(void)
+{
+   if (nbody_profiling) nbody_profile_step();
+}
+
+/* tune.c */
+#define NBODY_TUNE_FILE    "nbody.tune"
+
+/* Options given on the command line, a saved configuration does not override them */
+#define NBODY_TUNE_THREADS 1
+#define NBODY_TUNE_ISA     2
+#define NBODY_TUNE_TILE    4
+
+/* Sweeps threads, kernel ISA and tile size with the engine, writes prefix.csv
+ * and prefix.json and saves the fastest valid configuration to NBODY_TUNE_FILE */
+int nbody_tune(const nbody_engine_t * const engine, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, const char * prefix);
+/* Applies the saved configuration of the engine to the options not given */
+int nbody_tune_load(const char * engine, nbody_opts_t * const opts, const int given);
+
+/* pool.c */
+typedef void (*nbody_pool_fn_t)(void * arg, const int tid, const int nthreads);
+
+/* Pins the threads of the pools started afterwards to the CPUs, in order */
+void nbody_pool_pin(const int pin);
+void nbody_pool_init(const int nthreads);
+void nbody_pool_run(nbody_pool_fn_t fn, void * arg);
+void nbody_pool_barrier(void);
+int  nbody_pool_size(void);
+void nbody_pool_fini(void);
+
+/* Splits [0, n) into nthreads contiguous chunks whose bounds are multiples of align */
+static inline void nbody_pool_range(const size_t n, const size_t align, const int tid, const int nthreads,
+      size_t * begin, size_t * end)
+{
+   const size_t units = (n + align - 1)/align;
+   *begin = (units*tid/nthreads)*align;
+   *end   = (units*(tid + 1)/nthreads)*align;
+   if (*begin > n) *begin = n;
+   if (*end   > n) *end   = n;
+}
+
+/* Walks a [*p, end) particle range one block slice [e0, e1) of block i at a time */
+static inline int nbody_next_slice(size_t * p, const size_t end, int * i, int * e0, int * e1)
+{
+   if (*p >= end) return 0;
+   *i  = *p/BLOCK_SIZE;
+   *e0 = *p%BLOCK_SIZE;
+   *e1 = end - (size_t)*i*BLOCK_SIZE < BLOCK_SIZE ? end - (size_t)*i*BLOCK_SIZE : BLOCK_SIZE;
+   *p  = (size_t)*i*BLOCK_SIZE + *e1;
+   return 1;
+}
+
+/* Particles of block i among the first count ones, the padding is at the end of the last block */
+static inline int nbody_block_count(const size_t count, const int i)
+{
+   const size_t first = (size_t)i*BLOCK_SIZE;
+   return count <= first ? 0 : count - first < BLOCK_SIZE ? (int)(count - first) : (int)BLOCK_SIZE;
+}
+
+/* Host versions of calculate_forces_part and update_particles_BLOCK working on a
+ * [e0, e1) slice of a block. Same arithmetic as the kernels, so results match. */
+static inline void host_forces_slice(force_block_t * __restrict__ const forces,
+      const particles_block_t * __restrict__ const target, const particles_block_t * __restrict__ const source,
+      const int e0, const int e1, const int s1)
+{
+   int e, j;
+   for (j = 0; j < s1; j++) {
+      const float pos_x2  = source->position_x[j];
+      const float pos_y2  = source->position_y[j];
+      const float pos_z2  = source->position_z[j];
+      const float weight2 = source->weight[j];
+
+      for (e = e0; e < e1; e++) {
+         const float diff_x = pos_x2 - target->position_x[e];
+         const float diff_y = pos_y2 - target->position_y[e];
+         const float diff_z = pos_z2 - target->position_z[e];
+
+         const float distance_squared = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
+         const float distance = sqrtf(distance_squared);
+
+         const float force = target->mass[e] / (distance_squared * distance) * weight2;
+         const float force_corrected = distance_squared == 0.0f ? 0.0f : force;
+
+         forces->x[e] += force_corrected * diff_x;
+         forces->y[e] += force_corrected * diff_y;
+         forces->z[e] += force_corrected * diff_z;
+      }
+   }
+}
+
+static inline void host_update_slice(particles_block_t * __restrict__ const part,
+      force_block_t * __restrict__ const forces, const int e0, const int e1, const float time_interval)
+{
+   int e;
+   for (e = e0; e < e1; e++) {
+      const float time_by_mass       = time_interval / part->mass[e];
+      const float half_time_interval = 0.5f * time_interval;
+
+      const float velocity_change_x = forces->x[e] * time_by_mass;
+      const float velocity_change_y = forces->y[e] * time_by_mass;
+      const float velocity_change_z = forces->z[e] * time_by_mass;
+
+      const float position_change_x = part->velocity_x[e] + velocity_change_x * half_time_interval;
+      const float position_change_y = part->velocity_y[e] + velocity_change_y * half_time_interval;
+      const float position_change_z = part->velocity_z[e] + velocity_change_z * half_time_interval;
+
+      part->velocity_x[e] += velocity_change_x;
+      part->velocity_y[e] += velocity_change_y;
+      part->velocity_z[e] += velocity_change_z;
+
+      part->position_x[e] += position_change_x;
+      part->position_y[e] += position_change_y;
+      part->position_z[e] += position_change_z;
+
+      forces->x[e] = 0.0f;
+      forces->y[e] = 0.0f;
+      forces->z[e] = 0.0f;
+   }
+}
+
+#endif /* #ifndef engine_h */
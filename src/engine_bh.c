@@ -0,0 +1,338 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <assert.h>
+#include "engine.h"
+
+/* Barnes-Hut engine. Every timestep the particles are sorted by the Morton key of
+ * their position inside the bounding cube, which makes every octree cell a
+ * contiguous range of the sorted order, and the tree is built depth first so that
+ * it can be walked without a stack: a node is followed by its children and
+ * `next` skips its whole subtree. Cells are accepted as a single source when the
+ * target is farther than size/theta from the cell plus the offset between the
+ * center of mass and the geometric center. A target inside the cell is at most
+ * sqrt(3)/2*size from the center, plus the same offset from the center of mass,
+ * so it never accepts its own cell as long as theta < 2/sqrt(3). */
+
+static const int BH_LEAF_SIZE  = 16;
+static const int BH_MAX_LEVEL  = 21;   /* 3*21 bits of Morton key */
+static const int BH_CHUNK      = 256;  /* sorted targets taken by a thread at a time */
+
+typedef struct {
+   float x, y, z;       /* center of mass */
+   float weight;        /* sum of weights */
+   float open2;         /* squared opening radius */
+   int   begin, end;    /* sorted particle range */
+   int   next;          /* first node after the subtree */
+   int   leaf;
+} bh_node_t;
+
+typedef struct {
+   particles_block_t * particles;
+   force_block_t     * forces;
+   size_t              n;
+   float               theta;
+
+   uint64_t * keys, * keys_tmp;
+   uint32_t * index, * index_tmp;
+   float * pos_x, * pos_y, * pos_z, * weight; /* sorted copies */
+
+   bh_node_t * nodes;
+   int         num_nodes, max_nodes;
+
+   float  min_x, min_y, min_z, size;
+   double * pairs;                            /* per thread interactions, summed at the end */
+   int    next_chunk;
+} bh_tree_t;
+
+static inline void bh_particle(const bh_tree_t * const tree, const size_t p,
+      const particles_block_t ** const block, int * const e)
+{
+   *block = tree->particles + p/BLOCK_SIZE;
+   *e     = p%BLOCK_SIZE;
+}
+
+static void bh_keys(void * arg, const int tid, const int nthreads)
+{
+   bh_tree_t * const tree = arg;
+   const float scale = (float)(1 << BH_MAX_LEVEL)/tree->size;
+   const uint64_t max = (1 << BH_MAX_LEVEL) - 1;
+   size_t begin, end, p;
+
+   nbody_pool_range(tree->n, 1, tid, nthreads, &begin, &end);
+   for (p = begin; p < end; p++) {
+      const particles_block_t * block;
+      int e;
+      bh_particle(tree, p, &block, &e);
+
+      uint64_t ix = (block->position_x[e] - tree->min_x)*scale;
+      uint64_t iy = (block->position_y[e] - tree->min_y)*scale;
+      uint64_t iz = (block->position_z[e] - tree->min_z)*scale;
+      ix = ix > max ? max : ix;
+      iy = iy > max ? max : iy;
+      iz = iz > max ? max : iz;
+
+      tree->keys[p]  = nbody_curve_key(NBODY_CURVE_MORTON, ix, iy, iz);
+      tree->index[p] = p;
+   }
+}
+
+static void bh_gather(void * arg, const int tid, const int nthreads)
+{
+   bh_tree_t * const tree = arg;
+   size_t begin, end, s;
+
+   nbody_pool_range(tree->n, 1, tid, nthreads, &begin, &end);
+   for (s = begin; s < end; s++) {
+      const particles_block_t * block;
+      int e;
+      bh_particle(tree, tree->index[s], &block, &e);
+      tree->pos_x[s]  = block->position_x[e];
+      tree->pos_y[s]  = block->position_y[e];
+      tree->pos_z[s]  = block->position_z[e];
+      tree->weight[s] = block->weight[e];
+   }
+}
+
+static int bh_new_node(bh_tree_t * const tree)
+{
+   if (tree->num_nodes == tree->max_nodes) {
+      tree->max_nodes *= 2;
+      tree->nodes = realloc(tree->nodes, tree->max_nodes*sizeof(bh_node_t));
+      assert(tree->nodes != NULL);
+   }
+   return tree->num_nodes++;
+}
+
+/* Builds the node for the sorted range [begin, end) of a cell at the given level
+ * and returns its index. Children are the sub-ranges sharing the next 3 key bits. */
+static int bh_build(bh_tree_t * const tree, const int begin, const int end, const int level,
+      const float cx, const float cy, const float cz, const float size)
+{
+   const int id = bh_new_node(tree);
+   bh_node_t node = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, begin, end, 0, 0 };
+   double x = 0.0, y = 0.0, z = 0.0, w = 0.0;
+   int s;
+
+   if (end - begin <= BH_LEAF_SIZE || level == BH_MAX_LEVEL) {
+      for (s = begin; s < end; s++) {
+         x += (double)tree->pos_x[s]*tree->weight[s];
+         y += (double)tree->pos_y[s]*tree->weight[s];
+         z += (double)tree->pos_z[s]*tree->weight[s];
+         w += tree->weight[s];
+      }
+      node.leaf = 1;
+   } else {
+      const int shift = 3*(BH_MAX_LEVEL - 1 - level);
+      const float half = 0.5f*size;
+      int first = begin;
+      while (first < end) {
+         const int octant = (tree->keys[first] >> shift) & 7;
+         int last = first;
+         while (last < end && (int)((tree->keys[last] >> shift) & 7) == octant) last++;
+
+         const int child = bh_build(tree, first, last, level + 1,
+               cx + ((octant & 4) ? 0.25f : -0.25f)*size,
+               cy + ((octant & 2) ? 0.25f : -0.25f)*size,
+               cz + ((octant & 1) ? 0.25f : -0.25f)*size, half);
+         const bh_node_t * const c = &tree->nodes[child];
+         x += (double)c->x*c->weight;
+         y += (double)c->y*c->weight;
+         z += (double)c->z*c->weight;
+         w += c->weight;
+         first = last;
+      }
+   }
+
+   if (w > 0.0) {
+      node.x = x/w;
+      node.y = y/w;
+      node.z = z/w;
+   } else {
+      node.x = cx;
+      node.y = cy;
+      node.z = cz;
+   }
+   node.weight = w;
+
+   const float off_x = node.x - cx, off_y = node.y - cy, off_z = node.z - cz;
+   const float radius = size/tree->theta + sqrtf(off_x*off_x + off_y*off_y + off_z*off_z);
+   node.open2 = radius*radius;
+   node.next  = tree->num_nodes;
+
+   tree->nodes[id] = node;
+   return id;
+}
+
+static void bh_forces(void * arg, const int tid, const int nthreads)
+{
+   bh_tree_t * const tree = arg;
+   const bh_node_t * const nodes = tree->nodes;
+   const int num_nodes = tree->num_nodes;
+   double pairs = 0.0;
+   int chunk;
+
+   while ((chunk = __atomic_fetch_add(&tree->next_chunk, BH_CHUNK, __ATOMIC_RELAXED)) < (int)tree->n) {
+      const int chunk_end = chunk + BH_CHUNK < (int)tree->n ? chunk + BH_CHUNK : (int)tree->n;
+      int s;
+
+      for (s = chunk; s < chunk_end; s++) {
+         const size_t p = tree->index[s];
+         force_block_t * const forces = tree->forces + p/BLOCK_SIZE;
+         const int e = p%BLOCK_SIZE;
+         const float pos_x1 = tree->pos_x[s];
+         const float pos_y1 = tree->pos_y[s];
+         const float pos_z1 = tree->pos_z[s];
+         const float mass1  = tree->particles[p/BLOCK_SIZE].mass[e];
+         float fx = 0.0f, fy = 0.0f, fz = 0.0f;
+         int i = 0, k;
+
+         while (i < num_nodes) {
+            const bh_node_t * const node = &nodes[i];
+            const float diff_x = node->x - pos_x1;
+            const float diff_y = node->y - pos_y1;
+            const float diff_z = node->z - pos_z1;
+            const float distance_squared = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
+
+            if (distance_squared > node->open2) {
+               const float distance = sqrtf(distance_squared);
+               const float force = mass1 / (distance_squared * distance) * node->weight;
+               fx += force * diff_x;
+               fy += force * diff_y;
+               fz += force * diff_z;
+               pairs += 1.0;
+               i = node->next;
+            } else if (node->leaf) {
+               for (k = node->begin; k < node->end; k++) {
+                  const float dx = tree->pos_x[k] - pos_x1;
+                  const float dy = tree->pos_y[k] - pos_y1;
+                  const float dz = tree->pos_z[k] - pos_z1;
+                  const float d2 = dx * dx + dy * dy + dz * dz;
+                  const float force = mass1 / (d2 * sqrtf(d2)) * tree->weight[k];
+                  const float force_corrected = d2 == 0.0f ? 0.0f : force;
+                  fx += force_corrected * dx;
+                  fy += force_corrected * dy;
+                  fz += force_corrected * dz;
+               }
+               pairs += node->end - node->begin;
+               i = node->next;
+            } else {
+               i++;
+            }
+         }
+
+         forces->x[e] += fx;
+         forces->y[e] += fy;
+         forces->z[e] += fz;
+      }
+   }
+
+   tree->pairs[tid] += pairs;
+}
+
+static void bh_compute_forces(bh_tree_t * const tree)
+{
+   float min[3], max[3];
+
+   nbody_phase(NBODY_PHASE_BUILD);
+   nbody_bounding_box(tree->particles, tree->n, min, max);
+   tree->min_x = min[0];
+   tree->min_y = min[1];
+   tree->min_z = min[2];
+   tree->size  = fmaxf(max[0] - min[0], fmaxf(max[1] - min[1], max[2] - min[2]));
+   tree->size  = tree->size > 0.0f ? tree->size*(1.0f + FLT_EPSILON) : 1.0f;
+
+   nbody_pool_run(bh_keys, tree);
+   nbody_radix_sort(&tree->keys, &tree->index, &tree->keys_tmp, &tree->index_tmp, tree->n);
+   nbody_pool_run(bh_gather, tree);
+
+   tree->num_nodes = 0;
+   bh_build(tree, 0, tree->n, 0, tree->min_x + 0.5f*tree->size, tree->min_y + 0.5f*tree->size,
+         tree->min_z + 0.5f*tree->size, tree->size);
+
+   tree->next_chunk = 0;
+   nbody_phase(NBODY_PHASE_FORCES);
+   nbody_pool_run(bh_forces, tree);
+}
+
+double solve_nbody_bh(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times)
+{
+   const size_t n = (size_t)nbody->num_particles*BLOCK_SIZE;
+   bh_tree_t tree;
+   double pairs = 0.0;
+   int t;
+
+   assert(opts->theta > 0.0f && opts->theta < NBODY_BH_THETA_MAX);
+
+   times[0] = wall_time();
+   nbody_pool_init(opts->threads);
+
+   memset(&tree, 0, sizeof(tree));
+   tree.particles = nbody->local;
+   tree.forces    = nbody->forces;
+   tree.n         = nbody->count;
+   tree.theta     = opts->theta;
+   tree.keys      = malloc(n*sizeof(uint64_t));
+   tree.keys_tmp  = malloc(n*sizeof(uint64_t));
+   tree.index     = malloc(n*sizeof(uint32_t));
+   tree.index_tmp = malloc(n*sizeof(uint32_t));
+   tree.pos_x     = malloc(n*sizeof(float));
+   tree.pos_y     = malloc(n*sizeof(float));
+   tree.pos_z     = malloc(n*sizeof(float));
+   tree.weight    = malloc(n*sizeof(float));
+   tree.max_nodes = 2*n/BH_LEAF_SIZE + 1;
+   tree.nodes     = malloc(tree.max_nodes*sizeof(bh_node_t));
+   tree.pairs     = calloc(opts->threads, sizeof(double));
+   assert(tree.keys && tree.keys_tmp && tree.index && tree.index_tmp && tree.nodes);
+   assert(tree.pairs != NULL);
+   assert(tree.pos_x && tree.pos_y && tree.pos_z && tree.weight);
+
+   if (opts->samples > 0) {
+      char label[64];
+      sprintf(label, "Barnes-Hut (theta %g)", opts->theta);
+      bh_compute_forces(&tree);
+      nbody_force_error(label, nbody->local, nbody->forces, nbody->count, opts->samples);
+      memset(nbody->forces, 0, nbody->num_particles*sizeof(force_block_t));
+      memset(tree.pairs, 0, opts->threads*sizeof(double));
+   }
+   times[1] = wall_time();
+
+   for (t = 0; t < nbody->timesteps; t++) {
+      bh_compute_forces(&tree);
+      host_update_particles(nbody->local, nbody->forces, nbody->num_particles, nbody->count, conf->time_interval);
+      nbody_step();
+   }
+   times[2] = wall_time();
+
+   for (t = 0; t < opts->threads; t++) pairs += tree.pairs[t];
+
+   free(tree.keys);  free(tree.keys_tmp);
+   free(tree.index); free(tree.index_tmp);
+   free(tree.pos_x); free(tree.pos_y); free(tree.pos_z); free(tree.weight);
+   free(tree.nodes);
+   free(tree.pairs);
+   nbody_pool_fini();
+   times[3] = wall_time();
+
+   return pairs;
+}
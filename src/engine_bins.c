@@ -0,0 +1,304 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <sys/mman.h>
+#include "engine.h"
+
+extern int silent;
+
+/* All-pairs engine with hierarchical (block) timesteps. Particles sit in power of
+ * two bins, bin k advancing with time_interval/2^k, so a timestep is split into
+ * 2^(bins-1) substeps and a particle in bin k is active every 2^(bins-1-k) of
+ * them. On a substep the active particles are advanced with the force of their
+ * last evaluation, gathered into dense target blocks and get their new force from
+ * every particle, the inactive ones predicted to the same time. Their new bin comes
+ * from the change of the force, dt = eta*|F|/|dF/dt|, and may only get coarser
+ * when the substep is aligned with it. Every particle starts a run in bin 0, the
+ * global time_interval. Particles drift with the kick-drift x += (v + dv/2)*dt of
+ * their own step, not with the v + dv*dt/2 of update_particles_BLOCK, so even with
+ * one bin the positions differ from direct: in the last bits at time_interval 1,
+ * altogether at other ones.
+ *
+ * At the end of a solve every particle has been advanced to the last substep, so
+ * a run split in chunks only has to carry the bins, the forces of the last
+ * evaluations and the report from one chunk to the next, and is then bit-exact
+ * with a whole one. They live in bins_kept while opts->suspend is set. */
+
+typedef struct {
+   particles_block_t * particles;
+   force_block_t     * forces;      /* force of the last evaluation of each particle */
+   int                 n_blocks;
+   size_t              count;       /* real particles, the padding is never active */
+   int                 bins;
+   float               eta;
+   float               dt_min;      /* time_interval/2^(bins-1) */
+   int               * t0;          /* substep of the last evaluation */
+   int               * next;        /* substep of the next evaluation */
+   unsigned char     * bin;
+   uint32_t          * active;      /* active particles of the substep, in order */
+   size_t              n_active;
+   int                 now;         /* current substep */
+   int                 resumed;     /* substep 0 goes on from the last one of the previous chunk */
+   particles_block_t * sources;     /* positions predicted to now and weights */
+   particles_block_t * targets;     /* active particles, dense */
+   force_block_t     * target_forces;
+   double            * bin_evals;   /* force evaluations per bin */
+} bins_t;
+
+/* State of a run split in chunks, between them */
+static struct {
+   unsigned char * bin;
+   force_block_t * forces;
+   double        * bin_evals;
+   double          timesteps;   /* of the previous chunks */
+   int             silent;      /* of the first chunk, which would report */
+} bins_kept;
+
+#define P(blocks, field, i) ((blocks)[(i)/BLOCK_SIZE].field[(i)%BLOCK_SIZE])
+
+static const size_t BINS_SLICE_ALIGN = 16;
+
+/* Advances the active particles from t0 to now with their last force, same
+ * arithmetic as host_update_slice when the step is time_interval */
+static void bins_advance(void * arg, const int tid, const int nthreads)
+{
+   bins_t * const bins = arg;
+   size_t begin, end, a;
+
+   nbody_pool_range(bins->n_active, 1, tid, nthreads, &begin, &end);
+   for (a = begin; a < end; a++) {
+      const uint32_t i = bins->active[a];
+      const float time_interval = (bins->now - bins->t0[i])*bins->dt_min;
+      const float time_by_mass  = time_interval / P(bins->particles, mass, i);
+
+      const float velocity_change_x = P(bins->forces, x, i) * time_by_mass;
+      const float velocity_change_y = P(bins->forces, y, i) * time_by_mass;
+      const float velocity_change_z = P(bins->forces, z, i) * time_by_mass;
+
+      P(bins->particles, position_x, i) += (P(bins->particles, velocity_x, i) + velocity_change_x * 0.5f) * time_interval;
+      P(bins->particles, position_y, i) += (P(bins->particles, velocity_y, i) + velocity_change_y * 0.5f) * time_interval;
+      P(bins->particles, position_z, i) += (P(bins->particles, velocity_z, i) + velocity_change_z * 0.5f) * time_interval;
+
+      P(bins->particles, velocity_x, i) += velocity_change_x;
+      P(bins->particles, velocity_y, i) += velocity_change_y;
+      P(bins->particles, velocity_z, i) += velocity_change_z;
+
+      bins->t0[i] = bins->now;
+   }
+}
+
+/* Predicts every particle to now along its last step, the active ones are already
+ * there, and gathers the active ones into the dense target blocks */
+static void bins_predict(void * arg, const int tid, const int nthreads)
+{
+   bins_t * const bins = arg;
+   size_t begin, end, i, a;
+
+   nbody_pool_range(bins->count, BLOCK_SIZE, tid, nthreads, &begin, &end);
+   for (i = begin; i < end; i++) {
+      const float dt = (bins->now - bins->t0[i])*bins->dt_min;
+      const float half_dt_by_mass = 0.5f * dt / P(bins->particles, mass, i);
+
+      P(bins->sources, position_x, i) = P(bins->particles, position_x, i) +
+         (P(bins->particles, velocity_x, i) + P(bins->forces, x, i) * half_dt_by_mass) * dt;
+      P(bins->sources, position_y, i) = P(bins->particles, position_y, i) +
+         (P(bins->particles, velocity_y, i) + P(bins->forces, y, i) * half_dt_by_mass) * dt;
+      P(bins->sources, position_z, i) = P(bins->particles, position_z, i) +
+         (P(bins->particles, velocity_z, i) + P(bins->forces, z, i) * half_dt_by_mass) * dt;
+      P(bins->sources, weight, i) = P(bins->particles, weight, i);
+   }
+
+   nbody_pool_range(bins->n_active, 1, tid, nthreads, &begin, &end);
+   for (a = begin; a < end; a++) {
+      const uint32_t i = bins->active[a];
+      P(bins->targets, position_x, a) = P(bins->particles, position_x, i);
+      P(bins->targets, position_y, a) = P(bins->particles, position_y, i);
+      P(bins->targets, position_z, a) = P(bins->particles, position_z, i);
+      P(bins->targets, mass, a)       = P(bins->particles, mass, i);
+      P(bins->target_forces, x, a) = 0.0f;
+      P(bins->target_forces, y, a) = 0.0f;
+      P(bins->target_forces, z, a) = 0.0f;
+   }
+}
+
+static void bins_forces(void * arg, const int tid, const int nthreads)
+{
+   const bins_t * const bins = arg;
+   size_t begin, end;
+   int i, j, e0, e1;
+
+   nbody_pool_range(bins->n_active, BINS_SLICE_ALIGN, tid, nthreads, &begin, &end);
+
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      for (j = 0; j < bins->n_blocks; j++) {
+         nbody_forces_slice(bins->target_forces + i, bins->targets + i, bins->sources + j, e0, e1,
+               nbody_block_count(bins->count, j));
+      }
+   }
+}
+
+/* Stores the new forces and picks the bins of the active particles */
+static void bins_assign(void * arg, const int tid, const int nthreads)
+{
+   bins_t * const bins = arg;
+   const int substeps = 1 << (bins->bins - 1);
+   size_t begin, end, a;
+
+   nbody_pool_range(bins->n_active, 1, tid, nthreads, &begin, &end);
+   for (a = begin; a < end; a++) {
+      const uint32_t i = bins->active[a];
+      const float fx = P(bins->target_forces, x, a);
+      const float fy = P(bins->target_forces, y, a);
+      const float fz = P(bins->target_forces, z, a);
+      const double dx = fx - P(bins->forces, x, i);
+      const double dy = fy - P(bins->forces, y, i);
+      const double dz = fz - P(bins->forces, z, i);
+      const double change = sqrt(dx*dx + dy*dy + dz*dz);
+      int k = bins->bin[i];
+
+      if (bins->now > 0 || bins->resumed) {
+         /* the last step of the particle was the one of its bin */
+         const double force = sqrt((double)fx*fx + (double)fy*fy + (double)fz*fz);
+         const double step  = (double)(substeps >> k)*bins->dt_min;
+         const double dt    = change > 0.0 ? bins->eta*force/change*step : INFINITY;
+         int want = 0;
+
+         while (want < bins->bins - 1 && (double)bins->dt_min*(substeps >> want) > dt) want++;
+         /* one level coarser at most, and only on a substep aligned with it */
+         k = want < k - 1 ? k - 1 : want;
+         while (bins->now % (substeps >> k) != 0) k++;
+      }
+
+      bins->bin[i]  = k;
+      bins->next[i] = bins->now + (substeps >> k);
+      bins->bin_evals[k] += 1.0;
+
+      P(bins->forces, x, i) = fx;
+      P(bins->forces, y, i) = fy;
+      P(bins->forces, z, i) = fz;
+   }
+}
+
+static void bins_collect(bins_t * const bins)
+{
+   size_t i;
+
+   bins->n_active = 0;
+   for (i = 0; i < bins->count; i++) {
+      if (bins->next[i] == bins->now) bins->active[bins->n_active++] = i;
+   }
+}
+
+double solve_nbody_bins(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times)
+{
+   const size_t n = (size_t)nbody->num_particles*BLOCK_SIZE;
+   const size_t blocks_size = nbody->num_particles*sizeof(particles_block_t);
+   const size_t forces_size = nbody->num_particles*sizeof(force_block_t);
+   const int substeps = 1 << (opts->bins - 1);
+   const int last = nbody->timesteps*substeps;
+   double pairs = 0.0, evals = 0.0;
+   bins_t bins;
+   int k;
+
+   times[0] = wall_time();
+   nbody_pool_init(opts->threads);
+
+   memset(&bins, 0, sizeof(bins));
+   bins.resumed = opts->resume && bins_kept.bin != NULL;
+   if (bins.resumed) {
+      bins.bin       = bins_kept.bin;
+      bins.forces    = bins_kept.forces;
+      bins.bin_evals = bins_kept.bin_evals;
+   } else {
+      bins.bin       = calloc(n, sizeof(unsigned char));
+      bins.forces    = nbody_alloc(forces_size);
+      bins.bin_evals = calloc(opts->bins, sizeof(double));
+      assert(bins.forces != NULL);
+      memset(bins.forces, 0, forces_size);
+      bins_kept.timesteps = 0.0;
+      bins_kept.silent    = silent;
+   }
+   bins.particles     = nbody->local;
+   bins.n_blocks      = nbody->num_particles;
+   bins.count         = nbody->count;
+   bins.bins          = opts->bins;
+   bins.eta           = opts->eta;
+   bins.dt_min        = conf->time_interval/substeps;
+   bins.t0            = calloc(n, sizeof(int));
+   bins.next          = calloc(n, sizeof(int));
+   bins.active        = malloc(n*sizeof(uint32_t));
+   bins.sources       = nbody_alloc(blocks_size);
+   bins.targets       = nbody_alloc(blocks_size);
+   bins.target_forces = nbody_alloc(forces_size);
+   assert(bins.t0 && bins.next && bins.bin && bins.active && bins.bin_evals);
+   times[1] = wall_time();
+
+   for (bins.now = 0; bins.now <= last; bins.now++) {
+      if (bins.now > 0 && bins.now%substeps == 0) nbody_step();
+      nbody_phase(NBODY_PHASE_BUILD);
+      bins_collect(&bins);
+      if (bins.n_active == 0) continue;
+
+      nbody_phase(NBODY_PHASE_UPDATE);
+      nbody_pool_run(bins_advance, &bins);
+      if (bins.now == last) break;
+
+      nbody_phase(NBODY_PHASE_BUILD);
+      nbody_pool_run(bins_predict, &bins);
+      nbody_phase(NBODY_PHASE_FORCES);
+      nbody_pool_run(bins_forces, &bins);
+      nbody_phase(NBODY_PHASE_UPDATE);
+      nbody_pool_run(bins_assign, &bins);
+      pairs += (double)bins.n_active*bins.count;
+   }
+   times[2] = wall_time();
+   bins_kept.timesteps += nbody->timesteps;
+
+   if (!opts->suspend && !bins_kept.silent) {
+      for (k = 0; k < opts->bins; k++) evals += bins.bin_evals[k];
+      for (k = opts->bins - 1; k > 0 && bins.bin_evals[k] == 0.0; k--);
+      printf("> Timestep bins: %.0f force evaluations, %.1fx fewer than a global step of time_interval/%d\n",
+         evals, (double)bins.count*bins_kept.timesteps*(1 << k)/evals, 1 << k);
+      printf("> Force evaluations per bin:");
+      for (k = 0; k < opts->bins; k++) printf(" %d: %.0f", k, bins.bin_evals[k]);
+      printf("\n");
+   }
+
+   if (opts->suspend) {
+      bins_kept.bin       = bins.bin;
+      bins_kept.forces    = bins.forces;
+      bins_kept.bin_evals = bins.bin_evals;
+   } else {
+      free(bins.bin); free(bins.bin_evals);
+      nbody_dealloc(bins.forces, forces_size);
+      memset(&bins_kept, 0, sizeof(bins_kept));
+   }
+   free(bins.t0); free(bins.next); free(bins.active);
+   nbody_dealloc(bins.sources, blocks_size);
+   nbody_dealloc(bins.targets, blocks_size);
+   nbody_dealloc(bins.target_forces, forces_size);
+   nbody_pool_fini();
+   times[3] = wall_time();
+
+   return pairs;
+}
@@ -0,0 +1,258 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "engine.h"
+
+extern int silent;
+
+/* Short-range engine. Pairs farther apart than the cutoff radius do not interact,
+ * so every step the particles are binned into a uniform grid over the domain,
+ * [0, domain_size) on each axis, of cells no smaller than the cutoff, and each
+ * particle only sees the 27 cells around its own. The grid is rebuilt with a
+ * counting sort that packs the particles cell after cell into SoA arrays. It is
+ * stable, so results do not depend on the threads, and the 3 cells of a row of
+ * neighbors are one contiguous source range for the kernel. Particles outside
+ * the domain are clamped into the border cells, which is still correct but
+ * slower. The grid is coarsened until there are no more cells than particles. */
+
+typedef struct {
+   particles_block_t * particles;
+   force_block_t     * forces;
+   size_t              n;
+   int                 dim[3];         /* cells per axis */
+   int                 n_cells;
+   float               inv_size[3];    /* cells per meter */
+   float               cutoff_squared;
+   uint32_t          * cell;           /* cell of each particle */
+   uint32_t          * slot;           /* packed slot of each particle */
+   int               * start;          /* n_cells + 1 packed offsets */
+   int               * counts;         /* per thread histograms, then scatter offsets */
+   cell_particles_t    packed;
+   double            * pairs;          /* per thread pairs of the last evaluation */
+} cutoff_grid_t;
+
+#define P(blocks, field, i) ((blocks)[(i)/BLOCK_SIZE].field[(i)%BLOCK_SIZE])
+
+static inline int cutoff_coord(const float x, const float inv_size, const int dim)
+{
+   const float c = x*inv_size;
+   return c < 0.0f ? 0 : c >= dim ? dim - 1 : (int)c;
+}
+
+static void cutoff_count(void * arg, const int tid, const int nthreads)
+{
+   cutoff_grid_t * const grid = arg;
+   int * const counts = grid->counts + (size_t)tid*grid->n_cells;
+   size_t begin, end, i;
+
+   memset(counts, 0, grid->n_cells*sizeof(int));
+   nbody_pool_range(grid->n, BLOCK_SIZE, tid, nthreads, &begin, &end);
+   for (i = begin; i < end; i++) {
+      const int x = cutoff_coord(P(grid->particles, position_x, i), grid->inv_size[0], grid->dim[0]);
+      const int y = cutoff_coord(P(grid->particles, position_y, i), grid->inv_size[1], grid->dim[1]);
+      const int z = cutoff_coord(P(grid->particles, position_z, i), grid->inv_size[2], grid->dim[2]);
+      const uint32_t c = ((uint32_t)z*grid->dim[1] + y)*grid->dim[0] + x;
+
+      grid->cell[i] = c;
+      counts[c]++;
+   }
+}
+
+/* Same ranges as cutoff_count, so each thread fills the slots it counted */
+static void cutoff_scatter(void * arg, const int tid, const int nthreads)
+{
+   cutoff_grid_t * const grid = arg;
+   cell_particles_t * const packed = &grid->packed;
+   int * const offsets = grid->counts + (size_t)tid*grid->n_cells;
+   size_t begin, end, i;
+
+   nbody_pool_range(grid->n, BLOCK_SIZE, tid, nthreads, &begin, &end);
+   for (i = begin; i < end; i++) {
+      const int s = offsets[grid->cell[i]]++;
+
+      packed->position_x[s] = P(grid->particles, position_x, i);
+      packed->position_y[s] = P(grid->particles, position_y, i);
+      packed->position_z[s] = P(grid->particles, position_z, i);
+      packed->weight[s]     = P(grid->particles, weight, i);
+      packed->mass[s]       = P(grid->particles, mass, i);
+      packed->force_x[s]    = 0.0f;
+      packed->force_y[s]    = 0.0f;
+      packed->force_z[s]    = 0.0f;
+      grid->slot[i] = s;
+   }
+}
+
+static void cutoff_forces_part(void * arg, const int tid, const int nthreads)
+{
+   cutoff_grid_t * const grid = arg;
+   const int dim_x = grid->dim[0], dim_y = grid->dim[1], dim_z = grid->dim[2];
+   double pairs = 0.0;
+   size_t begin, end, c;
+
+   nbody_pool_range(grid->n_cells, 1, tid, nthreads, &begin, &end);
+   for (c = begin; c < end; c++) {
+      const int t0 = grid->start[c], t1 = grid->start[c + 1];
+      const int x = c%dim_x, y = c/dim_x%dim_y, z = c/dim_x/dim_y;
+      const int x0 = x > 0 ? x - 1 : 0, x1 = x < dim_x - 1 ? x + 1 : x;
+      int ny, nz;
+
+      if (t0 == t1) continue;
+      for (nz = z > 0 ? z - 1 : 0; nz <= z + 1 && nz < dim_z; nz++)
+      for (ny = y > 0 ? y - 1 : 0; ny <= y + 1 && ny < dim_y; ny++) {
+         const size_t row = ((size_t)nz*dim_y + ny)*dim_x;
+         const int s0 = grid->start[row + x0], s1 = grid->start[row + x1 + 1];
+
+         if (s0 == s1) continue;
+         nbody_cutoff_slice(&grid->packed, t0, t1, s0, s1, grid->cutoff_squared);
+         pairs += (double)(t1 - t0)*(s1 - s0);
+      }
+   }
+   grid->pairs[tid] = pairs;
+}
+
+/* Back to the particle order */
+static void cutoff_gather(void * arg, const int tid, const int nthreads)
+{
+   cutoff_grid_t * const grid = arg;
+   size_t begin, end, i;
+
+   nbody_pool_range(grid->n, BLOCK_SIZE, tid, nthreads, &begin, &end);
+   for (i = begin; i < end; i++) {
+      const uint32_t s = grid->slot[i];
+      P(grid->forces, x, i) = grid->packed.force_x[s];
+      P(grid->forces, y, i) = grid->packed.force_y[s];
+      P(grid->forces, z, i) = grid->packed.force_z[s];
+   }
+}
+
+/* Rebuilds the grid and sets the forces, returns the evaluated pairs */
+static double cutoff_compute_forces(cutoff_grid_t * const grid, double * phase)
+{
+   const int threads = nbody_pool_size();
+   double start = wall_time(), pairs = 0.0;
+   int offset = 0, c, t;
+
+   nbody_phase(NBODY_PHASE_BUILD);
+   nbody_pool_run(cutoff_count, grid);
+   for (c = 0; c < grid->n_cells; c++) {
+      grid->start[c] = offset;
+      for (t = 0; t < threads; t++) {
+         int * const count = &grid->counts[(size_t)t*grid->n_cells + c];
+         const int particles = *count;
+         *count  = offset;
+         offset += particles;
+      }
+   }
+   grid->start[grid->n_cells] = offset;
+   nbody_pool_run(cutoff_scatter, grid);
+   phase[0] += wall_time() - start;
+
+   start = wall_time();
+   nbody_phase(NBODY_PHASE_FORCES);
+   nbody_pool_run(cutoff_forces_part, grid);
+   nbody_pool_run(cutoff_gather, grid);
+   phase[1] += wall_time() - start;
+
+   for (t = 0; t < threads; t++) pairs += grid->pairs[t];
+   return pairs;
+}
+
+double solve_nbody_cutoff(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times)
+{
+   const float domain[3] = { conf->domain_size_x, conf->domain_size_y, conf->domain_size_z };
+   const float cutoff = opts->cutoff > 0.0f ? opts->cutoff : conf->domain_size_x/8;
+   double phase[3] = { 0.0, 0.0, 0.0 };
+   double pairs = 0.0, start;
+   cutoff_grid_t grid;
+   int k, t;
+
+   times[0] = wall_time();
+   nbody_pool_init(opts->threads);
+
+   memset(&grid, 0, sizeof(grid));
+   grid.particles = nbody->local;
+   grid.forces    = nbody->forces;
+   grid.n         = nbody->count;
+   grid.cutoff_squared = cutoff*cutoff;
+   assert(grid.n < UINT32_MAX);
+
+   for (k = 0; k < 3; k++) {
+      grid.dim[k] = domain[k]/cutoff < 1024.0f ? (int)(domain[k]/cutoff) : 1024;
+      if (grid.dim[k] < 1) grid.dim[k] = 1;
+   }
+   /* Halving rounded up keeps the cells at least as big as the cutoff */
+   while ((size_t)grid.dim[0]*grid.dim[1]*grid.dim[2] > grid.n) {
+      for (k = 0; k < 3; k++) grid.dim[k] = (grid.dim[k] + 1)/2;
+   }
+   for (k = 0; k < 3; k++) grid.inv_size[k] = grid.dim[k]/domain[k];
+   grid.n_cells = grid.dim[0]*grid.dim[1]*grid.dim[2];
+
+   grid.cell   = malloc(grid.n*sizeof(uint32_t));
+   grid.slot   = malloc(grid.n*sizeof(uint32_t));
+   grid.start  = malloc((grid.n_cells + 1)*sizeof(int));
+   grid.counts = malloc((size_t)nbody_pool_size()*grid.n_cells*sizeof(int));
+   grid.pairs  = malloc(nbody_pool_size()*sizeof(double));
+   grid.packed.position_x = malloc(grid.n*sizeof(float));
+   grid.packed.position_y = malloc(grid.n*sizeof(float));
+   grid.packed.position_z = malloc(grid.n*sizeof(float));
+   grid.packed.weight     = malloc(grid.n*sizeof(float));
+   grid.packed.mass       = malloc(grid.n*sizeof(float));
+   grid.packed.force_x    = malloc(grid.n*sizeof(float));
+   grid.packed.force_y    = malloc(grid.n*sizeof(float));
+   grid.packed.force_z    = malloc(grid.n*sizeof(float));
+   assert(grid.cell && grid.slot && grid.start && grid.counts && grid.pairs);
+   assert(grid.packed.position_x && grid.packed.position_y && grid.packed.position_z && grid.packed.weight &&
+         grid.packed.mass && grid.packed.force_x && grid.packed.force_y && grid.packed.force_z);
+
+   if (opts->samples > 0) {
+      char label[64];
+      double warmup[3] = { 0.0, 0.0, 0.0 };
+      sprintf(label, "Cutoff (radius %g m)", cutoff);
+      cutoff_compute_forces(&grid, warmup);
+      nbody_force_error(label, nbody->local, nbody->forces, nbody->count, opts->samples);
+      memset(nbody->forces, 0, nbody->num_particles*sizeof(force_block_t));
+   }
+   times[1] = wall_time();
+
+   for (t = 0; t < nbody->timesteps; t++) {
+      pairs += cutoff_compute_forces(&grid, phase);
+      start = wall_time();
+      host_update_particles(nbody->local, nbody->forces, nbody->num_particles, nbody->count, conf->time_interval);
+      phase[2] += wall_time() - start;
+      nbody_step();
+   }
+   times[2] = wall_time();
+
+   silent?:printf("> Cutoff grid: %dx%dx%d cells for a %g m cutoff, %.1f particles per cell, "
+         "%.2f%% of the pairs evaluated\n", grid.dim[0], grid.dim[1], grid.dim[2], cutoff,
+         (double)grid.n/grid.n_cells, 100.0*pairs/((double)grid.n*grid.n*nbody->timesteps));
+   silent?:printf("> Cutoff phases (secs): bin %f, forces %f, update %f\n", phase[0], phase[1], phase[2]);
+
+   free(grid.cell); free(grid.slot); free(grid.start); free(grid.counts); free(grid.pairs);
+   free(grid.packed.position_x); free(grid.packed.position_y); free(grid.packed.position_z);
+   free(grid.packed.weight); free(grid.packed.mass);
+   free(grid.packed.force_x); free(grid.packed.force_y); free(grid.packed.force_z);
+   nbody_pool_fini();
+   times[3] = wall_time();
+
+   return pairs;
+}
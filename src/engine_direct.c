@@ -0,0 +1,315 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "engine.h"
+
+extern int silent;
+
+/* Shared-memory all-pairs engine. Target particles are split in contiguous
+ * slices, one per thread, so every thread owns its part of the forces array and
+ * no synchronization is needed inside a phase. Each slice still accumulates the
+ * sources in the same order as calculate_forces, so results are bit-exact. */
+
+static const size_t DIRECT_SLICE_ALIGN = 16;
+
+/* Schedule of the fp32 forces. The slice one goes through all the source blocks
+ * for each block slice of the thread, so the slice (positions, masses and
+ * forces, 28 bytes per target) is swept from L2 for every source tile and every
+ * source block is streamed from memory once per slice. The tiled one splits the
+ * slices in target tiles that fit in half of the L1 next to a source tile, and
+ * the source blocks in panels of half of the L2: each panel is read from memory
+ * once per thread and stays in L2 while every target tile of the thread goes
+ * through it. Targets still add their source blocks in order, so both schedules
+ * are bit-exact. */
+static struct {
+   int tiled;
+   int targets;  /* particles per target tile */
+   int panel;    /* source blocks per panel */
+} schedule;
+
+static const int direct_tiles[] = { 256, 512, 1024, 2048 };
+
+int nbody_schedule_select(const char * name)
+{
+   long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+   long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+   size_t i;
+
+   if (strcmp(name, "tiled") != 0 && strcmp(name, "slice") != 0) return -1;
+   if (l1 <= 0) l1 = 32*1024;
+   if (l2 <= 0) l2 = 256*1024;
+
+   schedule.tiled   = strcmp(name, "tiled") == 0;
+   schedule.targets = direct_tiles[0];
+   for (i = 0; i < sizeof(direct_tiles)/sizeof(direct_tiles[0]); i++) {
+      const size_t bytes = (size_t)direct_tiles[i]*(4 + 3)*sizeof(float);
+      if (direct_tiles[i] <= (int)BLOCK_SIZE && bytes <= (size_t)l1/2) schedule.targets = direct_tiles[i];
+   }
+   schedule.panel = l2/2/(BLOCK_SIZE*4*sizeof(float));
+   if (schedule.panel < 1) schedule.panel = 1;
+   return 0;
+}
+
+/* Bytes per pair that go to memory when nothing stays in the LLC: the sources
+ * of each slice or of each thread, and the targets and forces of each panel */
+static void schedule_report(const int n_blocks, const int threads)
+{
+   const double n = (double)n_blocks*BLOCK_SIZE;
+   const double range = n/threads;
+   const double slice = range < BLOCK_SIZE ? range : BLOCK_SIZE;
+   const double panel = (schedule.panel < n_blocks ? schedule.panel : n_blocks)*(double)BLOCK_SIZE;
+   const double slice_traffic = 16.0/slice + 40.0/n;
+   const double tiled_traffic = 16.0/range + 40.0/panel;
+
+   if (schedule.tiled) {
+      silent?:printf("> Schedule: tiled, %d target tiles, %d block source panels, %.4f bytes/pair from memory "
+            "(slice: %.4f)\n", schedule.targets, schedule.panel, tiled_traffic, slice_traffic);
+   } else {
+      silent?:printf("> Schedule: slice, %.4f bytes/pair from memory (tiled: %.4f)\n", slice_traffic, tiled_traffic);
+   }
+}
+
+typedef struct {
+   particles_block_t * particles;
+   force_block_t     * forces;
+   int                 n_blocks;
+   float               time_interval;
+   source_block_t    * sources;   /* reduced precision sources, NULL for fp32 */
+   particles_block_t * scratch;   /* one expanded source block per thread */
+   int                 precision;
+   size_t              count;     /* targets, the padding of the last block is skipped */
+} direct_args_t;
+
+static void direct_forces(void * arg, const int tid, const int nthreads)
+{
+   const direct_args_t * const args = arg;
+   size_t begin, end;
+   int i, j, e0, e1;
+
+   nbody_pool_range(args->count, DIRECT_SLICE_ALIGN, tid, nthreads, &begin, &end);
+
+   if (!schedule.tiled) {
+      while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+         for (j = 0; j < args->n_blocks; j++) {
+            nbody_forces_slice(args->forces + i, args->particles + i, args->particles + j, e0, e1,
+                  nbody_block_count(args->count, j));
+         }
+      }
+      return;
+   }
+
+   int p0, t0;
+   for (p0 = 0; p0 < args->n_blocks; p0 += schedule.panel) {
+      const int p1 = p0 + schedule.panel < args->n_blocks ? p0 + schedule.panel : args->n_blocks;
+      size_t p = begin;
+
+      while (nbody_next_slice(&p, end, &i, &e0, &e1)) {
+         for (t0 = e0; t0 < e1; t0 += schedule.targets) {
+            const int t1 = t0 + schedule.targets < e1 ? t0 + schedule.targets : e1;
+            for (j = p0; j < p1; j++) {
+               nbody_forces_slice(args->forces + i, args->particles + i, args->particles + j, t0, t1,
+                     nbody_block_count(args->count, j));
+            }
+         }
+      }
+   }
+}
+
+/* Same as direct_forces with the sources read from the packed blocks, half the
+ * bytes of the fp32 ones. Each source block is expanded into a per thread block
+ * that stays in cache while the slice goes through it. The target block itself is
+ * already in cache and is read in fp32. */
+static void direct_forces_packed(void * arg, const int tid, const int nthreads)
+{
+   const direct_args_t * const args = arg;
+   particles_block_t * const source = args->scratch + tid;
+   size_t begin, end;
+   int i, j, e0, e1;
+
+   nbody_pool_range(args->count, DIRECT_SLICE_ALIGN, tid, nthreads, &begin, &end);
+
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      for (j = 0; j < args->n_blocks; j++) {
+         if (j == i) {
+            /* The rounded position of a particle is not its own, so the own block is
+             * read in fp32 to keep the self interaction at distance zero */
+            nbody_forces_slice(args->forces + i, args->particles + i, args->particles + i, e0, e1,
+                  nbody_block_count(args->count, i));
+            continue;
+         }
+         nbody_unpack_source(source, args->sources + j, args->precision);
+         nbody_forces_slice(args->forces + i, args->particles + i, source, e0, e1,
+               nbody_block_count(args->count, j));
+      }
+   }
+}
+
+static void direct_step(direct_args_t * const args)
+{
+   if (args->sources != NULL) {
+      nbody_phase(NBODY_PHASE_BUILD);
+      nbody_pack_sources(args->sources, args->particles, args->n_blocks, args->precision);
+      nbody_phase(NBODY_PHASE_FORCES);
+      nbody_pool_run(direct_forces_packed, args);
+   } else {
+      nbody_phase(NBODY_PHASE_FORCES);
+      nbody_pool_run(direct_forces, args);
+   }
+}
+
+static void direct_update(void * arg, const int tid, const int nthreads)
+{
+   const direct_args_t * const args = arg;
+   size_t begin, end;
+   int i, e0, e1;
+
+   nbody_pool_range(args->count, DIRECT_SLICE_ALIGN, tid, nthreads, &begin, &end);
+
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      host_update_slice(args->particles + i, args->forces + i, e0, e1, args->time_interval);
+   }
+}
+
+void host_update_particles(particles_block_t * const particles, force_block_t * const forces,
+      const int n_blocks, const size_t count, const float time_interval)
+{
+   direct_args_t args = { particles, forces, n_blocks, time_interval, NULL, NULL, 0, count };
+   nbody_phase(NBODY_PHASE_UPDATE);
+   nbody_pool_run(direct_update, &args);
+}
+
+void host_forces(particles_block_t * const particles, force_block_t * const forces, const int n_blocks,
+      const size_t count)
+{
+   direct_args_t args = { particles, forces, n_blocks, 0.0f, NULL, NULL, 0, count };
+   nbody_phase(NBODY_PHASE_FORCES);
+   nbody_pool_run(direct_forces, &args);
+}
+
+/* Symmetric engine: only the j >= i block pairs are visited and each pair updates
+ * both force blocks. To stay race free the off-diagonal pairs are scheduled as a
+ * round robin tournament (circle method): in every round each block is in at most
+ * one pair, so the pairs of a round run in parallel and rounds are separated by a
+ * barrier. The diagonal pairs form one more round. The kernel goes over whole
+ * blocks and the reaction of a pair is mass_e*weight_k, so the padded last block
+ * is always the source of its pairs: the padding then only adds its zero weight,
+ * and on the diagonal it is the k > e end of every pair it is in. */
+static void symmetric_forces(void * arg, const int tid, const int nthreads)
+{
+   const direct_args_t * const args = arg;
+   const int n = args->n_blocks;
+   const int m = n + (n & 1); /* odd block counts get a dummy block, its pairs are byes */
+   int round, k, i;
+
+   for (i = tid; i < n; i += nthreads) {
+      nbody_forces_sym(args->forces + i, args->forces + i, args->particles + i, args->particles + i, 1);
+   }
+
+   for (round = 0; round < m - 1; round++) {
+      nbody_pool_barrier();
+      for (k = tid; k < m/2; k += nthreads) {
+         int a = k == 0 ? m - 1 : (round + k)%(m - 1);
+         int b = k == 0 ? round : (round - k + m - 1)%(m - 1);
+         if (a >= n || b >= n) continue;
+         if (a == n - 1) { a = b; b = n - 1; }
+
+         nbody_forces_sym(args->forces + a, args->forces + b, args->particles + a, args->particles + b, 0);
+      }
+   }
+}
+
+double solve_nbody_symmetric(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times)
+{
+   int t;
+   direct_args_t args = { nbody->local, nbody->forces, nbody->num_particles, conf->time_interval,
+                          NULL, NULL, 0, nbody->count };
+
+   times[0] = wall_time();
+   nbody_pool_init(opts->threads);
+   times[1] = wall_time();
+
+   for (t = 0; t < nbody->timesteps; t++) {
+      nbody_phase(NBODY_PHASE_FORCES);
+      nbody_pool_run(symmetric_forces, &args);
+      nbody_phase(NBODY_PHASE_UPDATE);
+      nbody_pool_run(direct_update, &args);
+      nbody_step();
+   }
+   times[2] = wall_time();
+
+   nbody_pool_fini();
+   times[3] = wall_time();
+
+   const double n = (double)nbody->count;
+   return n*(n - 1.0)/2.0*nbody->timesteps;
+}
+
+double solve_nbody_direct(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times)
+{
+   int t;
+   direct_args_t args = { nbody->local, nbody->forces, nbody->num_particles, conf->time_interval,
+                          NULL, NULL, nbody_precision_find(opts->precision), nbody->count };
+
+   switch (nbody_integrator_find(opts->integrator)) {
+      case NBODY_INTEGRATOR_LEAPFROG: return solve_nbody_leapfrog(nbody, conf, opts, times);
+      case NBODY_INTEGRATOR_HERMITE:  return solve_nbody_hermite(nbody, conf, opts, times);
+   }
+   const size_t sources_size = nbody->num_particles*sizeof(source_block_t);
+
+   times[0] = wall_time();
+   nbody_pool_init(opts->threads);
+   const size_t scratch_size = nbody_pool_size()*sizeof(particles_block_t);
+   if (args.precision != NBODY_PRECISION_FP32) {
+      args.sources = nbody_alloc(sources_size);
+      args.scratch = nbody_alloc(scratch_size);
+
+      if (opts->samples > 0) {
+         char label[64];
+         sprintf(label, "Direct (%s sources)", opts->precision);
+         direct_step(&args);
+         nbody_force_error(label, nbody->local, nbody->forces, nbody->count, opts->samples);
+         memset(nbody->forces, 0, nbody->num_particles*sizeof(force_block_t));
+      }
+   } else {
+      schedule_report(nbody->num_particles, nbody_pool_size());
+   }
+   times[1] = wall_time();
+
+   for (t = 0; t < nbody->timesteps; t++) {
+      direct_step(&args);
+      nbody_phase(NBODY_PHASE_UPDATE);
+      nbody_pool_run(direct_update, &args);
+      nbody_step();
+   }
+   times[2] = wall_time();
+
+   if (args.sources != NULL) {
+      nbody_dealloc(args.sources, sources_size);
+      nbody_dealloc(args.scratch, scratch_size);
+   }
+   nbody_pool_fini();
+   times[3] = wall_time();
+
+   return (double)nbody->count*nbody->count*nbody->timesteps;
+}
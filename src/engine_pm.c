@@ -0,0 +1,410 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+#include <assert.h>
+#include "engine.h"
+
+/* Particle-mesh engine. The weights are deposited with cloud-in-cell on an M^3 mesh
+ * spanning the bounding box, the potential is the convolution of that density
+ * with 1/r, done with FFTs on a zero padded (2M)^3 mesh so that the system is
+ * isolated instead of periodic, and the acceleration is its central difference
+ * gradient interpolated back to the particles with the same cloud-in-cell weights.
+ * Particles are kept in mesh nodes [1, M-3] so stencils never leave the M^3 part.
+ *
+ * The deposit uses one private M^3 mesh per thread which are then added up, so it
+ * needs threads*M^3*4 bytes on top of the padded mesh. */
+
+extern int silent;
+
+static const int PM_BATCH = 8;
+
+typedef float complex cfloat;
+
+typedef struct {
+   particles_block_t * particles;
+   force_block_t     * forces;
+   size_t              n;
+   int                 M, L;           /* mesh and padded mesh sizes */
+
+   float    origin[3];
+   float    h;                         /* mesh spacing */
+
+   float  * density;                   /* nthreads private M^3 meshes */
+   cfloat * mesh;                      /* L^3 padded mesh, density then potential */
+   float  * green;                     /* L^3 transform of 1/r for h = 1, it is real */
+   float  * accel[3];                  /* M^3 acceleration */
+
+   cfloat * twiddle;                   /* L/2 roots of unity */
+   int    * reverse;                   /* L bit reversal permutation */
+   cfloat * scratch;                   /* nthreads*PM_BATCH lines of L */
+
+   int      inverse;                   /* direction of the running fft pass */
+   int      axis;
+} pm_mesh_t;
+
+static inline size_t pm_index(const int M, const int x, const int y, const int z)
+{
+   return ((size_t)z*M + y)*M + x;
+}
+
+/* In place radix-2 transform of one line of L points */
+static void pm_fft_line(const pm_mesh_t * const pm, cfloat * const line, const int inverse)
+{
+   const int L = pm->L;
+   int i, len, k;
+
+   for (i = 0; i < L; i++) {
+      const int r = pm->reverse[i];
+      if (i < r) {
+         const cfloat t = line[i];
+         line[i] = line[r];
+         line[r] = t;
+      }
+   }
+
+   for (len = 2; len <= L; len <<= 1) {
+      const int half = len >> 1;
+      const int step = L/len;
+      for (i = 0; i < L; i += len) {
+         for (k = 0; k < half; k++) {
+            const float wr = crealf(pm->twiddle[k*step]);
+            const float wi = inverse ? -cimagf(pm->twiddle[k*step]) : cimagf(pm->twiddle[k*step]);
+            const float br = crealf(line[i + k + half]), bi = cimagf(line[i + k + half]);
+            const cfloat a = line[i + k];
+            /* Written out to skip the C99 inf/nan handling of complex products */
+            const cfloat b = (br*wr - bi*wi) + (br*wi + bi*wr)*I;
+            line[i + k]        = a + b;
+            line[i + k + half] = a - b;
+         }
+      }
+   }
+}
+
+/* One axis of the 3D transform. Lines whose other two coordinates are beyond M are
+ * all zero on the way forward, and not needed on the way back, so they are skipped
+ * (x lines need y, z < M, y lines need z < M). Strided y and z lines are copied
+ * PM_BATCH at a time, neighbours in x, so every cache line read is fully used. */
+static void pm_fft_axis(void * arg, const int tid, const int nthreads)
+{
+   pm_mesh_t * const pm = arg;
+   const int L = pm->L, M = pm->M, axis = pm->axis;
+   const int batch = axis == 0 ? 1 : PM_BATCH;
+   const size_t stride = axis == 0 ? 1 : (axis == 1 ? (size_t)L : (size_t)L*L);
+   cfloat * const scratch = pm->scratch + (size_t)tid*L*PM_BATCH;
+   size_t begin, end, group;
+   int i, j;
+
+   nbody_pool_range((size_t)L*L/batch, 1, tid, nthreads, &begin, &end);
+   for (group = begin; group < end; group++) {
+      const int a = group*batch%L, b = group*batch/L; /* the two other coordinates, slowest last */
+      size_t base;
+
+      if (axis == 0) {
+         if (a >= M || b >= M) continue;
+         base = ((size_t)b*L + a)*L;
+      } else if (axis == 1) {
+         if (b >= M) continue;
+         base = (size_t)b*L*L + a;
+      } else {
+         base = (size_t)b*L + a;
+      }
+
+      for (i = 0; i < L; i++) {
+         for (j = 0; j < batch; j++) scratch[(size_t)j*L + i] = pm->mesh[base + i*stride + j];
+      }
+      for (j = 0; j < batch; j++) pm_fft_line(pm, scratch + (size_t)j*L, pm->inverse);
+      for (i = 0; i < L; i++) {
+         for (j = 0; j < batch; j++) pm->mesh[base + i*stride + j] = scratch[(size_t)j*L + i];
+      }
+   }
+}
+
+static void pm_fft(pm_mesh_t * const pm, const int inverse)
+{
+   static const int forward_axes[] = { 0, 1, 2 };
+   static const int inverse_axes[] = { 2, 1, 0 };
+   int a;
+
+   pm->inverse = inverse;
+   for (a = 0; a < 3; a++) {
+      pm->axis = inverse ? inverse_axes[a] : forward_axes[a];
+      nbody_pool_run(pm_fft_axis, pm);
+   }
+}
+
+static void pm_deposit(void * arg, const int tid, const int nthreads)
+{
+   pm_mesh_t * const pm = arg;
+   const int M = pm->M, L = pm->L;
+   const size_t cells = (size_t)M*M*M;
+   float * const density = pm->density + (size_t)tid*cells;
+   const float inv_h = 1.0f/pm->h;
+   size_t begin, end, c;
+   int i, e0, e1, e, t;
+
+   memset(density, 0, cells*sizeof(float));
+
+   nbody_pool_range(pm->n, 1, tid, nthreads, &begin, &end);
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      const particles_block_t * const block = pm->particles + i;
+      for (e = e0; e < e1; e++) {
+         const float u = (block->position_x[e] - pm->origin[0])*inv_h;
+         const float v = (block->position_y[e] - pm->origin[1])*inv_h;
+         const float w = (block->position_z[e] - pm->origin[2])*inv_h;
+         const int x = u, y = v, z = w;
+         const float fx = u - x, fy = v - y, fz = w - z;
+         const float weight = block->weight[e];
+
+         density[pm_index(M, x,     y,     z    )] += weight*(1.0f - fx)*(1.0f - fy)*(1.0f - fz);
+         density[pm_index(M, x + 1, y,     z    )] += weight*fx*(1.0f - fy)*(1.0f - fz);
+         density[pm_index(M, x,     y + 1, z    )] += weight*(1.0f - fx)*fy*(1.0f - fz);
+         density[pm_index(M, x + 1, y + 1, z    )] += weight*fx*fy*(1.0f - fz);
+         density[pm_index(M, x,     y,     z + 1)] += weight*(1.0f - fx)*(1.0f - fy)*fz;
+         density[pm_index(M, x + 1, y,     z + 1)] += weight*fx*(1.0f - fy)*fz;
+         density[pm_index(M, x,     y + 1, z + 1)] += weight*(1.0f - fx)*fy*fz;
+         density[pm_index(M, x + 1, y + 1, z + 1)] += weight*fx*fy*fz;
+      }
+   }
+
+   nbody_pool_barrier();
+
+   /* Add up the private meshes into the padded one, which is zeroed around them */
+   nbody_pool_range((size_t)L*L, 1, tid, nthreads, &begin, &end);
+   for (c = begin; c < end; c++) {
+      const int y = c%L, z = c/L;
+      cfloat * const line = pm->mesh + c*L;
+      int x;
+
+      if (y >= M || z >= M) {
+         memset(line, 0, L*sizeof(cfloat));
+         continue;
+      }
+      for (x = 0; x < M; x++) {
+         float sum = 0.0f;
+         for (t = 0; t < nthreads; t++) sum += pm->density[(size_t)t*cells + pm_index(M, x, y, z)];
+         line[x] = sum;
+      }
+      for (; x < L; x++) line[x] = 0.0f;
+   }
+}
+
+static void pm_convolve(void * arg, const int tid, const int nthreads)
+{
+   pm_mesh_t * const pm = arg;
+   const size_t points = (size_t)pm->L*pm->L*pm->L;
+   /* 1/r scales with 1/h, and the inverse transform needs 1/L^3 */
+   const float scale = 1.0f/(pm->h*points);
+   size_t begin, end, p;
+
+   nbody_pool_range(points, 1, tid, nthreads, &begin, &end);
+   for (p = begin; p < end; p++) pm->mesh[p] *= pm->green[p]*scale;
+}
+
+/* The potential is -U, with U the convolution, so the acceleration is grad U */
+static void pm_gradient(void * arg, const int tid, const int nthreads)
+{
+   pm_mesh_t * const pm = arg;
+   const int M = pm->M, L = pm->L;
+   const float inv_2h = 0.5f/pm->h;
+   size_t begin, end, c;
+   int x;
+
+   nbody_pool_range((size_t)M*M, 1, tid, nthreads, &begin, &end);
+   for (c = begin; c < end; c++) {
+      const int y = c%M, z = c/M;
+      for (x = 0; x < M; x++) {
+         const size_t p = ((size_t)z*L + y)*L + x;
+         const size_t m = pm_index(M, x, y, z);
+         const int xm = x > 0 ? -1 : 0, xp = x < M - 1 ? 1 : 0;
+         const int ym = y > 0 ? -1 : 0, yp = y < M - 1 ? 1 : 0;
+         const int zm = z > 0 ? -1 : 0, zp = z < M - 1 ? 1 : 0;
+
+         pm->accel[0][m] = (crealf(pm->mesh[p + xp]) - crealf(pm->mesh[p + xm]))*inv_2h*2.0f/(xp - xm);
+         pm->accel[1][m] = (crealf(pm->mesh[p + (size_t)yp*L]) - crealf(pm->mesh[p + (ptrdiff_t)ym*L]))
+            *inv_2h*2.0f/(yp - ym);
+         pm->accel[2][m] = (crealf(pm->mesh[p + (size_t)zp*L*L]) - crealf(pm->mesh[p + (ptrdiff_t)zm*L*L]))
+            *inv_2h*2.0f/(zp - zm);
+      }
+   }
+}
+
+static void pm_gather(void * arg, const int tid, const int nthreads)
+{
+   pm_mesh_t * const pm = arg;
+   const int M = pm->M;
+   const float inv_h = 1.0f/pm->h;
+   size_t begin, end;
+   int i, e0, e1, e, d;
+
+   nbody_pool_range(pm->n, 1, tid, nthreads, &begin, &end);
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      const particles_block_t * const block = pm->particles + i;
+      force_block_t * const forces = pm->forces + i;
+      for (e = e0; e < e1; e++) {
+         const float u = (block->position_x[e] - pm->origin[0])*inv_h;
+         const float v = (block->position_y[e] - pm->origin[1])*inv_h;
+         const float w = (block->position_z[e] - pm->origin[2])*inv_h;
+         const int x = u, y = v, z = w;
+         const float fx = u - x, fy = v - y, fz = w - z;
+         float a[3];
+
+         for (d = 0; d < 3; d++) {
+            const float * const g = pm->accel[d];
+            a[d] = g[pm_index(M, x,     y,     z    )]*(1.0f - fx)*(1.0f - fy)*(1.0f - fz)
+                 + g[pm_index(M, x + 1, y,     z    )]*fx*(1.0f - fy)*(1.0f - fz)
+                 + g[pm_index(M, x,     y + 1, z    )]*(1.0f - fx)*fy*(1.0f - fz)
+                 + g[pm_index(M, x + 1, y + 1, z    )]*fx*fy*(1.0f - fz)
+                 + g[pm_index(M, x,     y,     z + 1)]*(1.0f - fx)*(1.0f - fy)*fz
+                 + g[pm_index(M, x + 1, y,     z + 1)]*fx*(1.0f - fy)*fz
+                 + g[pm_index(M, x,     y + 1, z + 1)]*(1.0f - fx)*fy*fz
+                 + g[pm_index(M, x + 1, y + 1, z + 1)]*fx*fy*fz;
+         }
+
+         forces->x[e] += block->mass[e]*a[0];
+         forces->y[e] += block->mass[e]*a[1];
+         forces->z[e] += block->mass[e]*a[2];
+      }
+   }
+}
+
+/* 1/r on the padded mesh for h = 1, with the distances wrapped around, and its
+ * transform. The self term uses the potential at the center of a uniform cube. */
+static void pm_setup_green(pm_mesh_t * const pm)
+{
+   const int L = pm->L;
+   const size_t points = (size_t)L*L*L;
+   size_t p;
+
+   for (p = 0; p < points; p++) {
+      const int x = p%L, y = (p/L)%L, z = p/((size_t)L*L);
+      const float dx = x < L/2 ? x : x - L;
+      const float dy = y < L/2 ? y : y - L;
+      const float dz = z < L/2 ? z : z - L;
+      const float r2 = dx*dx + dy*dy + dz*dz;
+      pm->mesh[p] = r2 == 0.0f ? 2.38f : 1.0f/sqrtf(r2);
+   }
+
+   /* Every line is needed here, so transform the full mesh pretending M = L */
+   const int M = pm->M;
+   pm->M = L;
+   pm_fft(pm, 0);
+   pm->M = M;
+
+   for (p = 0; p < points; p++) pm->green[p] = crealf(pm->mesh[p]);
+}
+
+static void pm_compute_forces(pm_mesh_t * const pm, double * phase)
+{
+   float min[3], max[3];
+   int d;
+
+   double start = wall_time();
+   nbody_phase(NBODY_PHASE_FORCES);
+   nbody_bounding_box(pm->particles, pm->n, min, max);
+   const float size = fmaxf(max[0] - min[0], fmaxf(max[1] - min[1], max[2] - min[2]));
+   pm->h = (size > 0.0f ? size : 1.0f)/(pm->M - 4);
+   for (d = 0; d < 3; d++) pm->origin[d] = min[d] - pm->h;
+   nbody_pool_run(pm_deposit, pm);
+   double now = wall_time();
+   phase[0] += now - start;
+
+   start = now;
+   pm_fft(pm, 0);
+   nbody_pool_run(pm_convolve, pm);
+   pm_fft(pm, 1);
+   now = wall_time();
+   phase[1] += now - start;
+
+   start = now;
+   nbody_pool_run(pm_gradient, pm);
+   nbody_pool_run(pm_gather, pm);
+   now = wall_time();
+   phase[2] += now - start;
+}
+
+double solve_nbody_pm(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times)
+{
+   const int M = opts->pm_grid, L = 2*M;
+   const size_t points = (size_t)L*L*L;
+   double phase[3] = { 0.0, 0.0, 0.0 };
+   pm_mesh_t pm;
+   int i, t;
+
+   assert(M >= 8 && (M & (M - 1)) == 0);
+
+   times[0] = wall_time();
+   nbody_pool_init(opts->threads);
+
+   memset(&pm, 0, sizeof(pm));
+   pm.particles = nbody->local;
+   pm.forces    = nbody->forces;
+   pm.n         = nbody->count;
+   pm.M         = M;
+   pm.L         = L;
+   pm.density   = malloc((size_t)opts->threads*M*M*M*sizeof(float));
+   pm.mesh      = malloc(points*sizeof(cfloat));
+   pm.green     = malloc(points*sizeof(float));
+   pm.twiddle   = malloc(L/2*sizeof(cfloat));
+   pm.reverse   = malloc(L*sizeof(int));
+   pm.scratch   = malloc((size_t)opts->threads*L*PM_BATCH*sizeof(cfloat));
+   for (i = 0; i < 3; i++) {
+      pm.accel[i] = malloc((size_t)M*M*M*sizeof(float));
+      assert(pm.accel[i] != NULL);
+   }
+   assert(pm.density && pm.mesh && pm.green && pm.twiddle && pm.reverse && pm.scratch);
+
+   for (i = 0; i < L/2; i++) pm.twiddle[i] = cexpf(-2.0f*I*(float)M_PI*i/L);
+   for (i = 0; i < L; i++) {
+      int r = 0, b;
+      for (b = 1; b < L; b <<= 1) r = (r << 1) | ((i & b) != 0);
+      pm.reverse[i] = r;
+   }
+   pm_setup_green(&pm);
+
+   if (opts->samples > 0) {
+      char label[64];
+      double warmup[3] = { 0.0, 0.0, 0.0 };
+      sprintf(label, "Particle-mesh (%d^3)", M);
+      pm_compute_forces(&pm, warmup);
+      nbody_force_error(label, nbody->local, nbody->forces, nbody->count, opts->samples);
+      memset(nbody->forces, 0, nbody->num_particles*sizeof(force_block_t));
+   }
+   times[1] = wall_time();
+
+   for (t = 0; t < nbody->timesteps; t++) {
+      pm_compute_forces(&pm, phase);
+      host_update_particles(nbody->local, nbody->forces, nbody->num_particles, nbody->count, conf->time_interval);
+      nbody_step();
+   }
+   times[2] = wall_time();
+
+   silent?:printf("> Particle-mesh phases (secs): deposit %f, fft %f, gather %f\n", phase[0], phase[1], phase[2]);
+
+   free(pm.density); free(pm.mesh); free(pm.green);
+   free(pm.twiddle); free(pm.reverse); free(pm.scratch);
+   for (i = 0; i < 3; i++) free(pm.accel[i]);
+   nbody_pool_fini();
+   times[3] = wall_time();
+
+   /* No pair is evaluated, see the effective throughput */
+   return 0.0;
+}
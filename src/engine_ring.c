@@ -0,0 +1,115 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include "engine.h"
+
+extern int silent;
+
+/* Distributed all-pairs engine. Every rank owns a slab of nbody->num_particles
+ * blocks and the slabs travel around the ring of ranks: at stage i a rank holds
+ * the slab of rank - i, computes the forces it exerts on its own particles and,
+ * at the same time, forwards it to rank + 1 while receiving the next one from
+ * rank - 1. After rank_size stages every slab has been visited and the local
+ * particles can be updated. Stage 0 uses the local slab itself, later ones
+ * alternate between the remote buffer and a second one. */
+
+typedef struct {
+   particles_block_t * local;
+   particles_block_t * source;
+   force_block_t     * forces;
+   int                 n_blocks;
+   size_t              count;        /* real particles of local */
+   size_t              source_count; /* real particles of the slab in source */
+} ring_args_t;
+
+/* Real particles of the slab of rank, as split by nbody_setup */
+static size_t ring_slab_count(const nbody_conf_t * const conf, const int n_blocks, const int rank)
+{
+   const size_t size  = (size_t)n_blocks*BLOCK_SIZE;
+   const size_t first = (size_t)rank*size;
+   return first >= conf->particles ? 0 : conf->particles - first < size ? conf->particles - first : size;
+}
+
+static void ring_forces(void * arg, const int tid, const int nthreads)
+{
+   const ring_args_t * const args = arg;
+   size_t begin, end;
+   int i, j, e0, e1;
+
+   nbody_pool_range(args->count, 16, tid, nthreads, &begin, &end);
+
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      for (j = 0; j < args->n_blocks; j++) {
+         nbody_forces_slice(args->forces + i, args->local + i, args->source + j, e0, e1,
+               nbody_block_count(args->source_count, j));
+      }
+   }
+}
+
+double solve_nbody_ring(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times)
+{
+   const int rank = nbody_comm_rank(), rank_size = nbody_comm_size();
+   const int n_blocks = nbody->num_particles;
+   particles_block_t * buffers[2];
+   double exchange_time = 0.0;
+   int t, i;
+
+   times[0] = wall_time();
+   nbody_pool_init(opts->threads);
+   buffers[0] = nbody->remote;
+   buffers[1] = rank_size > 2 ? nbody_alloc(n_blocks*sizeof(particles_block_t)) : NULL;
+   nbody_comm_barrier();
+   times[1] = wall_time();
+
+   for (t = 0; t < nbody->timesteps; t++) {
+      ring_args_t args = { nbody->local, nbody->local, nbody->forces, n_blocks, nbody->count, nbody->count };
+
+      for (i = 0; i < rank_size; i++) {
+         particles_block_t * const next = buffers[i%2];
+
+         nbody_phase(NBODY_PHASE_COMM);
+         if (i < rank_size - 1) exchange_particles_start(args.source, next, n_blocks, rank, rank_size, i);
+         nbody_phase(NBODY_PHASE_FORCES);
+         nbody_pool_run(ring_forces, &args);
+         if (i < rank_size - 1) {
+            const double start = wall_time();
+            nbody_phase(NBODY_PHASE_COMM);
+            exchange_particles_wait();
+            exchange_time += wall_time() - start;
+            args.source = next;
+            args.source_count = ring_slab_count(conf, n_blocks, (rank - i - 1 + rank_size)%rank_size);
+         }
+      }
+
+      host_update_particles(nbody->local, nbody->forces, n_blocks, nbody->count, conf->time_interval);
+      nbody_step();
+   }
+   times[2] = wall_time();
+
+   exchange_time = nbody_comm_max(exchange_time);
+   silent?:printf("> Ring exchange not hidden by compute (secs, slowest rank): %f\n", exchange_time);
+
+   if (buffers[1] != NULL) nbody_dealloc(buffers[1], n_blocks*sizeof(particles_block_t));
+   nbody_pool_fini();
+   times[3] = wall_time();
+
+   return (double)nbody->count*conf->particles*nbody->timesteps;
+}
@@ -0,0 +1,312 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include "engine.h"
+
+extern int silent;
+
+/* Ensemble mode: many small independent systems advanced in one process. Each
+ * line of the list describes a system, or `repeat` of them with consecutive
+ * seeds, and every system is generated in memory (philox or plummer) without
+ * rounding its particle count. The systems are packed first fit decreasing into
+ * shared particle and force blocks, each one starting on a cache line. A system
+ * never spans blocks, so it is a [offset, offset + particles) range of a block,
+ * which the cutoff kernel computes with an infinite cutoff: all the pairs of the
+ * range, vectorized over the sources. The systems need no synchronization between
+ * them, so each one is generated and advanced for all its timesteps by a single
+ * thread of the pool, the most expensive ones first, and stays in its caches. The
+ * update is the one of the kernels. */
+
+#define ENSEMBLE_ALIGN 16
+
+typedef struct {
+   int   particles;
+   int   timesteps;
+   int   seed;
+   int   plummer;
+   float mass_maximum;
+   float domain[3];
+   float time_interval;
+   int   block;     /* where it is packed */
+   int   offset;
+   double time;     /* secs to advance it */
+} ensemble_system_t;
+
+typedef struct {
+   ensemble_system_t * systems;
+   int                 n_systems;
+   int               * order;       /* most expensive first */
+   int                 next;        /* next entry of order to run */
+   particles_block_t * particles;
+   force_block_t     * forces;
+   particles_block_t * scratch;     /* one generated block per thread */
+} ensemble_t;
+
+static double ensemble_pairs(const ensemble_system_t * const s)
+{
+   return (double)s->particles*s->particles*s->timesteps;
+}
+
+/* Parses key=value items separated by blanks into s, the rest of the line after
+ * a # is a comment. Returns the repeat count, 0 for empty lines or -1 on errors */
+static int ensemble_parse_line(char * line, ensemble_system_t * const s)
+{
+   char * item, * save;
+   int repeat = 1, items = 0;
+
+   if (strchr(line, '#') != NULL) *strchr(line, '#') = '\0';
+
+   for (item = strtok_r(line, " \t\r\n", &save); item != NULL; item = strtok_r(NULL, " \t\r\n", &save)) {
+      char * value = strchr(item, '='), * end;
+      if (value == NULL) return -1;
+      *value++ = '\0';
+      items++;
+
+      if (strcmp(item, "particles") == 0) {
+         s->particles = strtol(value, &end, 10);
+      } else if (strcmp(item, "timesteps") == 0) {
+         s->timesteps = strtol(value, &end, 10);
+      } else if (strcmp(item, "seed") == 0) {
+         s->seed = strtol(value, &end, 10);
+      } else if (strcmp(item, "repeat") == 0) {
+         repeat = strtol(value, &end, 10);
+      } else if (strcmp(item, "mass") == 0) {
+         s->mass_maximum = strtof(value, &end);
+      } else if (strcmp(item, "dt") == 0) {
+         s->time_interval = strtof(value, &end);
+      } else if (strcmp(item, "domain") == 0) {
+         s->domain[0] = s->domain[1] = s->domain[2] = strtof(value, &end);
+         if (*end == ',') {
+            s->domain[1] = strtof(end + 1, &end);
+            if (*end != ',') return -1;
+            s->domain[2] = strtof(end + 1, &end);
+         }
+      } else if (strcmp(item, "generator") == 0) {
+         if (strcmp(value, "philox") != 0 && strcmp(value, "plummer") != 0) return -1;
+         s->plummer = strcmp(value, "plummer") == 0;
+         end = value + strlen(value);
+      } else {
+         return -1;
+      }
+      if (end == value || *end != '\0') return -1;
+   }
+
+   if (items == 0) return 0;
+   if (s->particles < 1 || s->particles > (int)BLOCK_SIZE || s->timesteps < 1 || repeat < 1 ||
+         s->mass_maximum <= 0.0f || s->time_interval <= 0.0f ||
+         s->domain[0] <= 0.0f || s->domain[1] <= 0.0f || s->domain[2] <= 0.0f) {
+      return -1;
+   }
+   return repeat;
+}
+
+static ensemble_system_t * ensemble_load(const char * fname, const nbody_opts_t * const opts, int * n_systems)
+{
+   FILE * f = fopen(fname, "r");
+   ensemble_system_t * systems = NULL;
+   char line[4096];
+   int n = 0, capacity = 0, lineno = 0, k;
+
+   if (f == NULL) {
+      fprintf(stderr, "Can not open the ensemble list %s\n", fname);
+      return NULL;
+   }
+
+   while (fgets(line, sizeof(line), f) != NULL) {
+      ensemble_system_t s = { 0, 0, default_seed, strcmp(opts->generator, "plummer") == 0, default_mass_maximum,
+                              { default_domain_size_x, default_domain_size_y, default_domain_size_z },
+                              opts->time_interval };
+      const int repeat = ensemble_parse_line(line, &s);
+      lineno++;
+
+      if (repeat < 0) {
+         fprintf(stderr, "%s:%d: bad system, it needs particles=1..%d and timesteps=N, and may set "
+               "seed, repeat, mass, dt, domain=X[,Y,Z] and generator=philox|plummer\n", fname, lineno, BLOCK_SIZE);
+         free(systems);
+         fclose(f);
+         return NULL;
+      }
+      for (k = 0; k < repeat; k++, n++) {
+         if (n == capacity) {
+            capacity = capacity ? 2*capacity : 64;
+            systems = realloc(systems, capacity*sizeof(ensemble_system_t));
+            assert(systems != NULL);
+         }
+         systems[n] = s;
+         systems[n].seed = s.seed + k;
+      }
+   }
+   fclose(f);
+
+   if (n == 0) fprintf(stderr, "No systems in the ensemble list %s\n", fname);
+   *n_systems = n;
+   return systems;
+}
+
+static const ensemble_system_t * ensemble_sort_systems;
+
+/* Decreasing particles, then list order */
+static int ensemble_compare_size(const void * a, const void * b)
+{
+   const int pa = ensemble_sort_systems[*(const int *)a].particles;
+   const int pb = ensemble_sort_systems[*(const int *)b].particles;
+   if (pa != pb) return pb - pa;
+   return *(const int *)a - *(const int *)b;
+}
+
+/* Decreasing pairs, then list order */
+static int ensemble_compare_cost(const void * a, const void * b)
+{
+   const double ca = ensemble_pairs(&ensemble_sort_systems[*(const int *)a]);
+   const double cb = ensemble_pairs(&ensemble_sort_systems[*(const int *)b]);
+   if (ca != cb) return ca < cb ? 1 : -1;
+   return *(const int *)a - *(const int *)b;
+}
+
+/* First fit decreasing by particles, returns the number of blocks */
+static int ensemble_pack(ensemble_system_t * const systems, const int n_systems)
+{
+   int * order = malloc(n_systems*sizeof(int));
+   int * used  = malloc(n_systems*sizeof(int));   /* particles taken in each block */
+   int i, b, n_blocks = 0;
+   assert(order != NULL && used != NULL);
+
+   for (i = 0; i < n_systems; i++) order[i] = i;
+   ensemble_sort_systems = systems;
+   qsort(order, n_systems, sizeof(int), ensemble_compare_size);
+
+   for (i = 0; i < n_systems; i++) {
+      ensemble_system_t * const s = &systems[order[i]];
+      for (b = 0; b < n_blocks && used[b] + s->particles > (int)BLOCK_SIZE; b++);
+      if (b == n_blocks) used[n_blocks++] = 0;
+      s->block  = b;
+      s->offset = used[b];
+      used[b]   = roundup(used[b] + s->particles, ENSEMBLE_ALIGN);
+   }
+
+   free(used);
+   free(order);
+   return n_blocks;
+}
+
+static void ensemble_run(void * arg, const int tid, const int nthreads)
+{
+   ensemble_t * const ens = arg;
+   particles_block_t * const scratch = ens->scratch + tid;
+   int k, t;
+   (void)nthreads;
+
+   while ((k = __atomic_fetch_add(&ens->next, 1, __ATOMIC_RELAXED)) < ens->n_systems) {
+      ensemble_system_t * const s = &ens->systems[ens->order[k]];
+      particles_block_t * const part = ens->particles + s->block;
+      force_block_t * const forces = ens->forces + s->block;
+      const int e0 = s->offset, e1 = s->offset + s->particles;
+      nbody_conf_t conf = { s->domain[0], s->domain[1], s->domain[2], s->mass_maximum, s->time_interval,
+                            s->seed, "ensemble", s->timesteps, 1, s->particles };
+
+      if (s->plummer) particle_init_plummer(&conf, scratch, 0, s->particles);
+      else            particle_init_philox(&conf, scratch, 0);
+      memcpy(&part->position_x[e0], &scratch->position_x[0], s->particles*sizeof(float));
+      memcpy(&part->position_y[e0], &scratch->position_y[0], s->particles*sizeof(float));
+      memcpy(&part->position_z[e0], &scratch->position_z[0], s->particles*sizeof(float));
+      memcpy(&part->velocity_x[e0], &scratch->velocity_x[0], s->particles*sizeof(float));
+      memcpy(&part->velocity_y[e0], &scratch->velocity_y[0], s->particles*sizeof(float));
+      memcpy(&part->velocity_z[e0], &scratch->velocity_z[0], s->particles*sizeof(float));
+      memcpy(&part->mass[e0],       &scratch->mass[0],       s->particles*sizeof(float));
+      memcpy(&part->weight[e0],     &scratch->weight[0],     s->particles*sizeof(float));
+
+      cell_particles_t cells = { part->position_x, part->position_y, part->position_z, part->weight, part->mass,
+                                 forces->x, forces->y, forces->z };
+      const double start = wall_time();
+      for (t = 0; t < s->timesteps; t++) {
+         nbody_cutoff_slice(&cells, e0, e1, e0, e1, INFINITY);
+         host_update_slice(part, forces, e0, e1, s->time_interval);
+      }
+      s->time = wall_time() - start;
+   }
+}
+
+int nbody_ensemble(const char * fname, const nbody_opts_t * const opts)
+{
+   ensemble_t ens;
+   double times[3], pairs = 0.0;
+   size_t particles = 0;
+   int i;
+
+   ens.systems = ensemble_load(fname, opts, &ens.n_systems);
+   if (ens.systems == NULL || ens.n_systems == 0) return 1;
+
+   times[0] = wall_time();
+   const int n_blocks = ensemble_pack(ens.systems, ens.n_systems);
+   const size_t particles_size = n_blocks*sizeof(particles_block_t);
+   const size_t forces_size    = n_blocks*sizeof(force_block_t);
+
+   ens.order = malloc(ens.n_systems*sizeof(int));
+   assert(ens.order != NULL);
+   for (i = 0; i < ens.n_systems; i++) ens.order[i] = i;
+   ensemble_sort_systems = ens.systems;
+   qsort(ens.order, ens.n_systems, sizeof(int), ensemble_compare_cost);
+   ens.next = 0;
+
+   nbody_pool_init(opts->threads);
+   const size_t scratch_size = nbody_pool_size()*sizeof(particles_block_t);
+   /* Pages are first touched by the thread that runs the system */
+   ens.particles = nbody_alloc(particles_size);
+   ens.forces    = nbody_alloc(forces_size);
+   ens.scratch   = nbody_alloc(scratch_size);
+   times[1] = wall_time();
+
+   nbody_pool_run(ensemble_run, &ens);
+   times[2] = wall_time();
+
+   nbody_pool_fini();
+   nbody_dealloc(ens.scratch, scratch_size);
+   nbody_dealloc(ens.forces, forces_size);
+   nbody_dealloc(ens.particles, particles_size);
+
+   for (i = 0; i < ens.n_systems; i++) {
+      const ensemble_system_t * const s = &ens.systems[i];
+      particles += s->particles;
+      pairs     += ensemble_pairs(s);
+      silent?:printf("> System %d: %d particles, %d steps, seed %d, %s, block %d+%d: %f secs, %f gpairs/s\n",
+            i, s->particles, s->timesteps, s->seed, s->plummer ? "plummer" : "philox", s->block, s->offset,
+            s->time, ensemble_pairs(s)/1e9/s->time);
+   }
+   free(ens.order);
+   free(ens.systems);
+
+   printf( "==================== RESULTS ===================== \n" );
+   printf( "  Benchmark: %s (%s)\n", "N-Body", "OmpSs");
+   printf( "  Engine: %s (%s)\n", "ensemble", "independent systems packed in shared blocks");
+   printf( "  Threads: %d\n", opts->threads );
+   /* The cutoff kernel always uses sqrt+div and has no tile */
+   printf( "  Kernel: %s, cutoff, sqrt+div\n", nbody_simd_isa() );
+   printf( "  Systems: %d\n", ens.n_systems );
+   printf( "  Total particles: %zu\n", particles );
+   printf( "  Blocks: %d (%.1f%% used)\n", n_blocks, 100.0*particles/((double)n_blocks*BLOCK_SIZE) );
+   printf( "  Verification: %s\n", "n/a" );
+   printf( "  Warm up time (secs): %f\n", times[1] - times[0]);
+   printf( "  Execution time (secs): %f\n", times[2] - times[1]);
+   printf( "  Throughput (gpairs/s): %f\t\n", pairs/1e9/(times[2] - times[1]));
+   printf( "================================================== \n" );
+   return 0;
+}
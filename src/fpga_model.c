@@ -0,0 +1,200 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "nbody.h"
+
+extern int silent;
+
+/* Cycle model of the accelerators in kernel_*.c, to compare FPGA designs
+ * without building their bitstreams. The host builds run the same kernels
+ * functionally, this only predicts how long the FPGA would take for them.
+ *
+ * calculate_forces_BLOCK copies its 11 input arrays of BLOCK_SIZE floats to
+ * local memory (localmem_copies), one port width per cycle after a fixed
+ * latency per copy, runs the i loop of every j with the given II over
+ * NCALCFORCES unrolled lanes plus the pipeline depth, and copies the 3 force
+ * arrays back. The tasks of a target block are chained by their forces, so
+ * the instances run min(accs, blocks) chains at a time. update_particles_BLOCK
+ * has a single instance and a pipeline of II 7. Updates are not overlapped
+ * with the forces of the next step, and the instances share a memory of the
+ * given bandwidth (0 for unlimited). The latencies, depths and task overheads
+ * are estimates to be calibrated against a real bitstream. */
+
+#ifndef FPGA_CLOCK
+#  define FPGA_CLOCK 200
+#endif
+
+enum { MODEL_CLOCK, MODEL_WIDTH, MODEL_LANES, MODEL_ACCS, MODEL_BLOCK, MODEL_II, MODEL_DEPTH,
+       MODEL_LATENCY, MODEL_TASK, MODEL_BANDWIDTH, MODEL_KEYS };
+
+static const char * const model_keys[MODEL_KEYS] = {
+   "clock", "width", "lanes", "accs", "block", "ii", "depth", "latency", "task", "bandwidth"
+};
+
+#define MODEL_MAX_VALUES  16
+#define MODEL_MAX_CONFIGS 4096
+
+static const int    UPDATE_II    = 7;
+static const int    UPDATE_DEPTH = 40;
+
+static struct {
+   double values[MODEL_KEYS][MODEL_MAX_VALUES];
+   int    count[MODEL_KEYS];
+} model;
+
+typedef struct {
+   double time;       /* s */
+   double compute;    /* cycles of the force pipelines */
+   double transfers;  /* cycles of the force copies */
+   double update;     /* cycles of the updates */
+   double overhead;   /* cycles of the task launches */
+} model_result_t;
+
+/* Parses key=value[:value...] items separated by commas, "build" alone keeps
+ * the build configuration */
+int nbody_fpga_model_parse(const char * spec)
+{
+   const double defaults[MODEL_KEYS] = {
+      FPGA_CLOCK, FPGA_PWIDTH, NCALCFORCES, FBLOCK_NUM_ACCS, BLOCK_SIZE, 1, 64, 100,
+      strcmp(FPGA_HWRUNTIME, "pom") == 0 ? 100 : 500, 0
+   };
+   int k;
+
+   for (k = 0; k < MODEL_KEYS; k++) {
+      model.values[k][0] = defaults[k];
+      model.count[k] = 0;
+   }
+   if (strcmp(spec, "build") == 0) spec = "";
+
+   while (*spec != '\0') {
+      const char * eq = strchr(spec, '=');
+      if (eq == NULL) return -1;
+      for (k = 0; k < MODEL_KEYS; k++) {
+         if (strlen(model_keys[k]) == (size_t)(eq - spec) && strncmp(model_keys[k], spec, eq - spec) == 0) break;
+      }
+      if (k == MODEL_KEYS || model.count[k] > 0) return -1;
+
+      spec = eq;
+      do {
+         char * end;
+         const double value = strtod(spec + 1, &end);
+         if (end == spec + 1 || value < 0.0 || model.count[k] == MODEL_MAX_VALUES) return -1;
+         /* Sizes and rates have to be positive, latencies and the bandwidth may be 0 */
+         if (value == 0.0 && k != MODEL_BANDWIDTH && k != MODEL_LATENCY && k != MODEL_TASK && k != MODEL_DEPTH) return -1;
+         model.values[k][model.count[k]++] = value;
+         spec = end;
+      } while (*spec == ':');
+      if (*spec == ',') spec++;
+      else if (*spec != '\0') return -1;
+   }
+
+   size_t configs = 1;
+   for (k = 0; k < MODEL_KEYS; k++) {
+      if (model.count[k] == 0) model.count[k] = 1;
+      configs *= model.count[k];
+   }
+   return configs <= MODEL_MAX_CONFIGS ? 0 : -1;
+}
+
+/* Cycles of a localmem copy of the given bytes */
+static double model_copy(const double * c, const double bytes, const double contention)
+{
+   return c[MODEL_LATENCY] + contention*ceil(bytes/(c[MODEL_WIDTH]/8.0));
+}
+
+static model_result_t model_run(const double * c, const size_t particles, const int timesteps)
+{
+   const double block  = c[MODEL_BLOCK];
+   const double blocks = ceil((double)particles/block);
+   const double accs   = c[MODEL_ACCS] < blocks ? c[MODEL_ACCS] : blocks;
+   const double array  = block*sizeof(float);
+
+   /* Concurrent copies beyond the memory bandwidth slow down evenly */
+   double contention = 1.0;
+   if (c[MODEL_BANDWIDTH] > 0.0) {
+      contention = accs*c[MODEL_WIDTH]/8.0*c[MODEL_CLOCK]*1e6/(c[MODEL_BANDWIDTH]*1e9);
+      if (contention < 1.0) contention = 1.0;
+   }
+
+   const double compute   = block*(ceil(block/c[MODEL_LANES])*c[MODEL_II] + c[MODEL_DEPTH]);
+   const double transfers = 11*model_copy(c, array, contention) + 3*model_copy(c, array, contention);
+   const double update    = model_copy(c, 8*array, 1.0) + model_copy(c, 3*array, 1.0) +
+      block*UPDATE_II + UPDATE_DEPTH + model_copy(c, 6*array, 1.0) + model_copy(c, 3*array, 1.0);
+
+   /* Chains of blocks force tasks, accs at a time, then the updates one by one */
+   const double rounds = ceil(blocks/accs)*blocks*timesteps;
+   model_result_t r;
+   r.compute   = rounds*compute;
+   r.transfers = rounds*transfers;
+   r.update    = blocks*timesteps*update;
+   r.overhead  = (rounds + blocks*timesteps)*c[MODEL_TASK];
+   r.time      = (r.compute + r.transfers + r.update + r.overhead)/(c[MODEL_CLOCK]*1e6);
+   return r;
+}
+
+void nbody_fpga_model_report(const size_t particles, const int timesteps)
+{
+   double c[MODEL_KEYS], best_rate = 0.0;
+   int idx[MODEL_KEYS] = { 0 }, k, configs = 1, n, best = 0;
+
+   for (k = 0; k < MODEL_KEYS; k++) configs *= model.count[k];
+
+   if (configs > 1) {
+      silent?:printf("> FPGA model (%s, %zu particles, %d steps):\n", FPGA_HWRUNTIME, particles, timesteps);
+      silent?:printf(">   %6s %6s %5s %4s %6s %3s %5s %7s %5s %9s %10s %10s %8s %9s %7s %8s\n",
+            "clock", "width", "lanes", "accs", "block", "ii", "depth", "latency", "task", "bandwidth",
+            "time (s)", "gpairs/s", "compute", "transfers", "update", "overhead");
+   }
+   for (n = 0; n < configs; n++) {
+      for (k = 0; k < MODEL_KEYS; k++) c[k] = model.values[k][idx[k]];
+
+      const model_result_t r = model_run(c, particles, timesteps);
+      /* Pairs of real particles, so that the padding of a large block counts against it */
+      const double rate   = (double)particles*particles*timesteps/r.time/1e9;
+      const double cycles = r.compute + r.transfers + r.update + r.overhead;
+      if (rate > best_rate) best_rate = rate, best = n;
+
+      if (configs > 1) {
+         silent?:printf(">   %6g %6g %5g %4g %6g %3g %5g %7g %5g %9g %10.6f %10.4f %7.1f%% %8.1f%% %6.1f%% %7.1f%%\n",
+               c[MODEL_CLOCK], c[MODEL_WIDTH], c[MODEL_LANES], c[MODEL_ACCS], c[MODEL_BLOCK], c[MODEL_II],
+               c[MODEL_DEPTH], c[MODEL_LATENCY], c[MODEL_TASK], c[MODEL_BANDWIDTH], r.time, rate,
+               100.0*r.compute/cycles, 100.0*r.transfers/cycles, 100.0*r.update/cycles, 100.0*r.overhead/cycles);
+      } else {
+         silent?:printf("> FPGA model (%s, %g MHz, %g-bit port, %g lanes, %g instances, block %g): "
+               "%f secs, %.4f gpairs/s\n", FPGA_HWRUNTIME, c[MODEL_CLOCK], c[MODEL_WIDTH], c[MODEL_LANES],
+               c[MODEL_ACCS], c[MODEL_BLOCK], r.time, rate);
+         silent?:printf("> FPGA model cycles: compute %.1f%%, transfers %.1f%%, update %.1f%%, task overhead %.1f%%\n",
+               100.0*r.compute/cycles, 100.0*r.transfers/cycles, 100.0*r.update/cycles, 100.0*r.overhead/cycles);
+      }
+
+      /* Next configuration, the last key changing fastest */
+      for (k = MODEL_KEYS - 1; k >= 0 && ++idx[k] == model.count[k]; k--) idx[k] = 0;
+   }
+
+   if (configs > 1) {
+      for (k = MODEL_KEYS - 1, n = best; k >= 0; k--) {
+         c[k] = model.values[k][n % model.count[k]];
+         n /= model.count[k];
+      }
+      silent?:printf("> FPGA model best: %g MHz, %g-bit port, %g lanes, %g instances, block %g, %.4f gpairs/s\n",
+            c[MODEL_CLOCK], c[MODEL_WIDTH], c[MODEL_LANES], c[MODEL_ACCS], c[MODEL_BLOCK], best_rate);
+   }
+}
@@ -0,0 +1,259 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <sys/mman.h>
+#include "engine.h"
+
+/* Integrators of the direct engine besides the euler update of the kernels:
+ *   leapfrog  kick-drift-kick, second order and symplectic, one force
+ *             evaluation per step plus one per solve to start
+ *   hermite   fourth order predictor-corrector (Makino & Aarseth 1992) with the
+ *             jerk computed alongside the acceleration
+ * Both keep the forces of the last step in memory only and a solve starts by
+ * evaluating them again. For leapfrog those are the same forces, so split runs
+ * (checkpoints, trajectories) are bit-identical to whole ones. Hermite evaluates
+ * at the predicted positions and velocities, so a split run starts from the
+ * corrected ones instead and differs in the last bits. */
+
+static const char * const integrator_names[] = { "euler", "leapfrog", "hermite" };
+static const int num_integrators = sizeof(integrator_names)/sizeof(integrator_names[0]);
+
+int nbody_integrator_find(const char * name)
+{
+   int i;
+   for (i = 0; i < num_integrators; i++) {
+      if (strcmp(integrator_names[i], name) == 0) return i;
+   }
+   return -1;
+}
+
+static const size_t INTEGRATOR_SLICE_ALIGN = 16;
+
+typedef struct {
+   particles_block_t * particles;
+   force_block_t     * forces;
+   int                 n_blocks;
+   size_t              count;       /* real particles, the padding is only a weightless source */
+   float               dt;
+   particles_block_t * predicted;   /* hermite */
+   force_block_t     * acc[2];      /* acceleration and jerk at the start and end of the step */
+   force_block_t     * jerk[2];
+} integrator_args_t;
+
+/* Leapfrog: v += F/m*dt/2, x += v*dt, and the forces are cleared for the next evaluation */
+static void leapfrog_kick_drift(void * arg, const int tid, const int nthreads)
+{
+   const integrator_args_t * const args = arg;
+   size_t begin, end;
+   int i, e, e0, e1;
+
+   nbody_pool_range(args->count, INTEGRATOR_SLICE_ALIGN, tid, nthreads, &begin, &end);
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      particles_block_t * const part = args->particles + i;
+      force_block_t * const forces = args->forces + i;
+
+      for (e = e0; e < e1; e++) {
+         const float half_dt_by_mass = 0.5f * args->dt / part->mass[e];
+         part->velocity_x[e] += forces->x[e] * half_dt_by_mass;
+         part->velocity_y[e] += forces->y[e] * half_dt_by_mass;
+         part->velocity_z[e] += forces->z[e] * half_dt_by_mass;
+         part->position_x[e] += part->velocity_x[e] * args->dt;
+         part->position_y[e] += part->velocity_y[e] * args->dt;
+         part->position_z[e] += part->velocity_z[e] * args->dt;
+         forces->x[e] = 0.0f;
+         forces->y[e] = 0.0f;
+         forces->z[e] = 0.0f;
+      }
+   }
+}
+
+/* Leapfrog: v += F/m*dt/2 with the forces of the new positions, kept for the next step */
+static void leapfrog_kick(void * arg, const int tid, const int nthreads)
+{
+   const integrator_args_t * const args = arg;
+   size_t begin, end;
+   int i, e, e0, e1;
+
+   nbody_pool_range(args->count, INTEGRATOR_SLICE_ALIGN, tid, nthreads, &begin, &end);
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      particles_block_t * const part = args->particles + i;
+      const force_block_t * const forces = args->forces + i;
+
+      for (e = e0; e < e1; e++) {
+         const float half_dt_by_mass = 0.5f * args->dt / part->mass[e];
+         part->velocity_x[e] += forces->x[e] * half_dt_by_mass;
+         part->velocity_y[e] += forces->y[e] * half_dt_by_mass;
+         part->velocity_z[e] += forces->z[e] * half_dt_by_mass;
+      }
+   }
+}
+
+double solve_nbody_leapfrog(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times)
+{
+   integrator_args_t args = { nbody->local, nbody->forces, nbody->num_particles, nbody->count, conf->time_interval };
+   int t;
+
+   times[0] = wall_time();
+   nbody_pool_init(opts->threads);
+   host_forces(nbody->local, nbody->forces, nbody->num_particles, nbody->count);
+   times[1] = wall_time();
+
+   for (t = 0; t < nbody->timesteps; t++) {
+      nbody_phase(NBODY_PHASE_UPDATE);
+      nbody_pool_run(leapfrog_kick_drift, &args);
+      host_forces(nbody->local, nbody->forces, nbody->num_particles, nbody->count);
+      nbody_phase(NBODY_PHASE_UPDATE);
+      nbody_pool_run(leapfrog_kick, &args);
+      nbody_step();
+   }
+   memset(nbody->forces, 0, nbody->num_particles*sizeof(force_block_t));
+   times[2] = wall_time();
+
+   nbody_pool_fini();
+   times[3] = wall_time();
+
+   const double n = (double)nbody->count;
+   return n*n*(nbody->timesteps + 1);
+}
+
+/* Acceleration and jerk of the predicted particles into acc[1] and jerk[1] */
+static void hermite_forces(void * arg, const int tid, const int nthreads)
+{
+   const integrator_args_t * const args = arg;
+   size_t begin, end;
+   int i, j, e, e0, e1;
+
+   nbody_pool_range(args->count, INTEGRATOR_SLICE_ALIGN, tid, nthreads, &begin, &end);
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      force_block_t * const acc  = args->acc[1] + i;
+      force_block_t * const jerk = args->jerk[1] + i;
+
+      for (e = e0; e < e1; e++) {
+         acc->x[e]  = acc->y[e]  = acc->z[e]  = 0.0f;
+         jerk->x[e] = jerk->y[e] = jerk->z[e] = 0.0f;
+      }
+      for (j = 0; j < args->n_blocks; j++) {
+         nbody_hermite_slice(acc, jerk, args->predicted + i, args->predicted + j, e0, e1,
+               nbody_block_count(args->count, j));
+      }
+   }
+}
+
+/* x + v*dt + a*dt^2/2 + j*dt^3/6 and v + a*dt + j*dt^2/2 */
+static void hermite_predict(void * arg, const int tid, const int nthreads)
+{
+   const integrator_args_t * const args = arg;
+   const float dt = args->dt;
+   size_t begin, end;
+   int i, e, e0, e1;
+
+   nbody_pool_range(args->count, INTEGRATOR_SLICE_ALIGN, tid, nthreads, &begin, &end);
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      const particles_block_t * const part = args->particles + i;
+      particles_block_t * const pred = args->predicted + i;
+      const force_block_t * const acc  = args->acc[0] + i;
+      const force_block_t * const jerk = args->jerk[0] + i;
+
+      for (e = e0; e < e1; e++) {
+         pred->position_x[e] = part->position_x[e] + dt * (part->velocity_x[e] + dt * (0.5f * acc->x[e] + dt * jerk->x[e] / 6.0f));
+         pred->position_y[e] = part->position_y[e] + dt * (part->velocity_y[e] + dt * (0.5f * acc->y[e] + dt * jerk->y[e] / 6.0f));
+         pred->position_z[e] = part->position_z[e] + dt * (part->velocity_z[e] + dt * (0.5f * acc->z[e] + dt * jerk->z[e] / 6.0f));
+         pred->velocity_x[e] = part->velocity_x[e] + dt * (acc->x[e] + 0.5f * dt * jerk->x[e]);
+         pred->velocity_y[e] = part->velocity_y[e] + dt * (acc->y[e] + 0.5f * dt * jerk->y[e]);
+         pred->velocity_z[e] = part->velocity_z[e] + dt * (acc->z[e] + 0.5f * dt * jerk->z[e]);
+      }
+   }
+}
+
+/* v1 = v + (a0 + a1)*dt/2 + (j0 - j1)*dt^2/12 and x1 = x + (v + v1)*dt/2 + (a0 - a1)*dt^2/12 */
+static void hermite_correct(void * arg, const int tid, const int nthreads)
+{
+   const integrator_args_t * const args = arg;
+   const float dt = args->dt, dt2_12 = args->dt * args->dt / 12.0f;
+   size_t begin, end;
+   int i, e, e0, e1;
+
+   nbody_pool_range(args->count, INTEGRATOR_SLICE_ALIGN, tid, nthreads, &begin, &end);
+   while (nbody_next_slice(&begin, end, &i, &e0, &e1)) {
+      particles_block_t * const part = args->particles + i;
+      const force_block_t * const a0 = args->acc[0] + i, * const a1 = args->acc[1] + i;
+      const force_block_t * const j0 = args->jerk[0] + i, * const j1 = args->jerk[1] + i;
+
+      for (e = e0; e < e1; e++) {
+         const float vel_x = part->velocity_x[e] + 0.5f * dt * (a0->x[e] + a1->x[e]) + dt2_12 * (j0->x[e] - j1->x[e]);
+         const float vel_y = part->velocity_y[e] + 0.5f * dt * (a0->y[e] + a1->y[e]) + dt2_12 * (j0->y[e] - j1->y[e]);
+         const float vel_z = part->velocity_z[e] + 0.5f * dt * (a0->z[e] + a1->z[e]) + dt2_12 * (j0->z[e] - j1->z[e]);
+
+         part->position_x[e] += 0.5f * dt * (part->velocity_x[e] + vel_x) + dt2_12 * (a0->x[e] - a1->x[e]);
+         part->position_y[e] += 0.5f * dt * (part->velocity_y[e] + vel_y) + dt2_12 * (a0->y[e] - a1->y[e]);
+         part->position_z[e] += 0.5f * dt * (part->velocity_z[e] + vel_z) + dt2_12 * (a0->z[e] - a1->z[e]);
+         part->velocity_x[e] = vel_x;
+         part->velocity_y[e] = vel_y;
+         part->velocity_z[e] = vel_z;
+      }
+   }
+}
+
+double solve_nbody_hermite(nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, double * times)
+{
+   const size_t forces_size = nbody->num_particles*sizeof(force_block_t);
+   const size_t blocks_size = nbody->num_particles*sizeof(particles_block_t);
+   integrator_args_t args = { nbody->local, nbody->forces, nbody->num_particles, nbody->count,
+                              conf->time_interval, nbody_alloc(blocks_size),
+                              { nbody_alloc(forces_size), nbody_alloc(forces_size) },
+                              { nbody_alloc(forces_size), nbody_alloc(forces_size) } };
+   force_block_t * swap;
+   int t;
+
+   times[0] = wall_time();
+   nbody_pool_init(opts->threads);
+   memcpy(args.predicted, nbody->local, blocks_size);
+   nbody_phase(NBODY_PHASE_FORCES);
+   nbody_pool_run(hermite_forces, &args);
+   times[1] = wall_time();
+
+   for (t = 0; t < nbody->timesteps; t++) {
+      swap = args.acc[0];  args.acc[0]  = args.acc[1];  args.acc[1]  = swap;
+      swap = args.jerk[0]; args.jerk[0] = args.jerk[1]; args.jerk[1] = swap;
+      nbody_phase(NBODY_PHASE_UPDATE);
+      nbody_pool_run(hermite_predict, &args);
+      nbody_phase(NBODY_PHASE_FORCES);
+      nbody_pool_run(hermite_forces, &args);
+      nbody_phase(NBODY_PHASE_UPDATE);
+      nbody_pool_run(hermite_correct, &args);
+      nbody_step();
+   }
+   times[2] = wall_time();
+
+   nbody_dealloc(args.predicted, blocks_size);
+   for (t = 0; t < 2; t++) {
+      nbody_dealloc(args.acc[t], forces_size);
+      nbody_dealloc(args.jerk[t], forces_size);
+   }
+   nbody_pool_fini();
+   times[3] = wall_time();
+
+   const double n = (double)nbody->count;
+   return n*n*(nbody->timesteps + 1);
+}
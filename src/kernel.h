@@ -33,7 +33,7 @@ static const unsigned int BLOCK_SIZE = NBODY_BLOCK_SIZE;
 #pragma omp target device(fpga)
 static const unsigned int NCALCFORCES = NBODY_NCALCFORCES;
 #pragma omp target device(fpga)
-const unsigned int FPGA_PWIDTH = FPGA_MEMORY_PORT_WIDTH;
+static const unsigned int FPGA_PWIDTH = FPGA_MEMORY_PORT_WIDTH;
 static const unsigned int FBLOCK_NUM_ACCS = NBODY_NUM_FBLOCK_ACCS;
 
 static const unsigned int PARTICLES_FPGABLOCK_POS_X_OFFSET  = 0*NBODY_BLOCK_SIZE;
@@ -72,7 +72,9 @@ typedef struct {
 
 typedef force_block_t * __restrict__ const force_ptr_t;
 
-void solve_nbody_wrapper(particles_block_t * __restrict__ particles, force_block_t * __restrict__ forces,
-      const int n_blocks, const int timesteps, const float time_interval, double * times );
+/* next is scratch space for the double buffered positions, the result is left in particles */
+void solve_nbody_wrapper(particles_block_t * __restrict__ particles, particles_block_t * __restrict__ next,
+      force_block_t * __restrict__ forces, const int n_blocks, const int timesteps, const float time_interval,
+      double * times );
 
 #endif //__KERNEL_H__
@@ -109,19 +109,22 @@ void calculate_forces(const int n_blocks, float * forces, const float * particle
 }
 
 #pragma omp target device(fpga) localmem_copies no_copy_deps \
-  copy_inout([PARTICLES_FPGABLOCK_SIZE]particles, [FORCE_FPGABLOCK_SIZE]forces)
-#pragma omp task label(update_partices_BLOCK) inout(particles[PARTICLES_FPGABLOCK_POS_X_OFFSET], particles[PARTICLES_FPGABLOCK_POS_Y_OFFSET])
-void update_particles_BLOCK(float * particles, float * forces, const float time_interval)
+  copy_in([PARTICLES_FPGABLOCK_SIZE]particles) copy_out([PARTICLES_FPGABLOCK_MASS_OFFSET]next) \
+  copy_inout([FORCE_FPGABLOCK_SIZE]forces)
+#pragma omp task label(update_partices_BLOCK) \
+  out(next[PARTICLES_FPGABLOCK_POS_X_OFFSET], next[PARTICLES_FPGABLOCK_POS_Y_OFFSET]) inout([FORCE_FPGABLOCK_SIZE]forces)
+void update_particles_BLOCK(const float * particles, float * next, float * forces, const float time_interval)
 {
     #pragma HLS inline
     #pragma HLS array_partition variable=forces cyclic factor=FPGA_PWIDTH/64
     #pragma HLS array_partition variable=particles cyclic factor=FPGA_PWIDTH/64
+    #pragma HLS array_partition variable=next cyclic factor=FPGA_PWIDTH/64
 
    int e;
    for (e=0; e < BLOCK_SIZE; e++) {
       //There are 7 loads to the particles array which can't be done in the same cycle
       #pragma HLS pipeline II=7
-      #pragma HLS dependence variable=particles inter false
+      #pragma HLS dependence variable=next inter false
       #pragma HLS dependence variable=forces inter false
 
       const float mass       = particles[PARTICLES_FPGABLOCK_MASS_OFFSET + e];
@@ -144,13 +147,13 @@ void update_particles_BLOCK(float * particles, float * forces, const float time_
       const float position_change_y = velocity_y + velocity_change_y * half_time_interval;
       const float position_change_z = velocity_z + velocity_change_z * half_time_interval;
 
-      particles[PARTICLES_FPGABLOCK_VEL_X_OFFSET + e] = velocity_x + velocity_change_x;
-      particles[PARTICLES_FPGABLOCK_VEL_Y_OFFSET + e] = velocity_y + velocity_change_y;
-      particles[PARTICLES_FPGABLOCK_VEL_Z_OFFSET + e] = velocity_z + velocity_change_z;
+      next[PARTICLES_FPGABLOCK_VEL_X_OFFSET + e] = velocity_x + velocity_change_x;
+      next[PARTICLES_FPGABLOCK_VEL_Y_OFFSET + e] = velocity_y + velocity_change_y;
+      next[PARTICLES_FPGABLOCK_VEL_Z_OFFSET + e] = velocity_z + velocity_change_z;
 
-      particles[PARTICLES_FPGABLOCK_POS_X_OFFSET + e] = position_x + position_change_x;
-      particles[PARTICLES_FPGABLOCK_POS_Y_OFFSET + e] = position_y + position_change_y;
-      particles[PARTICLES_FPGABLOCK_POS_Z_OFFSET + e] = position_z + position_change_z;
+      next[PARTICLES_FPGABLOCK_POS_X_OFFSET + e] = position_x + position_change_x;
+      next[PARTICLES_FPGABLOCK_POS_Y_OFFSET + e] = position_y + position_change_y;
+      next[PARTICLES_FPGABLOCK_POS_Z_OFFSET + e] = position_z + position_change_z;
 
       forces[FORCE_FPGABLOCK_X_OFFSET + e] = 0.0f;
       forces[FORCE_FPGABLOCK_Y_OFFSET + e] = 0.0f;
@@ -158,47 +161,64 @@ void update_particles_BLOCK(float * particles, float * forces, const float time_
    }
 }
 
-void update_particles(const int n_blocks, float * particles,
+void update_particles(const int n_blocks, const float * particles, float * next,
       float * forces, const float time_interval)
 {
    #pragma HLS inline
    int i;
    for (i = 0; i < n_blocks; i++) {
-      update_particles_BLOCK(particles + i*PARTICLES_FPGABLOCK_SIZE, forces + i*FORCE_FPGABLOCK_SIZE, time_interval);
+      update_particles_BLOCK(particles + i*PARTICLES_FPGABLOCK_SIZE, next + i*PARTICLES_FPGABLOCK_SIZE,
+            forces + i*FORCE_FPGABLOCK_SIZE, time_interval);
    }
 }
 
-void solve_nbody(float * particles, float * forces, const int n_blocks,
+/* Positions are double buffered: step t reads one buffer and writes the other,
+ * so no update has to wait for the forces still reading its old positions.
+ * Updating block i only waits for its force row and the forces of the next
+ * step only wait for the two blocks they read, there is no barrier between
+ * steps. The buffers alternate so that the last step writes particles.
+ * Picos takes 3 dependencies per task, so the update has none on the block it
+ * reads: the force row it waits for already waited for the previous update of
+ * that block through pos_x1. */
+void solve_nbody(float * particles, float * next, float * forces, const int n_blocks,
       const int timesteps, const float time_interval )
 {
    #pragma HLS inline
-   int t, i, j;
+   int t;
    for(t = 0; t < timesteps; t++) {
-      calculate_forces(n_blocks, forces, particles);
+      float * const current = (timesteps - t)%2 == 0 ? particles : next;
+      float * const updated = (timesteps - t)%2 == 0 ? next : particles;
 
-      update_particles(n_blocks, particles, forces, time_interval);
+      calculate_forces(n_blocks, forces, current);
+
+      update_particles(n_blocks, current, updated, forces, time_interval);
    }
 }
 
-#pragma omp target device(fpga) copy_inout([n_blocks*PARTICLES_FPGABLOCK_SIZE]particles, [n_blocks*FORCE_FPGABLOCK_SIZE]forces)
+#pragma omp target device(fpga) copy_inout([n_blocks*PARTICLES_FPGABLOCK_SIZE]particles, [n_blocks*PARTICLES_FPGABLOCK_SIZE]next) \
+  copy_inout([n_blocks*FORCE_FPGABLOCK_SIZE]forces)
 #pragma omp task label(solve_nbody_task)
-void solve_nbody_task(float * particles, float * forces, const int n_blocks,
+void solve_nbody_task(float * particles, float * next, float * forces, const int n_blocks,
       const int timesteps, const float time_interval )
 {
-   solve_nbody(particles, forces, n_blocks, timesteps, time_interval);
+   solve_nbody(particles, next, forces, n_blocks, timesteps, time_interval);
    #pragma omp taskwait
 }
 
-void solve_nbody_wrapper(particles_block_t * __restrict__ particles, force_block_t * __restrict__ forces,
-      const int n_blocks, const int timesteps, const float time_interval, double *times )
+void solve_nbody_wrapper(particles_block_t * __restrict__ particles, particles_block_t * __restrict__ next,
+      force_block_t * __restrict__ forces, const int n_blocks, const int timesteps, const float time_interval,
+      double *times )
 {
    times[0] = wall_time();
 
    float * particles_fpga = (float *)particles;
+   float * next_fpga = (float *)next;
    float * forces_fpga = (float *)forces;
+   /* Both buffers start equal, masses and weights are only read */
+   memcpy(next, particles, n_blocks*sizeof(particles_block_t));
    times[1] = wall_time();
 
-   solve_nbody_task((float *)particles_fpga, (float *)forces_fpga, n_blocks, timesteps, time_interval);
+   solve_nbody_task((float *)particles_fpga, (float *)next_fpga, (float *)forces_fpga, n_blocks, timesteps, time_interval);
    #pragma omp taskwait noflush
    times[2] = wall_time();
 
@@ -212,8 +212,11 @@ void solve_nbody_task(float * particles, float * forces, const int n_blocks,
    #pragma omp taskwait
 }
 
-void solve_nbody_wrapper(particles_block_t * __restrict__ particles, force_block_t * __restrict__ forces,
-      const int n_blocks, const int timesteps, const float time_interval, double *times )
+/* Without hardware dependencies the timesteps are separated by taskwaits and
+ * the positions are updated in place, next is not used */
+void solve_nbody_wrapper(particles_block_t * __restrict__ particles, particles_block_t * __restrict__ next,
+      force_block_t * __restrict__ forces, const int n_blocks, const int timesteps, const float time_interval,
+      double *times )
 {
    times[0] = wall_time();
 
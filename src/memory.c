@@ -0,0 +1,190 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "engine.h"
+
+extern int silent;
+
+/* Placement of the big arrays. Every particle and force array comes from
+ * nbody_alloc, which backs it with 4 KiB pages, transparent huge pages (THP,
+ * madvise) or explicit huge pages (MAP_HUGETLB, from the pool reserved in
+ * /proc/sys/vm/nr_hugepages), and binds it to a NUMA node or interleaves it over
+ * all of them with mbind. Without a binding the pages land on the node of the
+ * thread that touches them first, so nbody_first_touch zeroes the arrays with
+ * the pool in the same proportional split the engines use for the particles.
+ * Policies the system refuses are reported once and the allocation goes on
+ * with the default one. */
+
+#ifndef MPOL_BIND
+#  define MPOL_BIND       2
+#  define MPOL_INTERLEAVE 3
+#endif
+
+static const size_t HUGE_PAGE_SIZE = 2*1024*1024;
+static const int    NUMA_MAX_NODES = 1024;
+
+static struct {
+   int           pages;
+   int           policy;    /* 0 for the default one */
+   unsigned long nodes[1024/(8*sizeof(unsigned long))];
+   int           warned;
+} memory = { NBODY_PAGES_DEFAULT };
+
+static const char * const page_names[] = { "default", "thp", "huge" };
+
+static void memory_warn(const char * what)
+{
+   if (memory.warned & 1 << memory.pages) return;
+   memory.warned |= 1 << memory.pages;
+   fprintf(stderr, "Warning: %s failed, falling back to the defaults\n", what);
+}
+
+/* Parses a node list like "0-3,6" into the mask */
+static int parse_nodes(const char * list, unsigned long * mask)
+{
+   const int bits = 8*sizeof(unsigned long);
+   char * end;
+
+   memset(mask, 0, sizeof(memory.nodes));
+   while (*list != '\0' && *list != '\n') {
+      const long first = strtol(list, &end, 10);
+      long last = first, n;
+      if (end == list || first < 0) return -1;
+      if (*end == '-') {
+         list = end + 1;
+         last = strtol(list, &end, 10);
+         if (end == list || last < first) return -1;
+      }
+      if (last >= NUMA_MAX_NODES) return -1;
+      for (n = first; n <= last; n++) mask[n/bits] |= 1UL << n%bits;
+      list = *end == ',' ? end + 1 : end;
+      if (end[0] != ',' && end[0] != '\0' && end[0] != '\n') return -1;
+   }
+   return 0;
+}
+
+int nbody_memory_init(const char * pages, const char * numa)
+{
+   int i;
+
+   memory.pages = -1;
+   for (i = 0; i < (int)(sizeof(page_names)/sizeof(page_names[0])); i++) {
+      if (strcmp(pages, page_names[i]) == 0) memory.pages = i;
+   }
+   if (memory.pages < 0) return -1;
+
+   if (strcmp(numa, "default") == 0) {
+      memory.policy = 0;
+   } else if (strcmp(numa, "interleave") == 0) {
+      char online[256] = "0";
+      FILE * const f = fopen("/sys/devices/system/node/online", "r");
+      if (f != NULL) {
+         if (fgets(online, sizeof(online), f) == NULL) strcpy(online, "0");
+         fclose(f);
+      }
+      memory.policy = MPOL_INTERLEAVE;
+      if (parse_nodes(online, memory.nodes) != 0) return -1;
+   } else {
+      memory.policy = MPOL_BIND;
+      if (parse_nodes(numa, memory.nodes) != 0) return -1;
+   }
+   return 0;
+}
+
+/* Explicit huge pages need the length in whole pages, also to unmap them */
+static size_t memory_length(const size_t size)
+{
+   return memory.pages == NBODY_PAGES_HUGE ? roundup(size, HUGE_PAGE_SIZE) : size;
+}
+
+void * nbody_alloc(const size_t size)
+{
+   const size_t length = memory_length(size);
+   void * space = MAP_FAILED;
+
+   if (memory.pages == NBODY_PAGES_HUGE) {
+      space = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+      if (space == MAP_FAILED) memory_warn("MAP_HUGETLB");
+   }
+   if (space == MAP_FAILED) {
+      space = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      assert(space != MAP_FAILED);
+   }
+   if (memory.pages == NBODY_PAGES_THP && madvise(space, length, MADV_HUGEPAGE) != 0) {
+      memory_warn("madvise(MADV_HUGEPAGE)");
+   }
+   if (memory.policy != 0 &&
+         syscall(SYS_mbind, space, length, memory.policy, memory.nodes, NUMA_MAX_NODES + 1, 0) != 0) {
+      memory_warn("mbind");
+   }
+   return space;
+}
+
+void nbody_dealloc(void * const ptr, const size_t size)
+{
+   assert(munmap(ptr, memory_length(size)) == 0);
+}
+
+typedef struct {
+   char * ptr;
+   size_t size;
+} touch_args_t;
+
+static void first_touch_part(void * arg, const int tid, const int nthreads)
+{
+   const touch_args_t * const args = arg;
+   size_t begin, end;
+
+   nbody_pool_range(args->size, PAGE_SIZE, tid, nthreads, &begin, &end);
+   if (end > begin) memset(args->ptr + begin, 0, end - begin);
+}
+
+void nbody_first_touch(void * const ptr, const size_t size, const int threads)
+{
+   touch_args_t args = { ptr, size };
+
+   nbody_pool_init(threads);
+   nbody_pool_run(first_touch_part, &args);
+   nbody_pool_fini();
+}
+
+void nbody_memory_report(const int pin)
+{
+   char line[256], numa[64] = "first touch";
+   long thp = 0, hugetlb = 0, kb;
+   FILE * const f = fopen("/proc/self/smaps_rollup", "r");
+
+   if (f != NULL) {
+      while (fgets(line, sizeof(line), f) != NULL) {
+         if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) thp = kb;
+         if (sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1) hugetlb = kb;
+      }
+      fclose(f);
+   }
+   if (memory.policy == MPOL_INTERLEAVE) strcpy(numa, "interleaved");
+   if (memory.policy == MPOL_BIND) strcpy(numa, "bound");
+
+   silent?:printf("> Memory: %s pages, %s, %s threads, %ld MiB in huge pages\n", page_names[memory.pages], numa,
+         pin ? "pinned" : "unpinned", (thp + hugetlb)/1024);
+}
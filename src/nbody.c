@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
@@ -27,7 +28,9 @@
 #include <math.h>
 #include <ieee754.h>
 #include <time.h>
+#include <getopt.h>
 #include "nbody.h"
+#include "engine.h"
 
 int silent;
 
@@ -43,6 +46,168 @@ void particle_init(nbody_conf_t * const conf, particles_block_t* const part)
    }
 }
 
+/* Philox4x32-10 counter-based generator: the 4 outputs only depend on the key
+ * and the counter, so any particle can be generated on its own */
+static inline void philox4x32(uint32_t ctr[4], const uint32_t seed)
+{
+   uint32_t key[2] = { seed, 0x5EED5EED };
+   int r;
+   for (r = 0; r < 10; r++) {
+      const uint64_t p0 = (uint64_t)0xD2511F53*ctr[0];
+      const uint64_t p1 = (uint64_t)0xCD9E8D57*ctr[2];
+      const uint32_t c1 = ctr[1], c3 = ctr[3];
+      ctr[0] = (uint32_t)(p1 >> 32) ^ c1 ^ key[0];
+      ctr[1] = (uint32_t)p1;
+      ctr[2] = (uint32_t)(p0 >> 32) ^ c3 ^ key[1];
+      ctr[3] = (uint32_t)p0;
+      key[0] += 0x9E3779B9;
+      key[1] += 0xBB67AE85;
+   }
+}
+
+/* Uniform in [0, 1) from the upper 24 bits */
+static inline float philox_uniform(const uint32_t u)
+{
+   return (float)(u >> 8)*(1.0f/16777216.0f);
+}
+
+/* Same distributions as particle_init, particle p of the whole system taking
+ * the counter (p, 0, 0, 0) */
+void particle_init_philox(nbody_conf_t * const conf, particles_block_t * const part, const size_t first)
+{
+   int i;
+   for (i = 0; i < BLOCK_SIZE; i++) {
+      const uint64_t p = first + i;
+      uint32_t ctr[4] = { (uint32_t)p, (uint32_t)(p >> 32), 0, 0 };
+      philox4x32(ctr, conf->seed);
+
+      part->position_x[i] = conf->domain_size_x * philox_uniform(ctr[0]);
+      part->position_y[i] = conf->domain_size_y * philox_uniform(ctr[1]);
+      part->position_z[i] = conf->domain_size_z * philox_uniform(ctr[2]);
+      part->mass[i]       = conf->mass_maximum  * philox_uniform(ctr[3]);
+      part->weight[i]     = gravitational_constant * part->mass[i];
+      part->velocity_x[i] = 0.0f;
+      part->velocity_y[i] = 0.0f;
+      part->velocity_z[i] = 0.0f;
+   }
+}
+
+/* Plummer sphere of equal masses centered at the origin (Aarseth, Henon & Wielen
+ * 1974), particle p taking the counters (p, 1, 0, 0) and (p, 2 + k, 0, 0) for the
+ * k-th try of its speed. The scale radius sets a dynamical time sqrt(a^3/(G*M))
+ * of PLUMMER_TIME seconds whatever the number of particles. */
+static const double PLUMMER_TIME = 100.0;
+
+void particle_init_plummer(nbody_conf_t * const conf, particles_block_t * const part, const size_t first,
+      const size_t total)
+{
+   const float  mass  = 0.5f*conf->mass_maximum;
+   const double gm    = (double)gravitational_constant*mass*total;
+   const double scale = cbrt(gm*PLUMMER_TIME*PLUMMER_TIME);
+   const double speed = sqrt(2.0*gm/scale);
+   int i;
+
+   for (i = 0; i < BLOCK_SIZE; i++) {
+      const uint64_t p = first + i;
+      uint32_t ctr[4] = { (uint32_t)p, (uint32_t)(p >> 32), 1, 0 };
+      uint32_t k;
+      double q, g;
+
+      philox4x32(ctr, conf->seed);
+      /* the outer 0.1% of the mass is left out, it would reach hundreds of radii */
+      const double x = 0.999*philox_uniform(ctr[0]);
+      const double r = x > 0.0 ? scale/sqrt(pow(x, -2.0/3.0) - 1.0) : 0.0;
+      double cos_t = 2.0*philox_uniform(ctr[1]) - 1.0, phi = 2.0*M_PI*philox_uniform(ctr[2]);
+      double sin_t = sqrt(1.0 - cos_t*cos_t);
+
+      part->position_x[i] = r*sin_t*cos(phi);
+      part->position_y[i] = r*sin_t*sin(phi);
+      part->position_z[i] = r*cos_t;
+
+      /* speed fraction q of the escape speed with density q^2*(1 - q^2)^3.5, by rejection */
+      for (k = 2;; k++) {
+         uint32_t try[4] = { (uint32_t)p, (uint32_t)(p >> 32), k, 0 };
+         philox4x32(try, conf->seed);
+         q = philox_uniform(try[0]);
+         g = 0.1*philox_uniform(try[1]);
+         if (g < q*q*pow(1.0 - q*q, 3.5)) {
+            cos_t = 2.0*philox_uniform(try[2]) - 1.0;
+            phi   = 2.0*M_PI*philox_uniform(try[3]);
+            sin_t = sqrt(1.0 - cos_t*cos_t);
+            break;
+         }
+      }
+      const double v = q*speed*pow(1.0 + r*r/(scale*scale), -0.25);
+
+      part->velocity_x[i] = v*sin_t*cos(phi);
+      part->velocity_y[i] = v*sin_t*sin(phi);
+      part->velocity_z[i] = v*cos_t;
+      part->mass[i]       = mass;
+      part->weight[i]     = gravitational_constant * part->mass[i];
+   }
+}
+
+void nbody_pad_particles(particles_block_t * const part, const size_t count, const int n_blocks)
+{
+   const size_t n = (size_t)n_blocks*BLOCK_SIZE;
+   size_t i;
+
+   if (count == 0 || count >= n) return;
+   const particles_block_t * const last = part + (count - 1)/BLOCK_SIZE;
+   const int e = (count - 1)%BLOCK_SIZE;
+   for (i = count; i < n; i++) {
+      particles_block_t * const block = part + i/BLOCK_SIZE;
+      block->position_x[i%BLOCK_SIZE] = last->position_x[e];
+      block->position_y[i%BLOCK_SIZE] = last->position_y[e];
+      block->position_z[i%BLOCK_SIZE] = last->position_z[e];
+      block->velocity_x[i%BLOCK_SIZE] = last->velocity_x[e];
+      block->velocity_y[i%BLOCK_SIZE] = last->velocity_y[e];
+      block->velocity_z[i%BLOCK_SIZE] = last->velocity_z[e];
+      block->mass[i%BLOCK_SIZE]       = last->mass[e];
+      block->weight[i%BLOCK_SIZE]     = 0.0f;
+   }
+}
+
+typedef struct {
+   nbody_conf_t      *conf;
+   particles_block_t *particles;
+   size_t            first_block;
+   size_t            total;       /* particles of all ranks, plummer only */
+   int               plummer;
+} generate_args_t;
+
+static void nbody_generate_blocks(void * arg, const int tid, const int nthreads)
+{
+   const generate_args_t * const args = arg;
+   size_t begin, end, i;
+   nbody_pool_range(args->conf->num_particles, 1, tid, nthreads, &begin, &end);
+   for (i = begin; i < end; i++) {
+      if (args->plummer) {
+         particle_init_plummer(args->conf, args->particles + i, (args->first_block + i)*BLOCK_SIZE, args->total);
+      } else {
+         particle_init_philox(args->conf, args->particles + i, (args->first_block + i)*BLOCK_SIZE);
+      }
+   }
+}
+
+/* Counter-based generation of this rank's blocks straight into memory, in
+ * parallel and without input file. The result does not depend on the threads. */
+particles_block_t * nbody_generate_philox(nbody_conf_t * conf, nbody_file_t * file, const int threads,
+      const int plummer)
+{
+   generate_args_t args = { conf, nbody_alloc(file->size), file->offset/sizeof(particles_block_t),
+                            conf->particles, plummer };
+
+   nbody_pool_init(threads);
+   nbody_pool_run(nbody_generate_blocks, &args);
+   nbody_pool_fini();
+
+   const size_t first = args.first_block*BLOCK_SIZE;
+   if (first < conf->particles) nbody_pad_particles(args.particles, conf->particles - first, conf->num_particles);
+
+   return args.particles;
+}
+
 void nbody_generate_particles(nbody_conf_t * conf, nbody_file_t * file)
 {
    int i;
@@ -64,6 +229,8 @@ void nbody_generate_particles(nbody_conf_t * conf, nbody_file_t * file)
    for(i=0; i<total_num_particles; i++){
       particle_init(conf, particles+i);
    }
+   /* The padding is in the file, so that every rank reads whole blocks */
+   nbody_pad_particles(particles, conf->particles, total_num_particles);
 
    assert(munmap(particles, file->total_size) == 0);
    close(fd);
@@ -74,47 +241,26 @@ int compare_positions(const float p0, const float p1)
    return p0 > p1*(1.0 + PRECISION) ? 1 : ( p0 < p1*(1.0 - PRECISION) ? -1 : 0 );
 }
 
-int nbody_check(const nbody_t *nbody, const int timesteps)
-{
-   char fname[1024];
-   sprintf(fname, "./input/%s.ref", nbody->file.name);
-
-   if ( access( fname, F_OK ) != 0 ) return 0;
-
-   const int fd = open (fname, O_RDONLY, 0);
-   assert(fd >= 0);
-
-   particle_ptr_t particles = mmap(NULL, nbody->file.total_size, PROT_READ, MAP_SHARED, fd, nbody->file.offset);
-
-   double error = 0.0;
-   int i, e, count = 0;
-   for(i=0; i< nbody->num_particles; i++){
+typedef struct {
+   particles_block_t * particles;
+   int                 fd;
+   const nbody_file_t* file;
+} load_args_t;
 
-      for (e=0;e < BLOCK_SIZE;e++){
-
-         if(nbody->local[i].position_x[e] != particles[i].position_x[e] ||
-               nbody->local[i].position_y[e] != particles[i].position_y[e] ||
-               nbody->local[i].position_z[e] != particles[i].position_z[e])
-         {
-            error += fabs(((nbody->local[i].position_x[e] - particles[i].position_x[e])*100.0)/particles[i].position_x[e]) +
-               fabs(((nbody->local[i].position_y[e] - particles[i].position_y[e])*100.0)/particles[i].position_y[e]) +
-               fabs(((nbody->local[i].position_z[e] - particles[i].position_z[e])*100.0)/particles[i].position_z[e]);
-            count++;
-         }
-      }
-   }
-   double relative_error = error/(3.0*count);
+static void nbody_load_blocks(void * arg, const int tid, const int nthreads)
+{
+   const load_args_t * const args = arg;
+   size_t begin, end;
 
-   if((count*100.0)/(nbody->num_particles*BLOCK_SIZE) > 0.6 || (relative_error >  0.000008)) {
-      silent?:printf("> Relative error[%d]: %f\n", count, relative_error);
-      return -1;
-   } else {
-      silent?:printf("> Result validation: OK\n");
-      return 1;
-   }
+   nbody_pool_range(args->file->size/sizeof(particles_block_t), 1, tid, nthreads, &begin, &end);
+   const size_t size = (end - begin)*sizeof(particles_block_t);
+   const off_t offset = args->file->offset + begin*sizeof(particles_block_t);
+   assert(size == 0 || pread(args->fd, args->particles + begin, size, offset) == (ssize_t)size);
 }
 
-particles_block_t * nbody_load_particles(nbody_conf_t * conf, nbody_file_t * file)
+/* Each thread reads the blocks it computes on, so that their pages are first
+ * touched where they are used */
+particles_block_t * nbody_load_particles(nbody_conf_t * conf, nbody_file_t * file, const int threads)
 {
 
    char fname[1024];
@@ -123,40 +269,35 @@ particles_block_t * nbody_load_particles(nbody_conf_t * conf, nbody_file_t * fil
    const int fd = open (fname, O_RDONLY, 0);
    assert(fd >= 0);
 
-   void * const ptr = mmap(NULL, file->size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, file->offset);
-   assert(ptr != MAP_FAILED);
+   load_args_t args = { nbody_alloc(file->size), fd, file };
+   nbody_pool_init(threads);
+   nbody_pool_run(nbody_load_blocks, &args);
+   nbody_pool_fini();
 
    assert(close(fd) == 0);
 
-   return ptr;
-}
-
-void * nbody_alloc(const size_t size)
-{
-   void * const space = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-   assert(space != MAP_FAILED);
-   return space;
+   return args.particles;
 }
 
-force_ptr_t nbody_alloc_forces(nbody_conf_t * const conf)
+force_ptr_t nbody_alloc_forces(nbody_conf_t * const conf, const int threads)
 {
-   return nbody_alloc(conf->num_particles*sizeof(force_block_t));
+   const size_t size = conf->num_particles*sizeof(force_block_t);
+   force_block_t * const forces = nbody_alloc(size);
+   nbody_first_touch(forces, size, threads);
+   return forces;
 }
 
-particle_ptr_t nbody_alloc_particles(nbody_conf_t * const conf)
+particle_ptr_t nbody_alloc_particles(nbody_conf_t * const conf, const int threads)
 {
-   return nbody_alloc(conf->num_particles*sizeof(particles_block_t));
+   const size_t size = conf->num_particles*sizeof(particles_block_t);
+   particles_block_t * const particles = nbody_alloc(size);
+   nbody_first_touch(particles, size, threads);
+   return particles;
 }
 
 nbody_file_t nbody_setup_file(nbody_conf_t * const conf)
 {
-#if 0
-   int rank, rank_size;
-   assert(MPI_Comm_size(MPI_COMM_WORLD, &rank_size) == MPI_SUCCESS);
-   assert(MPI_Comm_rank(MPI_COMM_WORLD, &rank) == MPI_SUCCESS);
-#else
-   int rank = 0, rank_size = 1;
-#endif
+   const int rank = nbody_comm_rank(), rank_size = nbody_comm_size();
 
    nbody_file_t file;
 
@@ -166,25 +307,34 @@ nbody_file_t nbody_setup_file(nbody_conf_t * const conf)
    file.size   = file.total_size/rank_size;
    file.offset = file.size*rank;
 
-   sprintf(file.name, "%s-%d-%d-%d", conf->name, BLOCK_SIZE*total_num_particles, BLOCK_SIZE, conf->timesteps);
+   sprintf(file.name, "%s-%zu-%d-%d", conf->name, conf->particles, BLOCK_SIZE, conf->timesteps);
 
    return file;
 }
 
-nbody_t nbody_setup(nbody_conf_t * const conf)
+nbody_t nbody_setup(nbody_conf_t * const conf, const nbody_opts_t * const opts)
 {
 
    nbody_file_t file = nbody_setup_file(conf);
-
-   if (file.offset == 0) nbody_generate_particles(conf, &file);
+   const size_t first = file.offset/sizeof(particles_block_t)*BLOCK_SIZE;
+   const size_t size  = (size_t)conf->num_particles*BLOCK_SIZE;
+   const int philox  = strcmp(opts->generator, "legacy") != 0;
+   const int plummer = strcmp(opts->generator, "plummer") == 0;
+
+   if (!philox) {
+      if (file.offset == 0) nbody_generate_particles(conf, &file);
+      nbody_comm_barrier();
+   }
 
    nbody_t nbody = {
-      nbody_load_particles(conf, &file),
-      nbody_alloc_particles(conf),
-      nbody_alloc_forces(conf),
+      philox ? nbody_generate_philox(conf, &file, opts->threads, plummer) :
+               nbody_load_particles(conf, &file, opts->threads),
+      nbody_alloc_particles(conf, opts->threads),
+      nbody_alloc_forces(conf, opts->threads),
       conf->num_particles,
       conf->timesteps,
-      file
+      file,
+      first >= conf->particles ? 0 : conf->particles - first < size ? conf->particles - first : size
    };
 
    return nbody;
@@ -198,7 +348,9 @@ void nbody_save_particles(nbody_t * const nbody, const int timesteps)
    const int fd = open (fname, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
    assert(fd >= 0);
 
-   write(fd, nbody->local, nbody->file.total_size);
+   /* Each rank writes its own slab */
+   assert(ftruncate(fd, nbody->file.total_size) == 0);
+   assert(pwrite(fd, nbody->local, nbody->file.size, nbody->file.offset) == (ssize_t)nbody->file.size);
 
    assert(close(fd) == 0);
 
@@ -208,11 +360,15 @@ void nbody_free(nbody_t * const nbody)
 {
    {
       const size_t size = nbody->num_particles*sizeof(particles_block_t);
-      assert(munmap(nbody->local, size) == 0);
+      nbody_dealloc(nbody->local, size);
+   }
+   {
+      const size_t size = nbody->num_particles*sizeof(particles_block_t);
+      nbody_dealloc(nbody->remote, size);
    }
    {
       const size_t size = nbody->num_particles*sizeof(force_block_t);
-      assert(munmap(nbody->forces, size) == 0);
+      nbody_dealloc(nbody->forces, size);
    }
 }
 
@@ -223,36 +379,398 @@ double wall_time(void)
    return (double) (ts.tv_sec)  + (double) ts.tv_nsec * 1.0e-9;
 }
 
+/* Runs the timesteps after first in chunks that end at every multiple of the
+ * checkpoint and trajectory intervals, to write them there, and of the reorder
+ * interval, to sort the particles there. Every engine leaves the forces zeroed
+ * after a step, so the particles are the whole state and running in chunks
+ * gives the same result. The bins engine, whose timestep bins are state too,
+ * keeps them from one chunk to the next through opts->resume and
+ * opts->suspend. Only the first chunk warms up and reports. */
+static double nbody_solve(const nbody_engine_t * const engine, nbody_t * const nbody, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, const int first, double * times)
+{
+   nbody_opts_t chunk_opts = *opts;
+   const int was_silent = silent;
+   double chunk_times[4], pairs = 0.0, warmup = 0.0, execution = 0.0, flush = 0.0;
+   int step = first;
+
+   if (opts->checkpoint > 0) nbody_checkpoint_init(nbody);
+   if (opts->reorder > 0) nbody_reorder_init(nbody, opts);
+   if (opts->trajectory > 0) {
+      nbody_trajectory_init(nbody, opts);
+      nbody_trajectory_frame(nbody, step);
+   }
+
+   times[0] = wall_time();
+   while (step < nbody->timesteps) {
+      int steps = nbody->timesteps - step;
+      if (opts->checkpoint > 0 && opts->checkpoint - step%opts->checkpoint < steps) {
+         steps = opts->checkpoint - step%opts->checkpoint;
+      }
+      if (opts->trajectory > 0 && opts->trajectory - step%opts->trajectory < steps) {
+         steps = opts->trajectory - step%opts->trajectory;
+      }
+      if (opts->reorder > 0 && opts->reorder - step%opts->reorder < steps) {
+         steps = opts->reorder - step%opts->reorder;
+      }
+      if (opts->reorder > 0) {
+         const double start = wall_time();
+         nbody_phase(NBODY_PHASE_IO);
+         nbody_reorder(nbody, opts->threads, step%opts->reorder == 0 || step == first);
+         execution += wall_time() - start;
+      }
+
+      nbody_t chunk = { nbody->local, nbody->remote, nbody->forces, nbody->num_particles, steps, nbody->file,
+                        nbody->count };
+      chunk_opts.suspend = step + steps < nbody->timesteps;
+      if (nbody_profiling) nbody_profile_step_start();
+      pairs += engine->solve(&chunk, conf, &chunk_opts, chunk_times);
+      step  += steps;
+      nbody_phase(NBODY_PHASE_IO);
+
+      warmup    += chunk_times[1] - chunk_times[0];
+      execution += chunk_times[2] - chunk_times[1];
+      flush     += chunk_times[3] - chunk_times[2];
+
+      const double start = wall_time();
+      const int write_checkpoint = opts->checkpoint > 0 && step%opts->checkpoint == 0 && step < nbody->timesteps;
+      const int write_frame      = opts->trajectory > 0 && step%opts->trajectory == 0;
+      if (opts->reorder > 0 && (write_checkpoint || write_frame)) nbody_reorder_restore(nbody, opts->threads);
+      if (write_checkpoint) nbody_checkpoint(nbody, step);
+      if (write_frame) nbody_trajectory_frame(nbody, step);
+      execution += wall_time() - start;
+
+      chunk_opts.samples = 0;
+      chunk_opts.resume  = 1;
+      silent = 1;
+   }
+   silent = was_silent;
+
+   if (opts->reorder > 0) {
+      const double start = wall_time();
+      nbody_phase(NBODY_PHASE_IO);
+      nbody_reorder_fini(nbody, opts, execution);
+      execution += wall_time() - start;
+   }
+   if (opts->checkpoint > 0) nbody_checkpoint_fini();
+   if (opts->trajectory > 0) nbody_trajectory_fini();
+
+   times[1] = times[0] + warmup;
+   times[2] = times[1] + execution;
+   times[3] = times[2] + flush;
+   return pairs;
+}
+
+static void usage(const char * prog)
+{
+   fprintf(stderr, "USAGE: %s [options] <num particles> <timesteps>\n", prog);
+   fprintf(stderr, "       %s [options] --ensemble=FILE\n", prog);
+   fprintf(stderr, "  -e, --engine=NAME     force engine (default: ompss)\n");
+   fprintf(stderr, "  -t, --threads=N       host engine threads (default: online cores)\n");
+   fprintf(stderr, "  -i, --isa=NAME        host force kernel: auto, avx512, avx2, sse, scalar (default: auto)\n");
+   fprintf(stderr, "  -r, --rsqrt=N         use rsqrt with N Newton steps instead of sqrt+div\n");
+   fprintf(stderr, "  -l, --tile=N          source tile of the host kernels: 256, 512, 1024, 2048,\n");
+   fprintf(stderr, "                        or 0 to fit it in the L1 cache (default: %d, the block)\n", BLOCK_SIZE);
+   fprintf(stderr, "  -T, --theta=X         Barnes-Hut opening angle, below 1.1547 (default: 0.5)\n");
+   fprintf(stderr, "  -C, --cutoff=R        cutoff engine interaction radius in meters, 0 for an eighth\n");
+   fprintf(stderr, "                        of the domain (default: 0)\n");
+   fprintf(stderr, "  -g, --pm-grid=M       particle-mesh grid size, a power of two (default: 64)\n");
+   fprintf(stderr, "  -a, --samples=N       particles sampled for the force accuracy report of\n");
+   fprintf(stderr, "                        approximate engines, 0 disables it (default: 256)\n");
+   fprintf(stderr, "  -n, --ranks=N         processes for distributed engines, ignored with MPI (default: 1)\n");
+   fprintf(stderr, "  -G, --generator=NAME  initial particles: legacy, random() through the .in file\n");
+   fprintf(stderr, "                        the .ref files were made with, or philox, parallel and in\n");
+   fprintf(stderr, "                        memory, or plummer, a Plummer sphere at the origin\n");
+   fprintf(stderr, "                        (default: legacy)\n");
+   fprintf(stderr, "  -I, --integrator=NAME direct engine integrator: euler, the update of the\n");
+   fprintf(stderr, "                        kernels, leapfrog or hermite (default: euler)\n");
+   fprintf(stderr, "  -d, --time-interval=X timestep in seconds (default: 1)\n");
+   fprintf(stderr, "  -y, --energy          report the drift of the total energy over the run\n");
+   fprintf(stderr, "  -S, --check-samples=N check about N particles, in evenly spread blocks (default: all)\n");
+   fprintf(stderr, "  -F, --check-fail-fast stop the check as soon as too many particles differ\n");
+   fprintf(stderr, "  -J, --check-report=FILE  write the check statistics to FILE as JSON\n");
+   fprintf(stderr, "  -c, --checkpoint=K    write a checkpoint every K timesteps in the background\n");
+   fprintf(stderr, "  -R, --restart         resume from the newest valid checkpoint of the same run\n");
+   fprintf(stderr, "  -o, --trajectory=N    write a compressed trajectory frame every N timesteps\n");
+   fprintf(stderr, "  -f, --traj-fields=L   trajectory fields: position, velocity, mass (default: position)\n");
+   fprintf(stderr, "  -q, --traj-tolerance=X  absolute error bound of the trajectory values, 0 is\n");
+   fprintf(stderr, "                        lossless (default: 0)\n");
+   fprintf(stderr, "  -p, --source-precision=NAME  storage of the source particles in the direct\n");
+   fprintf(stderr, "                        engine: fp32, bf16, fp16 or int16, the last two relative\n");
+   fprintf(stderr, "                        to each block's bounding box (default: fp32)\n");
+   fprintf(stderr, "  -B, --bins=K          timestep bins of the bins engine, bin k steps with\n");
+   fprintf(stderr, "                        time_interval/2^k, from 1 to 16 (default: 6)\n");
+   fprintf(stderr, "  -E, --eta=X           bins engine step accuracy, dt = X*|F|/|dF/dt| (default: 0.02)\n");
+   fprintf(stderr, "  -L, --schedule=NAME   direct engine force loop: slice, every source block for\n");
+   fprintf(stderr, "                        each block slice, or tiled, cache sized target tiles and\n");
+   fprintf(stderr, "                        source panels (default: tiled)\n");
+   fprintf(stderr, "  -O, --reorder=K       sort the particles along a space-filling curve every K\n");
+   fprintf(stderr, "                        timesteps, they are written out in their original order\n");
+   fprintf(stderr, "  -k, --curve=NAME      reorder curve: morton or hilbert (default: hilbert)\n");
+   fprintf(stderr, "  -P, --pages=NAME      particle and force pages: default, thp (transparent huge\n");
+   fprintf(stderr, "                        pages) or huge (reserved huge pages) (default: default)\n");
+   fprintf(stderr, "  -N, --numa=POLICY     NUMA placement: default (first touch by the thread that\n");
+   fprintf(stderr, "                        computes on it), interleave, or bind to a node list like 0-1\n");
+   fprintf(stderr, "  -x, --pin             pin host engine threads to cores\n");
+   fprintf(stderr, "  -Q, --profile=FILE    write the wall time of every phase and timestep to FILE\n");
+   fprintf(stderr, "                        as JSON\n");
+   fprintf(stderr, "  -W, --counters        add perf_event counters to the profile: cycles,\n");
+   fprintf(stderr, "                        instructions, LLC misses and FP operations\n");
+   fprintf(stderr, "  -M, --fpga-model=SPEC predict the FPGA time of the ompss engine run for the\n");
+   fprintf(stderr, "                        build configuration, or key=value[:value...] lists of\n");
+   fprintf(stderr, "                        clock, width, lanes, accs, block, ii, depth, latency,\n");
+   fprintf(stderr, "                        task and bandwidth, separated by commas\n");
+   fprintf(stderr, "  -A, --ensemble=FILE   run the independent systems listed in FILE, one per line\n");
+   fprintf(stderr, "                        with particles=N timesteps=T and optionally seed, repeat,\n");
+   fprintf(stderr, "                        mass, dt, domain=X[,Y,Z] and generator, instead of the\n");
+   fprintf(stderr, "                        <num particles> <timesteps> system\n");
+   fprintf(stderr, "  -u, --tune=PREFIX     sweep threads, kernels and tile sizes, write PREFIX.csv\n");
+   fprintf(stderr, "                        and PREFIX.json and save the best to " NBODY_TUNE_FILE ", which\n");
+   fprintf(stderr, "                        later runs use for the options they do not give\n");
+   fprintf(stderr, "  -s, --silent          silent mode\n");
+   fprintf(stderr, "  Engines:\n");
+   nbody_list_engines(stderr);
+}
+
 int main(int argc, char** argv)
 {
-   if (argc < 3 || argc > 3) {
-      fprintf(stderr, "USAGE: %s <num particles> <timesteps>\n", argv[0]);
+   static const struct option long_opts[] = {
+      { "engine",  required_argument, NULL, 'e' },
+      { "threads", required_argument, NULL, 't' },
+      { "isa",     required_argument, NULL, 'i' },
+      { "rsqrt",   required_argument, NULL, 'r' },
+      { "tile",    required_argument, NULL, 'l' },
+      { "theta",   required_argument, NULL, 'T' },
+      { "cutoff",  required_argument, NULL, 'C' },
+      { "pm-grid", required_argument, NULL, 'g' },
+      { "samples", required_argument, NULL, 'a' },
+      { "ranks",   required_argument, NULL, 'n' },
+      { "generator", required_argument, NULL, 'G' },
+      { "check-samples", required_argument, NULL, 'S' },
+      { "check-fail-fast", no_argument, NULL, 'F' },
+      { "check-report", required_argument, NULL, 'J' },
+      { "checkpoint", required_argument, NULL, 'c' },
+      { "restart", no_argument,       NULL, 'R' },
+      { "trajectory", required_argument, NULL, 'o' },
+      { "traj-fields", required_argument, NULL, 'f' },
+      { "traj-tolerance", required_argument, NULL, 'q' },
+      { "source-precision", required_argument, NULL, 'p' },
+      { "bins",    required_argument, NULL, 'B' },
+      { "eta",     required_argument, NULL, 'E' },
+      { "integrator", required_argument, NULL, 'I' },
+      { "time-interval", required_argument, NULL, 'd' },
+      { "energy",  no_argument,       NULL, 'y' },
+      { "reorder", required_argument, NULL, 'O' },
+      { "curve",   required_argument, NULL, 'k' },
+      { "pages",   required_argument, NULL, 'P' },
+      { "numa",    required_argument, NULL, 'N' },
+      { "pin",     no_argument,       NULL, 'x' },
+      { "profile", required_argument, NULL, 'Q' },
+      { "counters", no_argument,      NULL, 'W' },
+      { "fpga-model", required_argument, NULL, 'M' },
+      { "schedule", required_argument, NULL, 'L' },
+      { "ensemble", required_argument, NULL, 'A' },
+      { "tune",    required_argument, NULL, 'u' },
+      { "silent",  no_argument,       NULL, 's' },
+      { "help",    no_argument,       NULL, 'h' },
+      { NULL, 0, NULL, 0 }
+   };
+
+   int opt, i, given = 0;
+   const char * tune = NULL;
+   nbody_opts_t opts = { "ompss", sysconf(_SC_NPROCESSORS_ONLN), "auto", -1, NBODY_BLOCK_SIZE, 0.5f, 256, 64, 1, 0, 0,
+                         0, NBODY_TRAJ_POSITION, 0.0f, "legacy",
+                         0, 0, NULL, "fp32", 6, 0.02f,
+                         "euler", default_time_interval, 0, 0.0f, 0, "hilbert",
+                         "default", "default", 0, NULL, 0, NULL, "tiled", NULL };
+
+   while ((opt = getopt_long(argc, argv, "e:t:i:r:l:T:C:g:a:n:G:S:FJ:c:Ro:f:q:p:B:E:I:d:yO:k:P:N:xQ:WM:L:A:u:sh", long_opts, NULL)) != -1) {
+      switch (opt) {
+         case 'e': opts.engine  = optarg;       break;
+         case 't': opts.threads = atoi(optarg); given |= NBODY_TUNE_THREADS; break;
+         case 'i': opts.isa     = optarg;       given |= NBODY_TUNE_ISA;     break;
+         case 'r': opts.newton  = atoi(optarg); break;
+         case 'l': opts.tile    = atoi(optarg); given |= NBODY_TUNE_TILE;    break;
+         case 'T': opts.theta   = atof(optarg); break;
+         case 'C': opts.cutoff  = atof(optarg); break;
+         case 'g': opts.pm_grid = atoi(optarg); break;
+         case 'a': opts.samples = atoi(optarg); break;
+         case 'n': opts.ranks   = atoi(optarg); break;
+         case 'G': opts.generator = optarg;     break;
+         case 'S': opts.check_samples = atoi(optarg); break;
+         case 'F': opts.check_fail_fast = 1;    break;
+         case 'J': opts.check_report = optarg;  break;
+         case 'c': opts.checkpoint = atoi(optarg); break;
+         case 'R': opts.restart = 1;            break;
+         case 'o': opts.trajectory = atoi(optarg); break;
+         case 'f': opts.traj_fields = nbody_trajectory_fields(optarg); break;
+         case 'q': opts.traj_tolerance = atof(optarg); break;
+         case 'p': opts.precision = optarg;     break;
+         case 'B': opts.bins = atoi(optarg);    break;
+         case 'E': opts.eta  = atof(optarg);    break;
+         case 'I': opts.integrator = optarg;    break;
+         case 'd': opts.time_interval = atof(optarg); break;
+         case 'y': opts.energy = 1;             break;
+         case 'O': opts.reorder = atoi(optarg); break;
+         case 'k': opts.curve   = optarg;       break;
+         case 'P': opts.pages   = optarg;       break;
+         case 'N': opts.numa    = optarg;       break;
+         case 'x': opts.pin     = 1;            break;
+         case 'Q': opts.profile  = optarg;      break;
+         case 'W': opts.counters = 1;           break;
+         case 'M': opts.fpga_model = optarg;    break;
+         case 'L': opts.schedule = optarg;      break;
+         case 'A': opts.ensemble = optarg;      break;
+         case 'u': tune = optarg;               break;
+         case 's': silent = 1;                  break;
+         default:
+            usage(argv[0]);
+            return opt != 'h';
+      }
+   }
+
+   const nbody_engine_t * const engine = nbody_find_engine(opts.engine);
+
+   if (argc - optind != (opts.ensemble != NULL ? 0 : 2) || engine == NULL ||
+         (strcmp(opts.generator, "legacy") != 0 && strcmp(opts.generator, "philox") != 0 &&
+          strcmp(opts.generator, "plummer") != 0) || opts.threads < 1 || opts.ranks < 1 || opts.checkpoint < 0 || opts.check_samples < 0 ||
+         opts.trajectory < 0 || opts.traj_fields <= 0 || opts.traj_tolerance < 0.0f ||
+         nbody_precision_find(opts.precision) < 0 || opts.bins < 1 || opts.bins > 16 || opts.eta <= 0.0f ||
+         nbody_integrator_find(opts.integrator) < 0 || opts.time_interval <= 0.0f || opts.cutoff < 0.0f ||
+         opts.reorder < 0 || nbody_curve_find(opts.curve) < 0 || nbody_memory_init(opts.pages, opts.numa) != 0 ||
+         opts.theta <= 0.0f || opts.theta >= NBODY_BH_THETA_MAX || opts.pm_grid < 8 || (opts.pm_grid & (opts.pm_grid - 1)) != 0 ||
+         (opts.fpga_model != NULL && nbody_fpga_model_parse(opts.fpga_model) != 0) ||
+         nbody_schedule_select(opts.schedule) != 0) {
+      usage(argv[0]);
       return 1;
    }
 
-   int num_particles   = roundup(atoi(argv[1]), MIN_PARTICLES);
-   const int timesteps = atoi(argv[2]);
+   nbody_pool_pin(opts.pin);
+
+   if (opts.fpga_model != NULL && strcmp(engine->name, "ompss") != 0) {
+      fprintf(stderr, "The FPGA model needs the ompss engine\n");
+      return 1;
+   }
+
+   if (tune != NULL && strcmp(engine->name, "ompss") == 0) {
+      fprintf(stderr, "Engine '%s' has no host parameters to tune\n", engine->name);
+      return 1;
+   }
+   const int tuned = tune == NULL && strcmp(engine->name, "ompss") != 0 &&
+      nbody_tune_load(engine->name, &opts, given);
+
+   if (strcmp(opts.precision, "fp32") != 0 && strcmp(engine->name, "direct") != 0) {
+      fprintf(stderr, "Engine '%s' only supports fp32 sources\n", engine->name);
+      return 1;
+   }
+
+   if (strcmp(opts.integrator, "euler") != 0 &&
+         (strcmp(engine->name, "direct") != 0 || strcmp(opts.precision, "fp32") != 0)) {
+      fprintf(stderr, "Integrator '%s' needs the direct engine with fp32 sources\n", opts.integrator);
+      return 1;
+   }
+
+   if (strcmp(engine->name, "bins") == 0 && (opts.checkpoint > 0 || opts.reorder > 0)) {
+      fprintf(stderr, "Engine 'bins' keeps its timestep bins out of the particles, it supports no "
+            "--checkpoint or --reorder\n");
+      return 1;
+   }
+
+   if (nbody_simd_select(opts.isa, opts.newton, opts.tile) != 0) {
+      fprintf(stderr, "Kernel '%s' with tile %d is not supported\n", opts.isa, opts.tile);
+      return 1;
+   }
+
+   if (opts.ensemble != NULL) return nbody_ensemble(opts.ensemble, &opts);
+
+   /* Any count, the last block is padded with weightless particles */
+   const size_t particles = strtoull(argv[optind], NULL, 10);
+   const int timesteps    = atoi(argv[optind + 1]);
 
    assert(timesteps > 0);
-   assert(num_particles >= 4096);
+   assert(particles > 0 && particles <= (size_t)INT32_MAX);
+
+   const int num_particles = (particles + BLOCK_SIZE - 1)/BLOCK_SIZE;
+
+   /* Every rank gets the same number of blocks */
+   const int max_ranks = num_particles < opts.ranks ? num_particles : opts.ranks;
+   const int ranks = nbody_comm_init(&argc, &argv, max_ranks,
+         (size_t)roundup(num_particles, max_ranks)/max_ranks*sizeof(particles_block_t));
+   const int rank  = nbody_comm_rank();
 
-   num_particles = num_particles/BLOCK_SIZE;
+   if (ranks > 1 && !engine->distributed) {
+      if (rank == 0) fprintf(stderr, "Engine '%s' does not support several ranks\n", engine->name);
+      return nbody_comm_fini(1);
+   }
+   if (ranks > 1 && opts.energy) {
+      if (rank == 0) fprintf(stderr, "The energy needs all the particles on a single rank\n");
+      return nbody_comm_fini(1);
+   }
+   if (num_particles % ranks != 0) {
+      if (rank == 0) fprintf(stderr, "%d blocks can not be split among %d ranks\n", num_particles, ranks);
+      return nbody_comm_fini(1);
+   }
+   if (rank != 0) silent = 1;
 
    nbody_conf_t conf = { default_domain_size_x, default_domain_size_y, default_domain_size_z,
-                         default_mass_maximum, default_time_interval, default_seed, default_name,
-                         timesteps /* arg */, num_particles /* arg */ };
+                         default_mass_maximum, opts.time_interval, default_seed,
+                         strcmp(opts.generator, "philox")  == 0 ? "particles-philox"  :
+                         strcmp(opts.generator, "plummer") == 0 ? "particles-plummer" : default_name,
+                         timesteps /* arg */, num_particles/ranks /* arg */, particles /* arg */ };
+
+   if (tune != NULL) {
+      if (ranks > 1) {
+         if (rank == 0) fprintf(stderr, "Tuning runs on a single rank\n");
+         return nbody_comm_fini(1);
+      }
+      return nbody_comm_fini(nbody_tune(engine, &conf, &opts, tune) != 0);
+   }
+   if (tuned) silent?:printf("> Using the configuration saved in %s\n", NBODY_TUNE_FILE);
+
+   if (opts.profile != NULL) nbody_profile_init(opts.counters);
+   nbody_phase(NBODY_PHASE_IO);
+   nbody_t nbody = nbody_setup( &conf, &opts );
+   if (strcmp(opts.pages, "default") != 0 || strcmp(opts.numa, "default") != 0 || opts.pin) {
+      nbody_memory_report(opts.pin);
+   }
+
+   const int first = opts.restart ? nbody_restart(&nbody) : 0;
 
-   nbody_t nbody = nbody_setup( &conf );
+   const double energy = opts.energy ? nbody_energy(&nbody, opts.threads) : 0.0;
 
    double times[4];
-   solve_nbody_wrapper(nbody.local, nbody.forces, num_particles, timesteps, conf.time_interval, times);
+   const double pairs_local = nbody_solve(engine, &nbody, &conf, &opts, first, times);
+   nbody_phase(NBODY_PHASE_OTHER);
+   const double pairs = nbody_comm_sum(pairs_local);
 
+   if (opts.energy) {
+      const double drift = (nbody_energy(&nbody, opts.threads) - energy)/fabs(energy);
+      silent?:printf("> Energy: initial %e, relative drift %e, per step %e\n", energy, drift, drift/(timesteps - first));
+   }
+
+   if (opts.fpga_model != NULL) nbody_fpga_model_report(particles, timesteps - first);
+
+   nbody_phase(NBODY_PHASE_IO);
    nbody_save_particles(&nbody, timesteps);
-   int result = nbody_check(&nbody, timesteps);
+   nbody_phase(NBODY_PHASE_OTHER);
+   int result = nbody_comm_min(nbody_check(&nbody, &opts));
+   if (opts.profile != NULL) {
+      char fname[1024];
+      /* One report per rank */
+      if (ranks > 1) snprintf(fname, sizeof(fname), "%s.%d", opts.profile, rank);
+      else           snprintf(fname, sizeof(fname), "%s", opts.profile);
+      nbody_profile_report(fname, engine->name, nbody.count, opts.threads, pairs_local);
+   }
    nbody_free(&nbody);
 
-   double throughput = (double)(num_particles * BLOCK_SIZE) * (double)(num_particles * BLOCK_SIZE ) / 1.0E9;
-   throughput = throughput * (double)timesteps / (times[2] - times[1]);
+   /* The slowest rank sets the pace */
+   for (i = 3; i > 0; i--) times[i] = times[0] + nbody_comm_max(times[i] - times[0]);
+
+   const double throughput = pairs / 1.0E9 / (times[2] - times[1]);
+   double effective = (double)particles * (double)particles / 1.0E9;
+   effective = effective * (double)(timesteps - first) / (times[2] - times[1]);
+
+   if (rank != 0) return nbody_comm_fini(result < 0);
 
    const char * check[] = {"fail","n/a","successful"};
 
@@ -265,14 +783,27 @@ int main(int argc, char** argv)
    // Print results
    printf( "==================== RESULTS ===================== \n" );
    printf( "  Benchmark: %s (%s)\n", "N-Body", "OmpSs");
-   printf( "  Total particles: %d\n", num_particles * BLOCK_SIZE );
+   printf( "  Engine: %s (%s)\n", engine->name, engine->description);
+   if (strcmp(engine->name, "ompss") != 0) printf( "  Threads: %d\n", opts.threads );
+   if (engine->simd) {
+      char kernel[64];
+      nbody_simd_describe(kernel, sizeof(kernel));
+      printf( "  Kernel: %s\n", kernel );
+   }
+   if (strcmp(engine->name, "direct") == 0) printf( "  Integrator: %s\n", opts.integrator );
+   if (ranks > 1) printf( "  Ranks: %d\n", ranks );
+   printf( "  Total particles: %zu\n", particles );
    printf( "  Timesteps: %d\n", timesteps );
    printf( "  Verification: %s\n", check[check_idx] );
    printf( "  Warm up time (secs): %f\n", times[1] - times[0]);
    printf( "  Execution time (secs): %f\n", times[2] - times[1]);
    printf( "  Flush time (secs): %f\n", times[3] - times[2]);
-   printf( "  Throughput (gpairs/s): %f\t\n", throughput);
+   /* Mesh engines evaluate no pairs, their rate is in particle updates */
+   if (pairs > 0.0) printf( "  Throughput (gpairs/s): %f\t\n", throughput);
+   else printf( "  Throughput (mparticles/s): %f\t\n",
+         (double)particles*(timesteps - first)/1.0E6/(times[2] - times[1]));
+   printf( "  Effective throughput (gpairs/s): %f\t\n", effective);
    printf( "================================================== \n" );
 
-   return result < 0;
+   return nbody_comm_fini(result < 0);
 }
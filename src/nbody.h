@@ -32,7 +32,6 @@ typedef struct {
 } single_force;
 
 #define PAGE_SIZE 4096
-#define MIN_PARTICLES (4096*BLOCK_SIZE/sizeof(particles_block_t))
 #define PRECISION 0.000001
 
 #define roundup(x, y) (                                 \
@@ -67,6 +66,7 @@ typedef const struct {
    const char* name;
    const int timesteps;
    const int   num_particles;
+   const size_t particles;      /* of all ranks, the last block is padded up */
 } nbody_conf_t;
 
 typedef const struct {
@@ -76,19 +76,123 @@ typedef const struct {
    const int num_particles;
    const int timesteps;
    nbody_file_t file;
+   const size_t count;          /* real particles of local, the rest are padding */
 } nbody_t;
 
+typedef struct {
+   const char* engine;
+   int   threads;
+   const char* isa;
+   int   newton;
+   int   tile;
+   float theta;
+   int   samples;
+   int   pm_grid;
+   int   ranks;
+   int   checkpoint;
+   int   restart;
+   int   trajectory;
+   int   traj_fields;
+   float traj_tolerance;
+   const char* generator;
+   int   check_samples;
+   int   check_fail_fast;
+   const char* check_report;
+   const char* precision;
+   int   bins;
+   float eta;
+   const char* integrator;
+   float time_interval;
+   int   energy;
+   float cutoff;
+   int   reorder;
+   const char* curve;
+   const char* pages;
+   const char* numa;
+   int   pin;
+   const char* profile;
+   int   counters;
+   const char* fpga_model;
+   const char* schedule;
+   const char* ensemble;
+   int   resume;   /* set by nbody_solve on the chunks that go on from the previous one */
+   int   suspend;  /* set by nbody_solve on the chunks followed by another one */
+} nbody_opts_t;
+
+/* Fields a trajectory can store */
+#define NBODY_TRAJ_POSITION 1
+#define NBODY_TRAJ_VELOCITY 2
+#define NBODY_TRAJ_MASS     4
+
 /* coomon.c */
-nbody_t nbody_setup(nbody_conf_t * const conf);
+nbody_t nbody_setup(nbody_conf_t * const conf, const nbody_opts_t * const opts);
 void nbody_save_particles(nbody_t *nbody, const int timesteps);
 void nbody_free(nbody_t *nbody);
-int nbody_check(nbody_t *nbody, const int timesteps);
+/* Fill a whole block with the particles first to first + BLOCK_SIZE of a system */
+void particle_init_philox(nbody_conf_t * const conf, particles_block_t * const part, const size_t first);
+void particle_init_plummer(nbody_conf_t * const conf, particles_block_t * const part, const size_t first,
+      const size_t total);
+/* Turn the particles count to n_blocks*BLOCK_SIZE into weightless copies of the
+ * particle count - 1, which shadow it and add nothing to any force */
+void nbody_pad_particles(particles_block_t * const part, const size_t count, const int n_blocks);
 
 double wall_time(void);
 
 void print_stats(double n_blocks, int timesteps, double elapsed_time);
 
+/* memory.c */
+#define NBODY_PAGES_DEFAULT 0
+#define NBODY_PAGES_THP     1
+#define NBODY_PAGES_HUGE    2
+
+/* Sets the pages (default, thp or huge) and the NUMA policy (default, interleave
+ * or a node list like 0-1) of the next allocations, returns -1 on bad names */
+int    nbody_memory_init(const char * pages, const char * numa);
+void * nbody_alloc(const size_t size);
+void   nbody_dealloc(void * const ptr, const size_t size);
+/* Zeroes the memory with a pool of threads, each one the part it computes on */
+void   nbody_first_touch(void * const ptr, const size_t size, const int threads);
+void   nbody_memory_report(const int pin);
+
+/* fpga_model.c */
+/* Parses key=value[:value...] lists of accelerator parameters, returns -1 on errors */
+int  nbody_fpga_model_parse(const char * spec);
+/* Prints the predicted time and throughput of every parsed configuration */
+void nbody_fpga_model_report(const size_t particles, const int timesteps);
+
+/* check.c */
+int nbody_check(const nbody_t *nbody, const nbody_opts_t * const opts);
+
+/* comm.c */
+int    nbody_comm_init(int * argc, char *** argv, const int ranks, const size_t slab);
+int    nbody_comm_rank(void);
+int    nbody_comm_size(void);
+void   nbody_comm_barrier(void);
+double nbody_comm_sum(const double value);
+double nbody_comm_max(const double value);
+double nbody_comm_min(const double value);
+int    nbody_comm_fini(const int status);
+
 void exchange_particles(particles_block_t * const sendbuf, particles_block_t * recvbuf, const int n_blocks,
                         const int rank, const int rank_size, const int i);
+void exchange_particles_start(particles_block_t * const sendbuf, particles_block_t * recvbuf, const int n_blocks,
+                              const int rank, const int rank_size, const int i);
+void exchange_particles_wait(void);
+
+/* checkpoint.c */
+void nbody_checkpoint_init(nbody_t * const nbody);
+void nbody_checkpoint(nbody_t * const nbody, const int step);
+void nbody_checkpoint_fini(void);
+/* Loads the newest valid checkpoint of this run, returns its step or 0 */
+int  nbody_restart(nbody_t * const nbody);
+
+/* trajectory.c */
+int  nbody_trajectory_fields(const char * list);
+void nbody_trajectory_init(nbody_t * const nbody, const nbody_opts_t * const opts);
+void nbody_trajectory_frame(nbody_t * const nbody, const int step);
+void nbody_trajectory_fini(void);
+/* Decodes a frame of a trajectory file into values, field by field, and returns
+ * their count or -1 */
+int  nbody_trajectory_read(const char * fname, const int frame, float * values, int * step);
 
 #endif /* #ifndef nbody_h */
@@ -0,0 +1,151 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include "engine.h"
+
+/* Persistent worker pool. The calling thread takes part as tid 0, so a pool of
+ * one thread runs everything inline without any synchronization. When pinned,
+ * thread tid runs on the tid-th CPU the process was allowed to use at startup
+ * (wrapping around), so a thread keeps the caches and the NUMA node of the
+ * blocks it first touched; the caller gets its affinity back on fini. */
+static struct {
+   int               nthreads;
+   int               quit;
+   int               pin;
+   cpu_set_t         allowed;     /* affinity of the process before pinning */
+   pthread_t         *workers;
+   pthread_barrier_t start;
+   pthread_barrier_t end;
+   pthread_barrier_t sync;
+   nbody_pool_fn_t   fn;
+   void              *arg;
+} pool = { 1 };
+
+static void pool_pin_thread(const int tid)
+{
+   const int cpus = CPU_COUNT(&pool.allowed);
+   cpu_set_t set;
+   int cpu, k = -1;
+
+   for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &pool.allowed) && ++k == tid%cpus) break;
+   }
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   assert(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+}
+
+void nbody_pool_pin(const int pin)
+{
+   pool.pin = pin;
+   if (pin) assert(sched_getaffinity(0, sizeof(pool.allowed), &pool.allowed) == 0);
+}
+
+static void * nbody_pool_worker(void * data)
+{
+   const int tid = (int)(intptr_t)data;
+   if (pool.pin) pool_pin_thread(tid);
+   if (nbody_profiling) {
+      nbody_profile_thread(tid);
+      pthread_barrier_wait(&pool.sync);
+   }
+   for (;;) {
+      pthread_barrier_wait(&pool.start);
+      if (pool.quit) break;
+      pool.fn(pool.arg, tid, pool.nthreads);
+      pthread_barrier_wait(&pool.end);
+   }
+   return NULL;
+}
+
+void nbody_pool_init(const int nthreads)
+{
+   int i;
+   assert(nthreads > 0);
+   assert(pool.workers == NULL);
+
+   pool.nthreads = nthreads;
+   pool.quit     = 0;
+   if (pool.pin) pool_pin_thread(0);
+   if (nthreads == 1) return;
+
+   assert(pthread_barrier_init(&pool.start, NULL, nthreads) == 0);
+   assert(pthread_barrier_init(&pool.end, NULL, nthreads) == 0);
+   assert(pthread_barrier_init(&pool.sync, NULL, nthreads) == 0);
+
+   if (nbody_profiling) nbody_profile_pool(nthreads);
+   pool.workers = malloc((nthreads - 1)*sizeof(pthread_t));
+   assert(pool.workers != NULL);
+   for (i = 1; i < nthreads; i++) {
+      assert(pthread_create(&pool.workers[i - 1], NULL, nbody_pool_worker, (void *)(intptr_t)i) == 0);
+   }
+   /* The workers have opened their counters */
+   if (nbody_profiling) pthread_barrier_wait(&pool.sync);
+}
+
+void nbody_pool_run(nbody_pool_fn_t fn, void * arg)
+{
+   if (pool.nthreads == 1) {
+      fn(arg, 0, 1);
+      return;
+   }
+
+   pool.fn  = fn;
+   pool.arg = arg;
+   pthread_barrier_wait(&pool.start);
+   fn(arg, 0, pool.nthreads);
+   pthread_barrier_wait(&pool.end);
+}
+
+/* Only valid from inside a function run by nbody_pool_run, all threads must call it */
+void nbody_pool_barrier(void)
+{
+   if (pool.nthreads == 1) return;
+   pthread_barrier_wait(&pool.sync);
+}
+
+int nbody_pool_size(void)
+{
+   return pool.nthreads;
+}
+
+void nbody_pool_fini(void)
+{
+   int i;
+   if (pool.pin) assert(pthread_setaffinity_np(pthread_self(), sizeof(pool.allowed), &pool.allowed) == 0);
+   if (pool.workers == NULL) return;
+
+   if (nbody_profiling) nbody_profile_pool(1);
+   pool.quit = 1;
+   pthread_barrier_wait(&pool.start);
+   for (i = 1; i < pool.nthreads; i++) {
+      assert(pthread_join(pool.workers[i - 1], NULL) == 0);
+   }
+
+   pthread_barrier_destroy(&pool.start);
+   pthread_barrier_destroy(&pool.end);
+   pthread_barrier_destroy(&pool.sync);
+   free(pool.workers);
+   pool.workers  = NULL;
+   pool.nthreads = 1;
+}
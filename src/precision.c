@@ -0,0 +1,186 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "engine.h"
+
+/* Reduced precision source particles. A packed block stores every source field
+ * (position and weight) as 16 bit codes plus an affine map per field and block,
+ * value = offset + scale*decode(code):
+ *   bf16   upper half of the float, offset 0 and scale 1, so absolute values
+ *   fp16   IEEE half of (value - min)/(max - min), relative to the block box
+ *   int16  unsigned fixed point (value - min)/(max - min)*65535
+ * bf16 keeps 8 mantissa bits of the absolute position, fp16 11 and int16 16 bits
+ * of the block bounding box. Forces are still accumulated in fp32. */
+
+static const char * const precision_names[] = { "fp32", "bf16", "fp16", "int16" };
+static const int num_precisions = sizeof(precision_names)/sizeof(precision_names[0]);
+
+int nbody_precision_find(const char * name)
+{
+   int p;
+   for (p = 0; p < num_precisions; p++) {
+      if (strcmp(precision_names[p], name) == 0) return p;
+   }
+   return -1;
+}
+
+const char * nbody_precision_name(const int precision)
+{
+   return precision_names[precision];
+}
+
+static inline uint32_t float_bits(const float f)
+{
+   uint32_t u;
+   memcpy(&u, &f, sizeof(u));
+   return u;
+}
+
+static inline float bits_float(const uint32_t u)
+{
+   float f;
+   memcpy(&f, &u, sizeof(f));
+   return f;
+}
+
+/* Round to nearest even, the inputs are finite */
+static inline uint16_t float_to_bf16(const float f)
+{
+   const uint32_t u = float_bits(f);
+   return (u + 0x7fffu + ((u >> 16) & 1u)) >> 16;
+}
+
+static inline float bf16_to_float(const uint16_t h)
+{
+   return bits_float((uint32_t)h << 16);
+}
+
+/* Round to nearest even, saturates at the largest half instead of going to inf */
+static inline uint16_t float_to_fp16(const float f)
+{
+   const uint32_t u    = float_bits(f);
+   const uint32_t sign = (u >> 16) & 0x8000u;
+   const uint32_t a    = u & 0x7fffffffu;
+
+   if (a >= 0x477ff000u) return sign | 0x7bffu;
+   if (a <  0x38800000u) return sign | (uint16_t)lrintf(fabsf(f)*0x1p24f); /* subnormal */
+   return sign | ((a - 0x38000000u + 0xfffu + ((a >> 13) & 1u)) >> 13);
+}
+
+static inline float fp16_to_float(const uint16_t h)
+{
+   const uint32_t sign = (uint32_t)(h & 0x8000u) << 16;
+   const uint32_t e    = (h >> 10) & 0x1fu;
+   const uint32_t m    = h & 0x3ffu;
+
+   if (e == 0) return bits_float(sign | float_bits((float)m*0x1p-24f));
+   return bits_float(sign | (e + 112u) << 23 | m << 13);
+}
+
+static void pack_field(uint16_t * const code, float * const offset, float * const scale,
+      const float * const value, const int precision)
+{
+   float min = value[0], max = value[0];
+   int e;
+
+   if (precision == NBODY_PRECISION_BF16) {
+      *offset = 0.0f;
+      *scale  = 1.0f;
+      for (e = 0; e < BLOCK_SIZE; e++) code[e] = float_to_bf16(value[e]);
+      return;
+   }
+
+   for (e = 1; e < BLOCK_SIZE; e++) {
+      min = value[e] < min ? value[e] : min;
+      max = value[e] > max ? value[e] : max;
+   }
+   const float extent = max - min;
+   *offset = min;
+
+   if (precision == NBODY_PRECISION_FP16) {
+      *scale = extent > 0.0f ? extent : 1.0f;
+      for (e = 0; e < BLOCK_SIZE; e++) code[e] = float_to_fp16((value[e] - min)/ *scale);
+   } else {
+      *scale = extent/65535.0f;
+      for (e = 0; e < BLOCK_SIZE; e++) {
+         const long q = extent > 0.0f ? lrintf((value[e] - min)/ *scale) : 0;
+         code[e] = q < 0 ? 0 : q > 65535 ? 65535 : q;
+      }
+   }
+}
+
+static void unpack_field(float * __restrict__ const value, const uint16_t * __restrict__ const code,
+      const float offset, const float scale, const int precision)
+{
+   int e;
+
+   switch (precision) {
+      case NBODY_PRECISION_BF16:
+         for (e = 0; e < BLOCK_SIZE; e++) value[e] = bf16_to_float(code[e]);
+         break;
+      case NBODY_PRECISION_FP16:
+         for (e = 0; e < BLOCK_SIZE; e++) value[e] = offset + scale*fp16_to_float(code[e]);
+         break;
+      default:
+         for (e = 0; e < BLOCK_SIZE; e++) value[e] = offset + scale*(float)code[e];
+         break;
+   }
+}
+
+typedef struct {
+   source_block_t          * packed;
+   const particles_block_t * particles;
+   int                       n_blocks;
+   int                       precision;
+} pack_args_t;
+
+static void pack_blocks(void * arg, const int tid, const int nthreads)
+{
+   const pack_args_t * const args = arg;
+   int i;
+
+   for (i = tid; i < args->n_blocks; i += nthreads) {
+      source_block_t * const packed = args->packed + i;
+      const particles_block_t * const block = args->particles + i;
+
+      pack_field(packed->position_x, &packed->offset[0], &packed->scale[0], block->position_x, args->precision);
+      pack_field(packed->position_y, &packed->offset[1], &packed->scale[1], block->position_y, args->precision);
+      pack_field(packed->position_z, &packed->offset[2], &packed->scale[2], block->position_z, args->precision);
+      pack_field(packed->weight,     &packed->offset[3], &packed->scale[3], block->weight,     args->precision);
+   }
+}
+
+void nbody_pack_sources(source_block_t * const packed, const particles_block_t * const particles,
+      const int n_blocks, const int precision)
+{
+   pack_args_t args = { packed, particles, n_blocks, precision };
+   assert(precision > NBODY_PRECISION_FP32 && precision < num_precisions);
+   nbody_pool_run(pack_blocks, &args);
+}
+
+void nbody_unpack_source(particles_block_t * const block, const source_block_t * const packed,
+      const int precision)
+{
+   unpack_field(block->position_x, packed->position_x, packed->offset[0], packed->scale[0], precision);
+   unpack_field(block->position_y, packed->position_y, packed->offset[1], packed->scale[1], precision);
+   unpack_field(block->position_z, packed->position_z, packed->offset[2], packed->scale[2], precision);
+   unpack_field(block->weight,     packed->weight,     packed->offset[3], packed->scale[3], precision);
+}
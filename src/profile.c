@@ -0,0 +1,298 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "engine.h"
+
+/* Phase instrumentation. Engines and the driver mark where each phase starts
+ * with nbody_phase, everything until the next mark is charged to it, and the end
+ * of every timestep with nbody_step, so the wall time of a run splits exactly
+ * into phases and steps. Disabled, both are a test of nbody_profiling.
+ *
+ * With counters, every pool thread opens its own perf events when it starts,
+ * and they are read from the calling thread at each mark, when the workers wait
+ * on the pool barrier. Events the hardware or the kernel do not offer are
+ * reported as unavailable, events that had to be multiplexed are scaled by
+ * their enabled/running time. fp_ops counts the single precision arithmetic
+ * instructions retired by width on Intel cores (FP_ARITH_INST_RETIRED), times
+ * their lanes. */
+
+int nbody_profiling = 0;
+
+static const char * const phase_names[NBODY_PHASES] = { "other", "forces", "update", "build", "comm", "io" };
+
+#define PROFILE_METRICS 5
+
+static const char * const metric_names[PROFILE_METRICS] = {
+   "task_clock_ns", "cycles", "instructions", "llc_misses", "fp_ops"
+};
+
+typedef struct {
+   int      metric;
+   uint32_t type;
+   uint64_t config;
+   int      weight;
+   int      intel;   /* raw Intel event */
+} profile_event_t;
+
+static const profile_event_t profile_events[] = {
+   { 0, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK,       1, 0 },
+   { 1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,       1, 0 },
+   { 2, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,     1, 0 },
+   { 3, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,     1, 0 },
+   { 4, PERF_TYPE_RAW,      0x02c7,                         1, 1 },  /* scalar single */
+   { 4, PERF_TYPE_RAW,      0x08c7,                         4, 1 },  /* 128 bit packed single */
+   { 4, PERF_TYPE_RAW,      0x20c7,                         8, 1 },  /* 256 bit packed single */
+   { 4, PERF_TYPE_RAW,      0x80c7,                        16, 1 },  /* 512 bit packed single */
+};
+
+#define PROFILE_EVENTS ((int)(sizeof(profile_events)/sizeof(profile_events[0])))
+
+static struct {
+   int      counters;
+   int      phase;
+   double   start, last, step_last;
+   double   wall[NBODY_PHASES];
+   double   count[NBODY_PHASES][PROFILE_METRICS];
+   int      error[PROFILE_EVENTS];     /* errno of the first failed open, 0 if it worked */
+   int      threads;                   /* fd slots */
+   int    (*fd)[PROFILE_EVENTS];
+   double (*seen)[PROFILE_EVENTS];     /* last scaled value of each fd */
+   double * steps;
+   int      n_steps, max_steps;
+} profile;
+
+static void profile_open_thread(const int tid)
+{
+   int k;
+   for (k = 0; k < PROFILE_EVENTS; k++) {
+      struct perf_event_attr attr;
+      const profile_event_t * const ev = &profile_events[k];
+
+      profile.fd[tid][k]   = -1;
+      profile.seen[tid][k] = 0.0;
+      if (ev->intel && !__builtin_cpu_is("intel")) {
+         profile.error[k] = ENOENT;
+         continue;
+      }
+
+      memset(&attr, 0, sizeof(attr));
+      attr.size           = sizeof(attr);
+      attr.type           = ev->type;
+      attr.config         = ev->config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv     = 1;
+      attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+      profile.fd[tid][k] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (profile.fd[tid][k] < 0 && profile.error[k] == 0) profile.error[k] = errno;
+   }
+}
+
+static void profile_read(void)
+{
+   int t, k;
+   for (t = 0; t < profile.threads; t++) {
+      for (k = 0; k < PROFILE_EVENTS; k++) {
+         uint64_t value[3];
+         if (profile.fd[t][k] < 0 || read(profile.fd[t][k], value, sizeof(value)) != sizeof(value)) continue;
+
+         const double scaled = value[2] > 0 ? (double)value[0]*value[1]/value[2] : 0.0;
+         profile.count[profile.phase][profile_events[k].metric] +=
+            (scaled - profile.seen[t][k])*profile_events[k].weight;
+         profile.seen[t][k] = scaled;
+      }
+   }
+}
+
+void nbody_profile_init(const int counters)
+{
+   memset(&profile, 0, sizeof(profile));
+   profile.counters  = counters;
+   profile.threads   = 1;
+   profile.fd        = malloc(sizeof(*profile.fd));
+   profile.seen      = malloc(sizeof(*profile.seen));
+   profile.max_steps = 1024;
+   profile.steps     = malloc(profile.max_steps*sizeof(double));
+   assert(profile.fd && profile.seen && profile.steps);
+
+   memset(profile.fd, -1, sizeof(*profile.fd));
+   if (counters) profile_open_thread(0);
+
+   profile.start = profile.last = profile.step_last = wall_time();
+   nbody_profiling = 1;
+}
+
+void nbody_profile_switch(const int phase)
+{
+   const double now = wall_time();
+   profile.wall[profile.phase] += now - profile.last;
+   if (profile.counters) profile_read();
+   profile.phase = phase;
+   profile.last  = now;
+}
+
+void nbody_profile_step_start(void)
+{
+   profile.step_last = wall_time();
+}
+
+void nbody_profile_step(void)
+{
+   const double now = wall_time();
+   if (profile.n_steps == profile.max_steps) {
+      profile.max_steps *= 2;
+      profile.steps = realloc(profile.steps, profile.max_steps*sizeof(double));
+      assert(profile.steps != NULL);
+   }
+   profile.steps[profile.n_steps++] = now - profile.step_last;
+   profile.step_last = now;
+}
+
+void nbody_profile_thread(const int tid)
+{
+   if (!profile.counters || tid >= profile.threads) return;
+   profile_open_thread(tid);
+}
+
+void nbody_profile_pool(const int nthreads)
+{
+   int t, k;
+
+   if (!profile.counters) return;
+   if (nthreads > 1) {
+      profile.fd   = realloc(profile.fd, nthreads*sizeof(*profile.fd));
+      profile.seen = realloc(profile.seen, nthreads*sizeof(*profile.seen));
+      assert(profile.fd && profile.seen);
+      memset(profile.fd + 1, -1, (nthreads - 1)*sizeof(*profile.fd));
+      profile.threads = nthreads;
+      return;
+   }
+
+   /* The counts of the workers up to now go to the running phase */
+   profile_read();
+   for (t = 1; t < profile.threads; t++) {
+      for (k = 0; k < PROFILE_EVENTS; k++) {
+         if (profile.fd[t][k] >= 0) close(profile.fd[t][k]);
+      }
+   }
+   profile.threads = 1;
+}
+
+void nbody_profile_report(const char * fname, const char * engine, const size_t particles, const int threads,
+      const double pairs)
+{
+   const double now = wall_time();
+   double total, metric[PROFILE_METRICS] = { 0.0 };
+   int available[PROFILE_METRICS], i, k;
+
+   nbody_profile_switch(NBODY_PHASE_OTHER);
+   nbody_profiling = 0;
+   total = now - profile.start;
+
+   for (i = 0; i < PROFILE_METRICS; i++) available[i] = profile.counters;
+   for (k = 0; k < PROFILE_EVENTS; k++) {
+      if (profile.error[k] != 0) available[profile_events[k].metric] = 0;
+   }
+   for (i = 0; i < NBODY_PHASES; i++) {
+      for (k = 0; k < PROFILE_METRICS; k++) metric[k] += profile.count[i][k];
+   }
+
+   FILE * const f = fopen(fname, "w");
+   assert(f != NULL);
+
+   fprintf(f, "{\n  \"engine\": \"%s\",\n  \"particles\": %zu,\n  \"threads\": %d,\n  \"wall_s\": %f,\n",
+         engine, particles, threads, total);
+
+   fprintf(f, "  \"counters\": {");
+   for (i = 0; i < PROFILE_METRICS; i++) {
+      const char * status = available[i] ? "ok" : "disabled";
+      for (k = 0; profile.counters && k < PROFILE_EVENTS; k++) {
+         if (profile_events[k].metric == i && profile.error[k] != 0) status = strerror(profile.error[k]);
+      }
+      fprintf(f, "%s \"%s\": \"%s\"", i ? "," : "", metric_names[i], status);
+   }
+   fprintf(f, " },\n");
+
+   fprintf(f, "  \"phases\": {\n");
+   for (i = 0; i < NBODY_PHASES; i++) {
+      fprintf(f, "    \"%s\": { \"wall_s\": %f, \"fraction\": %f", phase_names[i], profile.wall[i],
+            total > 0.0 ? profile.wall[i]/total : 0.0);
+      for (k = 0; k < PROFILE_METRICS; k++) {
+         if (available[k]) fprintf(f, ", \"%s\": %.0f", metric_names[k], profile.count[i][k]);
+      }
+      fprintf(f, " }%s\n", i + 1 < NBODY_PHASES ? "," : "");
+   }
+   fprintf(f, "  },\n");
+
+   double step_min = 0.0, step_max = 0.0, step_sum = 0.0;
+   for (i = 0; i < profile.n_steps; i++) {
+      step_min  = i == 0 || profile.steps[i] < step_min ? profile.steps[i] : step_min;
+      step_max  = profile.steps[i] > step_max ? profile.steps[i] : step_max;
+      step_sum += profile.steps[i];
+   }
+   fprintf(f, "  \"steps\": { \"count\": %d, \"mean_s\": %f, \"min_s\": %f, \"max_s\": %f, \"wall_s\": [",
+         profile.n_steps, profile.n_steps > 0 ? step_sum/profile.n_steps : 0.0, step_min, step_max);
+   for (i = 0; i < profile.n_steps; i++) fprintf(f, "%s%f", i ? ", " : "", profile.steps[i]);
+   fprintf(f, "] },\n");
+
+   /* The model counts the operations of the exact kernel: 3 sub, 3 mul + 2 add,
+    * sqrt, mul, div, mul, and 3 mul + 3 add to accumulate */
+   const double forces_s = profile.wall[NBODY_PHASE_FORCES];
+   fprintf(f, "  \"derived\": {\n");
+   fprintf(f, "    \"pairs\": %.0f,\n", pairs);
+   fprintf(f, "    \"gpairs_s\": %f,\n", forces_s > 0.0 ? pairs/forces_s/1.0e9 : 0.0);
+   fprintf(f, "    \"model_flops_per_pair\": %d,\n", NBODY_FLOPS_PER_PAIR);
+   fprintf(f, "    \"model_gflop_s\": %f,\n", forces_s > 0.0 ? pairs*NBODY_FLOPS_PER_PAIR/forces_s/1.0e9 : 0.0);
+   if (available[4] && forces_s > 0.0) {
+      fprintf(f, "    \"measured_gflop_s\": %f,\n", profile.count[NBODY_PHASE_FORCES][4]/forces_s/1.0e9);
+   } else {
+      fprintf(f, "    \"measured_gflop_s\": null,\n");
+   }
+   if (available[3] && pairs > 0.0) {
+      fprintf(f, "    \"bytes_per_pair\": %e,\n", 64.0*metric[3]/pairs);
+   } else {
+      fprintf(f, "    \"bytes_per_pair\": null,\n");
+   }
+   if (available[1] && available[2] && metric[1] > 0.0) {
+      fprintf(f, "    \"ipc\": %f,\n", metric[2]/metric[1]);
+   } else {
+      fprintf(f, "    \"ipc\": null,\n");
+   }
+   if (available[0] && total > 0.0) {
+      fprintf(f, "    \"busy_fraction\": %f\n", metric[0]/1.0e9/(threads*total));
+   } else {
+      fprintf(f, "    \"busy_fraction\": null\n");
+   }
+   fprintf(f, "  }\n}\n");
+   assert(fclose(f) == 0);
+
+   for (k = 0; k < PROFILE_EVENTS; k++) {
+      if (profile.fd[0][k] >= 0) close(profile.fd[0][k]);
+   }
+   free(profile.fd);
+   free(profile.seen);
+   free(profile.steps);
+}
@@ -0,0 +1,370 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <assert.h>
+#include "engine.h"
+
+extern int silent;
+
+/* Space-filling curve reordering. Every K timesteps the particles are sorted by
+ * the Morton or Hilbert key of their position in the bounding cube, so that the
+ * particles of a block, and of a tile of a block, are close in space. The driver
+ * keeps the permutation, order[slot] being the original index of the particle in
+ * the slot, and puts the particles back in their original order whenever they
+ * are written out, so checkpoints, trajectories, the .out file and the check
+ * never see it. nbody->remote is the scratch buffer of the permutations, it is
+ * only used inside the engines. */
+
+static const int CURVE_BITS = 21;  /* per axis, 63 bit keys */
+
+static const char * const curve_names[] = { "morton", "hilbert" };
+
+static struct {
+   int        curve;
+   size_t     n;
+   size_t     count;      /* real particles, the padding is kept at the end */
+   uint32_t * order;      /* original index of the particle in each slot */
+   uint64_t * keys, * keys_tmp;
+   uint32_t * index, * index_tmp;
+   int        permuted;   /* local holds the particles in order[] */
+   int        sorts;
+   double     time;
+   double     unsorted;   /* mean distance between consecutive particles before the first sort */
+   double     sorted;     /* same after each sort, summed */
+} reorder;
+
+int nbody_curve_find(const char * name)
+{
+   int i;
+   for (i = 0; i < (int)(sizeof(curve_names)/sizeof(curve_names[0])); i++) {
+      if (strcmp(name, curve_names[i]) == 0) return i;
+   }
+   return -1;
+}
+
+static inline uint64_t curve_spread(uint64_t v)
+{
+   v &= 0x1fffff;
+   v = (v | v << 32) & 0x1f00000000ffffULL;
+   v = (v | v << 16) & 0x1f0000ff0000ffULL;
+   v = (v | v <<  8) & 0x100f00f00f00f00fULL;
+   v = (v | v <<  4) & 0x10c30c30c30c30c3ULL;
+   v = (v | v <<  2) & 0x1249249249249249ULL;
+   return v;
+}
+
+/* The Hilbert key is the Morton interleave of the coordinates transposed with
+ * Skilling's algorithm (AIP Conf. Proc. 707, 2004) */
+uint64_t nbody_curve_key(const int curve, uint32_t x, uint32_t y, uint32_t z)
+{
+   if (curve == NBODY_CURVE_HILBERT) {
+      uint32_t c[3] = { x, y, z }, q, t;
+      int i;
+
+      for (q = 1u << (CURVE_BITS - 1); q > 1; q >>= 1) {
+         const uint32_t p = q - 1;
+         for (i = 0; i < 3; i++) {
+            if (c[i] & q) {
+               c[0] ^= p;
+            } else {
+               t = (c[0] ^ c[i]) & p;
+               c[0] ^= t;
+               c[i] ^= t;
+            }
+         }
+      }
+      c[1] ^= c[0];
+      c[2] ^= c[1];
+      for (t = 0, q = 1u << (CURVE_BITS - 1); q > 1; q >>= 1) {
+         if (c[2] & q) t ^= q - 1;
+      }
+      x = c[0] ^ t;
+      y = c[1] ^ t;
+      z = c[2] ^ t;
+   }
+   return curve_spread(x) << 2 | curve_spread(y) << 1 | curve_spread(z);
+}
+
+typedef struct {
+   const uint64_t * keys;
+   uint64_t       * keys_out;
+   const uint32_t * index;
+   uint32_t       * index_out;
+   size_t           n;
+   int              shift;
+   size_t        (* count)[256];   /* per thread digit counts, then offsets */
+} radix_args_t;
+
+static void radix_count(void * arg, const int tid, const int nthreads)
+{
+   radix_args_t * const args = arg;
+   size_t * const count = args->count[tid];
+   size_t begin, end, p;
+
+   memset(count, 0, 256*sizeof(size_t));
+   nbody_pool_range(args->n, 1, tid, nthreads, &begin, &end);
+   for (p = begin; p < end; p++) count[(args->keys[p] >> args->shift) & 0xff]++;
+}
+
+static void radix_scatter(void * arg, const int tid, const int nthreads)
+{
+   radix_args_t * const args = arg;
+   size_t * const offset = args->count[tid];
+   size_t begin, end, p;
+
+   nbody_pool_range(args->n, 1, tid, nthreads, &begin, &end);
+   for (p = begin; p < end; p++) {
+      const size_t dst = offset[(args->keys[p] >> args->shift) & 0xff]++;
+      args->keys_out[dst]  = args->keys[p];
+      args->index_out[dst] = args->index[p];
+   }
+}
+
+void nbody_radix_sort(uint64_t ** keys, uint32_t ** index, uint64_t ** keys_tmp, uint32_t ** index_tmp,
+      const size_t n)
+{
+   const int nthreads = nbody_pool_size();
+   radix_args_t args = { NULL, NULL, NULL, NULL, n, 0, NULL };
+   int pass, d, t;
+
+   args.count = malloc(nthreads*sizeof(*args.count));
+   assert(args.count != NULL);
+
+   for (pass = 0; pass < 8 && n > 0; pass++) {
+      size_t offset = 0;
+
+      args.keys      = *keys;
+      args.keys_out  = *keys_tmp;
+      args.index     = *index;
+      args.index_out = *index_tmp;
+      args.shift     = pass*8;
+      nbody_pool_run(radix_count, &args);
+
+      /* Digit major, thread minor, so the sort stays stable */
+      const int digit = ((*keys)[0] >> args.shift) & 0xff;
+      size_t same = 0;
+      for (t = 0; t < nthreads; t++) same += args.count[t][digit];
+      if (same == n) continue;
+
+      for (d = 0; d < 256; d++) {
+         for (t = 0; t < nthreads; t++) {
+            const size_t c = args.count[t][d];
+            args.count[t][d] = offset;
+            offset += c;
+         }
+      }
+      nbody_pool_run(radix_scatter, &args);
+
+      uint64_t * const k = *keys;  *keys  = *keys_tmp;  *keys_tmp  = k;
+      uint32_t * const i = *index; *index = *index_tmp; *index_tmp = i;
+   }
+   free(args.count);
+}
+
+typedef struct {
+   particles_block_t       * dst;
+   const particles_block_t * src;
+   const uint32_t          * map;
+   size_t                    n;
+   int                       scatter;   /* dst[map[s]] = src[s], else dst[s] = src[map[s]] */
+   float                     min[3];
+   float                     scale;
+   double                  * distance;  /* per thread */
+} permute_args_t;
+
+#define P(blocks, field, i) ((blocks)[(i)/BLOCK_SIZE].field[(i)%BLOCK_SIZE])
+
+static void permute_part(void * arg, const int tid, const int nthreads)
+{
+   permute_args_t * const args = arg;
+   size_t begin, end, s;
+
+   nbody_pool_range(args->n, BLOCK_SIZE, tid, nthreads, &begin, &end);
+   for (s = begin; s < end; s++) {
+      const size_t d = args->scatter ? args->map[s] : s;
+      const size_t i = args->scatter ? s : args->map[s];
+
+      P(args->dst, position_x, d) = P(args->src, position_x, i);
+      P(args->dst, position_y, d) = P(args->src, position_y, i);
+      P(args->dst, position_z, d) = P(args->src, position_z, i);
+      P(args->dst, velocity_x, d) = P(args->src, velocity_x, i);
+      P(args->dst, velocity_y, d) = P(args->src, velocity_y, i);
+      P(args->dst, velocity_z, d) = P(args->src, velocity_z, i);
+      P(args->dst, mass, d)       = P(args->src, mass, i);
+      P(args->dst, weight, d)     = P(args->src, weight, i);
+   }
+}
+
+/* Moves the particles of nbody->local through nbody->remote */
+static void permute(nbody_t * const nbody, const uint32_t * const map, const int scatter)
+{
+   permute_args_t args = { nbody->remote, nbody->local, map, reorder.n, scatter };
+
+   nbody_pool_run(permute_part, &args);
+   memcpy(nbody->local, nbody->remote, nbody->num_particles*sizeof(particles_block_t));
+}
+
+static void curve_keys(void * arg, const int tid, const int nthreads)
+{
+   const permute_args_t * const args = arg;
+   const uint32_t max = (1u << CURVE_BITS) - 1;
+   size_t begin, end, p;
+
+   nbody_pool_range(args->n, BLOCK_SIZE, tid, nthreads, &begin, &end);
+   for (p = begin; p < end; p++) {
+      const float x = (P(args->src, position_x, p) - args->min[0])*args->scale;
+      const float y = (P(args->src, position_y, p) - args->min[1])*args->scale;
+      const float z = (P(args->src, position_z, p) - args->min[2])*args->scale;
+
+      reorder.keys[p]  = reorder.order[p] >= reorder.count ? UINT64_MAX :
+         nbody_curve_key(reorder.curve, x < max ? (uint32_t)x : max,
+            y < max ? (uint32_t)y : max, z < max ? (uint32_t)z : max);
+      reorder.index[p] = p;
+   }
+}
+
+static void consecutive_distance(void * arg, const int tid, const int nthreads)
+{
+   permute_args_t * const args = arg;
+   double sum = 0.0;
+   size_t begin, end, p;
+
+   nbody_pool_range(args->n - 1, 1, tid, nthreads, &begin, &end);
+   for (p = begin; p < end; p++) {
+      const double dx = P(args->src, position_x, p + 1) - P(args->src, position_x, p);
+      const double dy = P(args->src, position_y, p + 1) - P(args->src, position_y, p);
+      const double dz = P(args->src, position_z, p + 1) - P(args->src, position_z, p);
+      sum += sqrt(dx*dx + dy*dy + dz*dz);
+   }
+   args->distance[tid] = sum;
+}
+
+/* Mean distance between consecutive particles of local, how far apart the
+ * particles sharing a tile of the kernels are */
+static double locality(nbody_t * const nbody)
+{
+   const int nthreads = nbody_pool_size();
+   permute_args_t args = { NULL, nbody->local, NULL, reorder.count, 0 };
+   double sum = 0.0;
+   int t;
+
+   if (reorder.count < 2) return 0.0;
+
+   args.distance = malloc(nthreads*sizeof(double));
+   assert(args.distance != NULL);
+   nbody_pool_run(consecutive_distance, &args);
+   for (t = 0; t < nthreads; t++) sum += args.distance[t];
+   free(args.distance);
+   return sum/(reorder.count - 1);
+}
+
+void nbody_reorder_init(nbody_t * const nbody, const nbody_opts_t * const opts)
+{
+   size_t s;
+
+   memset(&reorder, 0, sizeof(reorder));
+   reorder.curve     = nbody_curve_find(opts->curve);
+   reorder.n         = (size_t)nbody->num_particles*BLOCK_SIZE;
+   reorder.count     = nbody->count;
+   reorder.order     = malloc(reorder.n*sizeof(uint32_t));
+   reorder.keys      = malloc(reorder.n*sizeof(uint64_t));
+   reorder.keys_tmp  = malloc(reorder.n*sizeof(uint64_t));
+   reorder.index     = malloc(reorder.n*sizeof(uint32_t));
+   reorder.index_tmp = malloc(reorder.n*sizeof(uint32_t));
+   assert(reorder.curve >= 0 && reorder.n < UINT32_MAX);
+   assert(reorder.order && reorder.keys && reorder.keys_tmp && reorder.index && reorder.index_tmp);
+
+   for (s = 0; s < reorder.n; s++) reorder.order[s] = s;
+}
+
+void nbody_reorder(nbody_t * const nbody, const int threads, const int sort)
+{
+   const double start = wall_time();
+   permute_args_t args = { NULL, nbody->local, NULL, reorder.n, 0 };
+   float min[3], max[3];
+   size_t s;
+
+   if (!sort && (reorder.permuted || reorder.sorts == 0)) return;
+   nbody_pool_init(threads);
+
+   if (!sort) {
+      /* Back in the order of the last sort after writing the particles out */
+      permute(nbody, reorder.order, 0);
+      reorder.permuted = 1;
+      nbody_pool_fini();
+      reorder.time += wall_time() - start;
+      return;
+   }
+
+   if (!reorder.permuted) {
+      for (s = 0; s < reorder.n; s++) reorder.order[s] = s;
+   }
+   if (reorder.sorts == 0) reorder.unsorted = locality(nbody);
+
+   nbody_bounding_box(nbody->local, nbody->count, min, max);
+   const float size = fmaxf(max[0] - min[0], fmaxf(max[1] - min[1], max[2] - min[2]));
+   memcpy(args.min, min, sizeof(min));
+   args.scale = size > 0.0f ? (1u << CURVE_BITS)/(size*(1.0f + FLT_EPSILON)) : 1.0f;
+
+   nbody_pool_run(curve_keys, &args);
+   nbody_radix_sort(&reorder.keys, &reorder.index, &reorder.keys_tmp, &reorder.index_tmp, reorder.n);
+   permute(nbody, reorder.index, 0);
+
+   /* The new slot s holds the particle of the old slot index[s] */
+   for (s = 0; s < reorder.n; s++) reorder.index_tmp[s] = reorder.order[reorder.index[s]];
+   uint32_t * const order = reorder.order; reorder.order = reorder.index_tmp; reorder.index_tmp = order;
+
+   reorder.sorted += locality(nbody);
+   reorder.permuted = 1;
+   reorder.sorts++;
+
+   nbody_pool_fini();
+   reorder.time += wall_time() - start;
+}
+
+void nbody_reorder_restore(nbody_t * const nbody, const int threads)
+{
+   const double start = wall_time();
+
+   if (!reorder.permuted) return;
+   nbody_pool_init(threads);
+   permute(nbody, reorder.order, 1);
+   nbody_pool_fini();
+   reorder.permuted = 0;
+   reorder.time += wall_time() - start;
+}
+
+void nbody_reorder_fini(nbody_t * const nbody, const nbody_opts_t * const opts, const double execution)
+{
+   nbody_reorder_restore(nbody, opts->threads);
+
+   if (reorder.sorts > 0) {
+      const double sorted = reorder.sorted/reorder.sorts;
+      silent?:printf("> Reorder (%s every %d steps): %d sorts, %f secs (%.1f%% of the execution)\n",
+            curve_names[reorder.curve], opts->reorder, reorder.sorts, reorder.time, 100.0*reorder.time/execution);
+      silent?:printf("> Mean distance between consecutive particles: %e m unsorted, %e m sorted (%.1fx closer)\n",
+            reorder.unsorted, sorted, reorder.unsorted/sorted);
+   }
+
+   free(reorder.order);
+   free(reorder.keys);  free(reorder.keys_tmp);
+   free(reorder.index); free(reorder.index_tmp);
+}
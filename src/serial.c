@@ -0,0 +1,106 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "engine.h"
+
+extern int silent;
+
+/* Stand-ins for the host-only sources (pool.c, simd.c, comm.c, profile.c and the
+ * host engines) in the accelerator builds, which only run the ompss engine: one
+ * thread, one rank, no counters and no host kernels. The options that need them
+ * are rejected by the same checks that reject a bad value in the host builds. */
+
+int nbody_profiling;
+
+void nbody_pool_pin(const int pin) { (void)pin; }
+void nbody_pool_init(const int nthreads) { (void)nthreads; }
+void nbody_pool_run(nbody_pool_fn_t fn, void * arg) { fn(arg, 0, 1); }
+void nbody_pool_barrier(void) {}
+int  nbody_pool_size(void) { return 1; }
+void nbody_pool_fini(void) {}
+
+int nbody_comm_init(int * argc, char *** argv, const int ranks, const size_t slab)
+{
+   (void)argc; (void)argv; (void)slab;
+   if (ranks > 1) fprintf(stderr, "Ranks need a host build, running on one\n");
+   return 1;
+}
+int    nbody_comm_rank(void) { return 0; }
+int    nbody_comm_size(void) { return 1; }
+void   nbody_comm_barrier(void) {}
+double nbody_comm_sum(const double value) { return value; }
+double nbody_comm_max(const double value) { return value; }
+double nbody_comm_min(const double value) { return value; }
+int    nbody_comm_fini(const int status) { return status; }
+
+void nbody_profile_init(const int counters)
+{
+   (void)counters;
+   fprintf(stderr, "Profiling needs a host build, ignored\n");
+}
+void nbody_profile_switch(const int phase) { (void)phase; }
+void nbody_profile_step(void) {}
+void nbody_profile_step_start(void) {}
+void nbody_profile_report(const char * fname, const char * engine, const size_t particles, const int threads,
+      const double pairs)
+{
+   (void)fname; (void)engine; (void)particles; (void)threads; (void)pairs;
+}
+
+/* Only the defaults, nothing uses the host kernels */
+int nbody_simd_select(const char * isa, const int newton, const int tile)
+{
+   (void)newton;
+   return strcmp(isa, "auto") == 0 && (tile == 0 || tile == (int)BLOCK_SIZE) ? 0 : -1;
+}
+
+void nbody_simd_describe(char * buf, const size_t len)
+{
+   snprintf(buf, len, "none");
+}
+
+int nbody_schedule_select(const char * name)
+{
+   return strcmp(name, "tiled") == 0 || strcmp(name, "slice") == 0 ? 0 : -1;
+}
+
+int nbody_integrator_find(const char * name)
+{
+   return strcmp(name, "euler") == 0 ? NBODY_INTEGRATOR_EULER : -1;
+}
+
+int nbody_tune(const nbody_engine_t * const engine, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, const char * prefix)
+{
+   (void)engine; (void)conf; (void)opts; (void)prefix;
+   return 1;
+}
+
+int nbody_tune_load(const char * engine, nbody_opts_t * const opts, const int given)
+{
+   (void)engine; (void)opts; (void)given;
+   return 0;
+}
+
+int nbody_ensemble(const char * fname, const nbody_opts_t * const opts)
+{
+   (void)fname; (void)opts;
+   fprintf(stderr, "Ensembles need a host build\n");
+   return 1;
+}
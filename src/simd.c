@@ -0,0 +1,314 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "engine.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define SIMD_X86 1
+#endif
+
+/* Newton steps after the reciprocal square root estimate, <0 means sqrt+div */
+static int simd_newton = -1;
+
+/* Source particles per tile of the SIMD kernels, one of simd_tiles or the block */
+static int simd_tile = NBODY_BLOCK_SIZE;
+
+static const int simd_tiles[] = { 256, 512, 1024, 2048 };
+
+/* Calls body with the tile size as a constant, so every tile gets its own copy
+ * with fixed trip counts. Bigger tiles than the block are never selected. */
+#define SIMD_TILED(body, ...) do {                                      \
+      switch (simd_tile) {                                              \
+         case 256:  body(__VA_ARGS__, 256);        break;               \
+         case 512:  body(__VA_ARGS__, 512);        break;               \
+         case 1024: body(__VA_ARGS__, 1024);       break;               \
+         default:   body(__VA_ARGS__, BLOCK_SIZE); break;               \
+      }                                                                 \
+   } while (0)
+
+static void forces_scalar(force_block_t * __restrict__ const forces,
+      const particles_block_t * __restrict__ const target, const particles_block_t * __restrict__ const source,
+      const int e0, const int e1, const int s1)
+{
+   host_forces_slice(forces, target, source, e0, e1, s1);
+}
+
+#include "simd_hermite.h"
+#include "simd_cutoff.h"
+
+/* One pair of the symmetric kernel, target force accumulated in fi */
+static inline void host_sym_pair(force_block_t * const fj, const particles_block_t * const bi,
+      const particles_block_t * const bj, const int e, const int k, single_force * const fi)
+{
+   const float diff_x = bj->position_x[k] - bi->position_x[e];
+   const float diff_y = bj->position_y[k] - bi->position_y[e];
+   const float diff_z = bj->position_z[k] - bi->position_z[e];
+
+   const float distance_squared = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
+   const float distance = sqrtf(distance_squared);
+
+   const float force = bi->mass[e] * bj->weight[k] / (distance_squared * distance);
+   const float force_corrected = distance_squared == 0.0f ? 0.0f : force;
+
+   fi->x += force_corrected * diff_x;
+   fi->y += force_corrected * diff_y;
+   fi->z += force_corrected * diff_z;
+   fj->x[k] -= force_corrected * diff_x;
+   fj->y[k] -= force_corrected * diff_y;
+   fj->z[k] -= force_corrected * diff_z;
+}
+
+static void forces_scalar_sym(force_block_t * const fi, force_block_t * const fj,
+      const particles_block_t * const bi, const particles_block_t * const bj, const int diagonal)
+{
+   int e, k;
+   for (e = 0; e < BLOCK_SIZE; e++) {
+      single_force f = { 0.0f, 0.0f, 0.0f };
+      for (k = diagonal ? e + 1 : 0; k < BLOCK_SIZE; k++) {
+         host_sym_pair(fj, bi, bj, e, k, &f);
+      }
+      fi->x[e] += f.x;
+      fi->y[e] += f.y;
+      fi->z[e] += f.z;
+   }
+}
+
+#ifdef SIMD_X86
+
+__attribute__((target("sse2")))
+static inline float hsum_sse(const __m128 v)
+{
+   const __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+   return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+}
+
+__attribute__((target("avx2")))
+static inline float hsum_avx2(const __m256 v)
+{
+   return hsum_sse(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+#define SIMD_KERNEL            forces_sse
+#define SIMD_TARGET            "sse2"
+#define SIMD_WIDTH             4
+#define vec_t                  __m128
+#define vec_load               _mm_loadu_ps
+#define vec_store              _mm_storeu_ps
+#define vec_set1               _mm_set1_ps
+#define vec_add                _mm_add_ps
+#define vec_sub                _mm_sub_ps
+#define vec_mul                _mm_mul_ps
+#define vec_div                _mm_div_ps
+#define vec_sqrt               _mm_sqrt_ps
+#define vec_rsqrt              _mm_rsqrt_ps
+#define vec_hsum               hsum_sse
+#define vec_zero_if_zero(c, v) _mm_andnot_ps(_mm_cmpeq_ps(c, _mm_setzero_ps()), v)
+#define vec_zero_if_greater(c, l, v) _mm_and_ps(_mm_cmple_ps(c, l), v)
+#include "simd_kernel.h"
+#include "simd_hermite.h"
+#include "simd_cutoff.h"
+#undef SIMD_KERNEL
+#undef SIMD_TARGET
+#undef SIMD_WIDTH
+#undef vec_t
+#undef vec_load
+#undef vec_store
+#undef vec_set1
+#undef vec_add
+#undef vec_sub
+#undef vec_mul
+#undef vec_div
+#undef vec_sqrt
+#undef vec_rsqrt
+#undef vec_hsum
+#undef vec_zero_if_zero
+#undef vec_zero_if_greater
+
+#define SIMD_KERNEL            forces_avx2
+#define SIMD_TARGET            "avx2"
+#define SIMD_WIDTH             8
+#define vec_t                  __m256
+#define vec_load               _mm256_loadu_ps
+#define vec_store              _mm256_storeu_ps
+#define vec_set1               _mm256_set1_ps
+#define vec_add                _mm256_add_ps
+#define vec_sub                _mm256_sub_ps
+#define vec_mul                _mm256_mul_ps
+#define vec_div                _mm256_div_ps
+#define vec_sqrt               _mm256_sqrt_ps
+#define vec_rsqrt              _mm256_rsqrt_ps
+#define vec_hsum               hsum_avx2
+#define vec_zero_if_zero(c, v) _mm256_andnot_ps(_mm256_cmp_ps(c, _mm256_setzero_ps(), _CMP_EQ_OQ), v)
+#define vec_zero_if_greater(c, l, v) _mm256_and_ps(_mm256_cmp_ps(c, l, _CMP_LE_OQ), v)
+#include "simd_kernel.h"
+#include "simd_hermite.h"
+#include "simd_cutoff.h"
+#undef SIMD_KERNEL
+#undef SIMD_TARGET
+#undef SIMD_WIDTH
+#undef vec_t
+#undef vec_load
+#undef vec_store
+#undef vec_set1
+#undef vec_add
+#undef vec_sub
+#undef vec_mul
+#undef vec_div
+#undef vec_sqrt
+#undef vec_rsqrt
+#undef vec_hsum
+#undef vec_zero_if_zero
+#undef vec_zero_if_greater
+
+#define SIMD_KERNEL            forces_avx512
+#define SIMD_TARGET            "avx512f"
+#define SIMD_WIDTH             16
+#define vec_t                  __m512
+#define vec_load               _mm512_loadu_ps
+#define vec_store              _mm512_storeu_ps
+#define vec_set1               _mm512_set1_ps
+#define vec_add                _mm512_add_ps
+#define vec_sub                _mm512_sub_ps
+#define vec_mul                _mm512_mul_ps
+#define vec_div                _mm512_div_ps
+#define vec_sqrt               _mm512_sqrt_ps
+#define vec_rsqrt              _mm512_rsqrt14_ps
+#define vec_hsum               _mm512_reduce_add_ps
+#define vec_zero_if_zero(c, v) _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(c, _mm512_setzero_ps(), _CMP_NEQ_UQ), v)
+#define vec_zero_if_greater(c, l, v) _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(c, l, _CMP_LE_OQ), v)
+#include "simd_kernel.h"
+#include "simd_hermite.h"
+#include "simd_cutoff.h"
+#undef SIMD_KERNEL
+#undef SIMD_TARGET
+#undef SIMD_WIDTH
+#undef vec_t
+#undef vec_load
+#undef vec_store
+#undef vec_set1
+#undef vec_add
+#undef vec_sub
+#undef vec_mul
+#undef vec_div
+#undef vec_sqrt
+#undef vec_rsqrt
+#undef vec_hsum
+#undef vec_zero_if_zero
+#undef vec_zero_if_greater
+
+#endif /* SIMD_X86 */
+
+typedef struct {
+   const char*       name;
+   int               (*supported)(void);
+   nbody_forces_fn_t exact;
+   nbody_forces_fn_t rsqrt;
+   nbody_sym_fn_t    sym;
+   nbody_hermite_fn_t hermite;
+   nbody_cutoff_fn_t  cutoff;
+} simd_isa_t;
+
+static int supports_always(void) { return 1; }
+#ifdef SIMD_X86
+static int supports_sse2(void)   { return __builtin_cpu_supports("sse2"); }
+static int supports_avx2(void)   { return __builtin_cpu_supports("avx2"); }
+static int supports_avx512(void) { return __builtin_cpu_supports("avx512f"); }
+#endif
+
+/* Best first, so "auto" picks the first supported one */
+static const simd_isa_t isas[] = {
+#ifdef SIMD_X86
+   { "avx512", supports_avx512, forces_avx512_exact, forces_avx512_rsqrt, forces_avx512_sym, forces_avx512_hermite, forces_avx512_cutoff },
+   { "avx2",   supports_avx2,   forces_avx2_exact,   forces_avx2_rsqrt,   forces_avx2_sym,   forces_avx2_hermite,   forces_avx2_cutoff   },
+   { "sse",    supports_sse2,   forces_sse_exact,    forces_sse_rsqrt,    forces_sse_sym,    forces_sse_hermite,    forces_sse_cutoff    },
+#endif
+   { "scalar", supports_always, forces_scalar,       NULL,                forces_scalar_sym, forces_scalar_hermite, forces_scalar_cutoff },
+};
+
+static const int num_isas  = sizeof(isas)/sizeof(isas[0]);
+static const int num_tiles = sizeof(simd_tiles)/sizeof(simd_tiles[0]);
+
+static const simd_isa_t * simd_isa = &isas[sizeof(isas)/sizeof(isas[0]) - 1];
+
+nbody_forces_fn_t nbody_forces_slice = forces_scalar;
+nbody_sym_fn_t    nbody_forces_sym   = forces_scalar_sym;
+nbody_hermite_fn_t nbody_hermite_slice = forces_scalar_hermite;
+nbody_cutoff_fn_t  nbody_cutoff_slice  = forces_scalar_cutoff;
+
+/* Biggest tile whose source positions, weights and symmetric forces fit in the
+ * L1 data cache */
+static int simd_auto_tile(void)
+{
+   long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+   int i, tile = simd_tiles[0];
+
+   if (l1 <= 0) l1 = 32*1024;
+   for (i = 0; i < num_tiles; i++) {
+      const size_t bytes = (size_t)simd_tiles[i]*(4 + 3)*sizeof(float);
+      if (simd_tiles[i] <= BLOCK_SIZE && bytes <= (size_t)l1) tile = simd_tiles[i];
+   }
+   return tile < BLOCK_SIZE ? tile : BLOCK_SIZE;
+}
+
+int nbody_simd_select(const char * name, const int newton, const int tile)
+{
+   int i;
+
+   if (tile == 0) {
+      simd_tile = simd_auto_tile();
+   } else {
+      for (i = 0; i < num_tiles && simd_tiles[i] != tile; i++);
+      if ((i == num_tiles && tile != BLOCK_SIZE) || tile > BLOCK_SIZE) return -1;
+      simd_tile = tile;
+   }
+
+   for (i = 0; i < num_isas; i++) {
+      const int match = strcmp(name, "auto") == 0 || strcmp(name, isas[i].name) == 0;
+      if (!match || !isas[i].supported()) continue;
+      if (newton >= 0 && isas[i].rsqrt == NULL) continue;
+
+      simd_isa    = &isas[i];
+      simd_newton = newton;
+      nbody_forces_slice = newton < 0 ? isas[i].exact : isas[i].rsqrt;
+      nbody_forces_sym   = isas[i].sym;
+      nbody_hermite_slice = isas[i].hermite;
+      nbody_cutoff_slice  = isas[i].cutoff;
+      return 0;
+   }
+   return -1;
+}
+
+const char * nbody_simd_isa(void)
+{
+   return simd_isa->name;
+}
+
+void nbody_simd_describe(char * buf, const size_t len)
+{
+   /* The scalar kernel has a single variant */
+   const int tile = simd_isa->rsqrt != NULL ? simd_tile : BLOCK_SIZE;
+
+   if (simd_newton < 0) {
+      snprintf(buf, len, "%s, sqrt+div, tile %d", simd_isa->name, tile);
+   } else {
+      snprintf(buf, len, "%s, rsqrt+%d newton, tile %d", simd_isa->name, simd_newton, tile);
+   }
+}
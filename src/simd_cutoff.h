@@ -0,0 +1,113 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Cutoff kernel: forces of the [t0, t1) targets from the [s0, s1) sources of the
+ * particles packed cell after cell by the cutoff engine, pairs farther than the
+ * cutoff (and the target itself) contributing nothing. The sources of a neighbor
+ * row are a few cells long, so the vector version keeps one target broadcast and
+ * goes over the sources SIMD_WIDTH at a time. Included by simd.c like
+ * simd_hermite.h, the cutoff makes it approximate anyway. */
+
+#ifndef SIMD_TARGET
+
+static inline void cutoff_scalar_target(const cell_particles_t * const cells, const int e,
+      const int s0, const int s1, const float cutoff_squared, single_force * const f)
+{
+   const float pos_x1 = cells->position_x[e];
+   const float pos_y1 = cells->position_y[e];
+   const float pos_z1 = cells->position_z[e];
+   int j;
+
+   for (j = s0; j < s1; j++) {
+      const float diff_x = cells->position_x[j] - pos_x1;
+      const float diff_y = cells->position_y[j] - pos_y1;
+      const float diff_z = cells->position_z[j] - pos_z1;
+
+      const float distance_squared = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
+      const float distance = sqrtf(distance_squared);
+
+      const float force = cells->weight[j] / (distance_squared * distance);
+      const float force_corrected = distance_squared == 0.0f || distance_squared > cutoff_squared ? 0.0f : force;
+
+      f->x += force_corrected * diff_x;
+      f->y += force_corrected * diff_y;
+      f->z += force_corrected * diff_z;
+   }
+}
+
+static void forces_scalar_cutoff(cell_particles_t * const cells, const int t0, const int t1,
+      const int s0, const int s1, const float cutoff_squared)
+{
+   int e;
+   for (e = t0; e < t1; e++) {
+      single_force f = { 0.0f, 0.0f, 0.0f };
+      cutoff_scalar_target(cells, e, s0, s1, cutoff_squared, &f);
+      cells->force_x[e] += cells->mass[e] * f.x;
+      cells->force_y[e] += cells->mass[e] * f.y;
+      cells->force_z[e] += cells->mass[e] * f.z;
+   }
+}
+
+#else
+
+__attribute__((target(SIMD_TARGET)))
+static void SIMD_CAT(SIMD_KERNEL, _cutoff)(cell_particles_t * const cells, const int t0, const int t1,
+      const int s0, const int s1, const float cutoff_squared)
+{
+   const int s_end = s0 + (s1 - s0)/SIMD_WIDTH*SIMD_WIDTH;
+   const vec_t limit = vec_set1(cutoff_squared);
+   int e, j;
+
+   for (e = t0; e < t1; e++) {
+      const vec_t pos_x1 = vec_set1(cells->position_x[e]);
+      const vec_t pos_y1 = vec_set1(cells->position_y[e]);
+      const vec_t pos_z1 = vec_set1(cells->position_z[e]);
+      vec_t fx = vec_set1(0.0f);
+      vec_t fy = vec_set1(0.0f);
+      vec_t fz = vec_set1(0.0f);
+      single_force f;
+
+      for (j = s0; j < s_end; j += SIMD_WIDTH) {
+         const vec_t diff_x = vec_sub(vec_load(&cells->position_x[j]), pos_x1);
+         const vec_t diff_y = vec_sub(vec_load(&cells->position_y[j]), pos_y1);
+         const vec_t diff_z = vec_sub(vec_load(&cells->position_z[j]), pos_z1);
+
+         const vec_t distance_squared = vec_add(vec_add(vec_mul(diff_x, diff_x), vec_mul(diff_y, diff_y)),
+               vec_mul(diff_z, diff_z));
+         const vec_t distance = vec_sqrt(distance_squared);
+
+         const vec_t force = vec_div(vec_load(&cells->weight[j]), vec_mul(distance_squared, distance));
+         const vec_t force_corrected = vec_zero_if_greater(distance_squared, limit,
+               vec_zero_if_zero(distance_squared, force));
+
+         fx = vec_add(fx, vec_mul(force_corrected, diff_x));
+         fy = vec_add(fy, vec_mul(force_corrected, diff_y));
+         fz = vec_add(fz, vec_mul(force_corrected, diff_z));
+      }
+
+      f.x = vec_hsum(fx);
+      f.y = vec_hsum(fy);
+      f.z = vec_hsum(fz);
+      if (s_end < s1) cutoff_scalar_target(cells, e, s_end, s1, cutoff_squared, &f);
+
+      cells->force_x[e] += cells->mass[e] * f.x;
+      cells->force_y[e] += cells->mass[e] * f.y;
+      cells->force_z[e] += cells->mass[e] * f.z;
+   }
+}
+
+#endif
@@ -0,0 +1,124 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Hermite kernel: acceleration and jerk of a [e0, e1) target slice from the
+ * [0, s1) particles of a source block,
+ *   a += w*r/|r|^3,  j += w*(v/|r|^3 - 3*(r.v)*r/|r|^5)
+ * with r and v the relative position and velocity and w = G*m of the source.
+ * Included by simd.c once without SIMD_TARGET for the scalar version, and after
+ * each simd_kernel.h for the vector one, laid out like the exact kernel. It does
+ * not need to match any other kernel, so the usual flags apply. */
+
+#ifndef SIMD_TARGET
+
+static void forces_scalar_hermite(force_block_t * __restrict__ const acc, force_block_t * __restrict__ const jerk,
+      const particles_block_t * __restrict__ const target, const particles_block_t * __restrict__ const source,
+      const int e0, const int e1, const int s1)
+{
+   int e, j;
+   for (j = 0; j < s1; j++) {
+      const float pos_x2 = source->position_x[j];
+      const float pos_y2 = source->position_y[j];
+      const float pos_z2 = source->position_z[j];
+      const float vel_x2 = source->velocity_x[j];
+      const float vel_y2 = source->velocity_y[j];
+      const float vel_z2 = source->velocity_z[j];
+      const float weight2 = source->weight[j];
+
+      for (e = e0; e < e1; e++) {
+         const float diff_x = pos_x2 - target->position_x[e];
+         const float diff_y = pos_y2 - target->position_y[e];
+         const float diff_z = pos_z2 - target->position_z[e];
+         const float dvel_x = vel_x2 - target->velocity_x[e];
+         const float dvel_y = vel_y2 - target->velocity_y[e];
+         const float dvel_z = vel_z2 - target->velocity_z[e];
+
+         const float distance_squared = diff_x * diff_x + diff_y * diff_y + diff_z * diff_z;
+         const float inv_squared = distance_squared == 0.0f ? 0.0f : 1.0f / distance_squared;
+         const float inv_cubed_weight = weight2 * inv_squared * sqrtf(inv_squared);
+         const float rv = 3.0f * (diff_x * dvel_x + diff_y * dvel_y + diff_z * dvel_z) * inv_squared;
+
+         acc->x[e]  += inv_cubed_weight * diff_x;
+         acc->y[e]  += inv_cubed_weight * diff_y;
+         acc->z[e]  += inv_cubed_weight * diff_z;
+         jerk->x[e] += inv_cubed_weight * (dvel_x - rv * diff_x);
+         jerk->y[e] += inv_cubed_weight * (dvel_y - rv * diff_y);
+         jerk->z[e] += inv_cubed_weight * (dvel_z - rv * diff_z);
+      }
+   }
+}
+
+#else
+
+__attribute__((target(SIMD_TARGET)))
+static void SIMD_CAT(SIMD_KERNEL, _hermite)(force_block_t * __restrict__ const acc, force_block_t * __restrict__ const jerk,
+      const particles_block_t * __restrict__ const target, const particles_block_t * __restrict__ const source,
+      const int e0, const int e1, const int s1)
+{
+   const int e_end = e0 + (e1 - e0)/SIMD_WIDTH*SIMD_WIDTH;
+   int e, j;
+
+   for (e = e0; e < e_end; e += SIMD_WIDTH) {
+      const vec_t pos_x1 = vec_load(&target->position_x[e]);
+      const vec_t pos_y1 = vec_load(&target->position_y[e]);
+      const vec_t pos_z1 = vec_load(&target->position_z[e]);
+      const vec_t vel_x1 = vec_load(&target->velocity_x[e]);
+      const vec_t vel_y1 = vec_load(&target->velocity_y[e]);
+      const vec_t vel_z1 = vec_load(&target->velocity_z[e]);
+      vec_t ax = vec_load(&acc->x[e]);
+      vec_t ay = vec_load(&acc->y[e]);
+      vec_t az = vec_load(&acc->z[e]);
+      vec_t jx = vec_load(&jerk->x[e]);
+      vec_t jy = vec_load(&jerk->y[e]);
+      vec_t jz = vec_load(&jerk->z[e]);
+
+      for (j = 0; j < s1; j++) {
+         const vec_t diff_x = vec_sub(vec_set1(source->position_x[j]), pos_x1);
+         const vec_t diff_y = vec_sub(vec_set1(source->position_y[j]), pos_y1);
+         const vec_t diff_z = vec_sub(vec_set1(source->position_z[j]), pos_z1);
+         const vec_t dvel_x = vec_sub(vec_set1(source->velocity_x[j]), vel_x1);
+         const vec_t dvel_y = vec_sub(vec_set1(source->velocity_y[j]), vel_y1);
+         const vec_t dvel_z = vec_sub(vec_set1(source->velocity_z[j]), vel_z1);
+
+         const vec_t distance_squared = vec_add(vec_add(vec_mul(diff_x, diff_x), vec_mul(diff_y, diff_y)),
+               vec_mul(diff_z, diff_z));
+         const vec_t inv_squared = vec_zero_if_zero(distance_squared, vec_div(vec_set1(1.0f), distance_squared));
+         const vec_t inv_cubed_weight = vec_mul(vec_mul(vec_set1(source->weight[j]), inv_squared),
+               vec_sqrt(inv_squared));
+         const vec_t rv = vec_mul(vec_mul(vec_set1(3.0f), vec_add(vec_add(vec_mul(diff_x, dvel_x),
+               vec_mul(diff_y, dvel_y)), vec_mul(diff_z, dvel_z))), inv_squared);
+
+         ax = vec_add(ax, vec_mul(inv_cubed_weight, diff_x));
+         ay = vec_add(ay, vec_mul(inv_cubed_weight, diff_y));
+         az = vec_add(az, vec_mul(inv_cubed_weight, diff_z));
+         jx = vec_add(jx, vec_mul(inv_cubed_weight, vec_sub(dvel_x, vec_mul(rv, diff_x))));
+         jy = vec_add(jy, vec_mul(inv_cubed_weight, vec_sub(dvel_y, vec_mul(rv, diff_y))));
+         jz = vec_add(jz, vec_mul(inv_cubed_weight, vec_sub(dvel_z, vec_mul(rv, diff_z))));
+      }
+
+      vec_store(&acc->x[e], ax);
+      vec_store(&acc->y[e], ay);
+      vec_store(&acc->z[e], az);
+      vec_store(&jerk->x[e], jx);
+      vec_store(&jerk->y[e], jy);
+      vec_store(&jerk->z[e], jz);
+   }
+
+   if (e_end < e1) forces_scalar_hermite(acc, jerk, target, source, e_end, e1, s1);
+}
+
+#endif
@@ -0,0 +1,245 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Body of the SIMD force kernels, included once per ISA by simd.c with the vec_*
+ * macros and SIMD_KERNEL/SIMD_TARGET/SIMD_WIDTH defined. Targets are processed
+ * SIMD_WIDTH at a time with their positions and accumulators kept in registers
+ * while the source block is broadcast one particle at a time, so each target
+ * still accumulates its sources in calculate_forces order. The source block is
+ * walked in tiles of `tile` particles that stay in L1 while every target vector
+ * of the slice goes over them, which keeps that order too. Only its first s1
+ * particles are used, so the last tile is cut there, which skips the padding
+ * of the last block. */
+
+#define SIMD_CAT_(a, b) a ## b
+#define SIMD_CAT(a, b)  SIMD_CAT_(a, b)
+
+/* Same arithmetic as calculate_forces_part: sqrt and divide, bit-exact. Neither
+ * FMA contraction nor reassociation is allowed, the scalar kernel gets neither. */
+__attribute__((target(SIMD_TARGET), optimize("fp-contract=off", "no-unsafe-math-optimizations"), always_inline))
+static inline void SIMD_CAT(SIMD_KERNEL, _exact_body)(force_block_t * __restrict__ const forces,
+      const particles_block_t * __restrict__ const target, const particles_block_t * __restrict__ const source,
+      const int e0, const int e1, const int s1, const int tile)
+{
+   const int e_end = e0 + (e1 - e0)/SIMD_WIDTH*SIMD_WIDTH;
+   int e, j, j0;
+
+   for (j0 = 0; j0 < s1; j0 += tile)
+   for (e = e0; e < e_end; e += SIMD_WIDTH) {
+      const vec_t pos_x1 = vec_load(&target->position_x[e]);
+      const vec_t pos_y1 = vec_load(&target->position_y[e]);
+      const vec_t pos_z1 = vec_load(&target->position_z[e]);
+      const vec_t mass1  = vec_load(&target->mass[e]);
+      vec_t fx = vec_load(&forces->x[e]);
+      vec_t fy = vec_load(&forces->y[e]);
+      vec_t fz = vec_load(&forces->z[e]);
+      const int j1 = j0 + tile < s1 ? j0 + tile : s1;
+
+      for (j = j0; j < j1; j++) {
+         const vec_t diff_x = vec_sub(vec_set1(source->position_x[j]), pos_x1);
+         const vec_t diff_y = vec_sub(vec_set1(source->position_y[j]), pos_y1);
+         const vec_t diff_z = vec_sub(vec_set1(source->position_z[j]), pos_z1);
+
+         const vec_t distance_squared = vec_add(vec_add(vec_mul(diff_x, diff_x), vec_mul(diff_y, diff_y)),
+               vec_mul(diff_z, diff_z));
+         const vec_t distance = vec_sqrt(distance_squared);
+
+         const vec_t force = vec_mul(vec_div(mass1, vec_mul(distance_squared, distance)),
+               vec_set1(source->weight[j]));
+         const vec_t force_corrected = vec_zero_if_zero(distance_squared, force);
+
+         fx = vec_add(fx, vec_mul(force_corrected, diff_x));
+         fy = vec_add(fy, vec_mul(force_corrected, diff_y));
+         fz = vec_add(fz, vec_mul(force_corrected, diff_z));
+      }
+
+      vec_store(&forces->x[e], fx);
+      vec_store(&forces->y[e], fy);
+      vec_store(&forces->z[e], fz);
+   }
+
+   if (e_end < e1) host_forces_slice(forces, target, source, e_end, e1, s1);
+}
+
+__attribute__((target(SIMD_TARGET), optimize("fp-contract=off", "no-unsafe-math-optimizations")))
+static void SIMD_CAT(SIMD_KERNEL, _exact)(force_block_t * __restrict__ const forces,
+      const particles_block_t * __restrict__ const target, const particles_block_t * __restrict__ const source,
+      const int e0, const int e1, const int s1)
+{
+   SIMD_TILED(SIMD_CAT(SIMD_KERNEL, _exact_body), forces, target, source, e0, e1, s1);
+}
+
+/* Hardware reciprocal square root estimate refined with newton Newton steps */
+__attribute__((target(SIMD_TARGET), always_inline))
+static inline void SIMD_CAT(SIMD_KERNEL, _rsqrt_body)(force_block_t * __restrict__ const forces,
+      const particles_block_t * __restrict__ const target, const particles_block_t * __restrict__ const source,
+      const int e0, const int e1, const int s1, const int newton, const int tile)
+{
+   const int e_end  = e0 + (e1 - e0)/SIMD_WIDTH*SIMD_WIDTH;
+   const vec_t half         = vec_set1(0.5f);
+   const vec_t three_halves = vec_set1(1.5f);
+   int e, j, j0, k;
+
+   for (j0 = 0; j0 < s1; j0 += tile)
+   for (e = e0; e < e_end; e += SIMD_WIDTH) {
+      const vec_t pos_x1 = vec_load(&target->position_x[e]);
+      const vec_t pos_y1 = vec_load(&target->position_y[e]);
+      const vec_t pos_z1 = vec_load(&target->position_z[e]);
+      const vec_t mass1  = vec_load(&target->mass[e]);
+      vec_t fx = vec_load(&forces->x[e]);
+      vec_t fy = vec_load(&forces->y[e]);
+      vec_t fz = vec_load(&forces->z[e]);
+      const int j1 = j0 + tile < s1 ? j0 + tile : s1;
+
+      for (j = j0; j < j1; j++) {
+         const vec_t diff_x = vec_sub(vec_set1(source->position_x[j]), pos_x1);
+         const vec_t diff_y = vec_sub(vec_set1(source->position_y[j]), pos_y1);
+         const vec_t diff_z = vec_sub(vec_set1(source->position_z[j]), pos_z1);
+
+         const vec_t distance_squared = vec_add(vec_add(vec_mul(diff_x, diff_x), vec_mul(diff_y, diff_y)),
+               vec_mul(diff_z, diff_z));
+
+         vec_t inv_distance = vec_rsqrt(distance_squared);
+         const vec_t half_distance_squared = vec_mul(half, distance_squared);
+         for (k = 0; k < newton; k++) {
+            inv_distance = vec_mul(inv_distance, vec_sub(three_halves,
+                     vec_mul(vec_mul(half_distance_squared, inv_distance), inv_distance)));
+         }
+         const vec_t inv_distance_cubed = vec_mul(vec_mul(inv_distance, inv_distance), inv_distance);
+
+         const vec_t force = vec_mul(vec_mul(mass1, vec_set1(source->weight[j])), inv_distance_cubed);
+         const vec_t force_corrected = vec_zero_if_zero(distance_squared, force);
+
+         fx = vec_add(fx, vec_mul(force_corrected, diff_x));
+         fy = vec_add(fy, vec_mul(force_corrected, diff_y));
+         fz = vec_add(fz, vec_mul(force_corrected, diff_z));
+      }
+
+      vec_store(&forces->x[e], fx);
+      vec_store(&forces->y[e], fy);
+      vec_store(&forces->z[e], fz);
+   }
+
+   if (e_end < e1) host_forces_slice(forces, target, source, e_end, e1, s1);
+}
+
+/* The common step counts get their own copy so the refinement loop unrolls away */
+__attribute__((target(SIMD_TARGET)))
+static void SIMD_CAT(SIMD_KERNEL, _rsqrt)(force_block_t * __restrict__ const forces,
+      const particles_block_t * __restrict__ const target, const particles_block_t * __restrict__ const source,
+      const int e0, const int e1, const int s1)
+{
+   switch (simd_newton) {
+      case 0:  SIMD_TILED(SIMD_CAT(SIMD_KERNEL, _rsqrt_body), forces, target, source, e0, e1, s1, 0); break;
+      case 1:  SIMD_TILED(SIMD_CAT(SIMD_KERNEL, _rsqrt_body), forces, target, source, e0, e1, s1, 1); break;
+      case 2:  SIMD_TILED(SIMD_CAT(SIMD_KERNEL, _rsqrt_body), forces, target, source, e0, e1, s1, 2); break;
+      default: SIMD_TILED(SIMD_CAT(SIMD_KERNEL, _rsqrt_body), forces, target, source, e0, e1, s1, simd_newton); break;
+   }
+}
+
+/* Symmetric kernel: every (e, k) pair of the block pair is evaluated once and its
+ * contribution is added to the target and subtracted from the source, which get
+ * the very same force, so momentum is conserved exactly. The source index is the
+ * vector one, the target accumulates in registers and is reduced at the end of
+ * each source tile, whose positions and forces stay in L1 meanwhile. With
+ * diagonal set both blocks are the same one and only the k > e pairs are visited. */
+__attribute__((target(SIMD_TARGET), always_inline))
+static inline void SIMD_CAT(SIMD_KERNEL, _sym_body)(force_block_t * const fi, force_block_t * const fj,
+      const particles_block_t * const bi, const particles_block_t * const bj, const int diagonal,
+      const int newton, const int tile)
+{
+   const vec_t one          = vec_set1(1.0f);
+   const vec_t half         = vec_set1(0.5f);
+   const vec_t three_halves = vec_set1(1.5f);
+   int e, k, k0, k1, n;
+
+   for (k0 = 0; k0 < BLOCK_SIZE; k0 += tile) {
+      k1 = k0 + tile < BLOCK_SIZE ? k0 + tile : BLOCK_SIZE;
+      for (e = 0; e < (diagonal ? k1 - 1 : BLOCK_SIZE); e++) {
+         const vec_t pos_x1 = vec_set1(bi->position_x[e]);
+         const vec_t pos_y1 = vec_set1(bi->position_y[e]);
+         const vec_t pos_z1 = vec_set1(bi->position_z[e]);
+         const vec_t mass1  = vec_set1(bi->mass[e]);
+         vec_t fx = vec_set1(0.0f);
+         vec_t fy = vec_set1(0.0f);
+         vec_t fz = vec_set1(0.0f);
+         single_force tail = { 0.0f, 0.0f, 0.0f };
+
+         k  = diagonal && e + 1 > k0 ? e + 1 : k0;
+         for (; k < k1 && k % SIMD_WIDTH != 0; k++) {
+            host_sym_pair(fj, bi, bj, e, k, &tail);
+         }
+
+         for (; k + SIMD_WIDTH <= k1; k += SIMD_WIDTH) {
+            const vec_t diff_x = vec_sub(vec_load(&bj->position_x[k]), pos_x1);
+            const vec_t diff_y = vec_sub(vec_load(&bj->position_y[k]), pos_y1);
+            const vec_t diff_z = vec_sub(vec_load(&bj->position_z[k]), pos_z1);
+
+            const vec_t distance_squared = vec_add(vec_add(vec_mul(diff_x, diff_x), vec_mul(diff_y, diff_y)),
+                  vec_mul(diff_z, diff_z));
+
+            vec_t inv_distance_cubed;
+            if (newton < 0) {
+               inv_distance_cubed = vec_div(one, vec_mul(distance_squared, vec_sqrt(distance_squared)));
+            } else {
+               vec_t inv_distance = vec_rsqrt(distance_squared);
+               const vec_t half_distance_squared = vec_mul(half, distance_squared);
+               for (n = 0; n < newton; n++) {
+                  inv_distance = vec_mul(inv_distance, vec_sub(three_halves,
+                           vec_mul(vec_mul(half_distance_squared, inv_distance), inv_distance)));
+               }
+               inv_distance_cubed = vec_mul(vec_mul(inv_distance, inv_distance), inv_distance);
+            }
+
+            const vec_t force = vec_mul(vec_mul(mass1, vec_load(&bj->weight[k])), inv_distance_cubed);
+            const vec_t force_corrected = vec_zero_if_zero(distance_squared, force);
+
+            const vec_t force_x = vec_mul(force_corrected, diff_x);
+            const vec_t force_y = vec_mul(force_corrected, diff_y);
+            const vec_t force_z = vec_mul(force_corrected, diff_z);
+
+            fx = vec_add(fx, force_x);
+            fy = vec_add(fy, force_y);
+            fz = vec_add(fz, force_z);
+            vec_store(&fj->x[k], vec_sub(vec_load(&fj->x[k]), force_x));
+            vec_store(&fj->y[k], vec_sub(vec_load(&fj->y[k]), force_y));
+            vec_store(&fj->z[k], vec_sub(vec_load(&fj->z[k]), force_z));
+         }
+
+         for (; k < k1; k++) {
+            host_sym_pair(fj, bi, bj, e, k, &tail);
+         }
+
+         fi->x[e] += vec_hsum(fx) + tail.x;
+         fi->y[e] += vec_hsum(fy) + tail.y;
+         fi->z[e] += vec_hsum(fz) + tail.z;
+      }
+   }
+}
+
+__attribute__((target(SIMD_TARGET)))
+static void SIMD_CAT(SIMD_KERNEL, _sym)(force_block_t * const fi, force_block_t * const fj,
+      const particles_block_t * const bi, const particles_block_t * const bj, const int diagonal)
+{
+   switch (simd_newton) {
+      case -1: SIMD_TILED(SIMD_CAT(SIMD_KERNEL, _sym_body), fi, fj, bi, bj, diagonal, -1); break;
+      case 0:  SIMD_TILED(SIMD_CAT(SIMD_KERNEL, _sym_body), fi, fj, bi, bj, diagonal, 0);  break;
+      case 1:  SIMD_TILED(SIMD_CAT(SIMD_KERNEL, _sym_body), fi, fj, bi, bj, diagonal, 1);  break;
+      case 2:  SIMD_TILED(SIMD_CAT(SIMD_KERNEL, _sym_body), fi, fj, bi, bj, diagonal, 2);  break;
+      default: SIMD_TILED(SIMD_CAT(SIMD_KERNEL, _sym_body), fi, fj, bi, bj, diagonal, simd_newton); break;
+   }
+}
@@ -0,0 +1,419 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nbody.h"
+
+extern int silent;
+
+#define TRAJ_MAGIC         "NBTRAJ1"
+#define TRAJ_INDEX_MAGIC   "NBTRIDX"
+#define TRAJ_KEYFRAME      16 /* frames between self-contained frames */
+#define TRAJ_FLAG_KEYFRAME 1
+#define TRAJ_FLAG_LOSSLESS 2
+/* Largest quantized symbol, so that the difference of two fits an int32 */
+#define TRAJ_SYMBOL_MAX    1073741824.0
+
+/* A trajectory file is this header, the compressed frames one after the other,
+ * the frame index and a trailer pointing to it. Each frame stores the selected
+ * fields, field by field, as one LEB128 varint per particle. Lossless frames
+ * store the float bits xored with the previous frame, lossy ones the zigzag
+ * difference of the values quantized to 2*tolerance. Every TRAJ_KEYFRAME-th
+ * frame is encoded against zero, so a reader decodes at most TRAJ_KEYFRAME
+ * frames to get any of them. Lossy values are within the tolerance plus half
+ * the float spacing of the originals. A lossy frame with a value too large for
+ * the quantum, or not finite, is stored lossless instead, and a frame of the
+ * other kind than the previous one is a keyframe. */
+typedef struct {
+   char     magic[8];
+   uint32_t particles;
+   uint32_t fields;
+   float    tolerance;
+   uint32_t interval;
+   uint32_t keyframe;
+   uint32_t reserved;
+} traj_header_t;
+
+typedef struct {
+   int32_t  step;
+   uint32_t flags;   /* TRAJ_FLAG_* */
+   uint64_t offset;
+   uint64_t size;
+} traj_index_t;
+
+typedef struct {
+   uint64_t index_offset;
+   uint32_t frames;
+   uint32_t reserved;
+   char     magic[8];
+} traj_trailer_t;
+
+static const struct {
+   const char* name;
+   int         field;
+   size_t      offset[3];
+   int         count;
+} traj_fields[] = {
+   { "position", NBODY_TRAJ_POSITION, { offsetof(particles_block_t, position_x),
+      offsetof(particles_block_t, position_y), offsetof(particles_block_t, position_z) }, 3 },
+   { "velocity", NBODY_TRAJ_VELOCITY, { offsetof(particles_block_t, velocity_x),
+      offsetof(particles_block_t, velocity_y), offsetof(particles_block_t, velocity_z) }, 3 },
+   { "mass",     NBODY_TRAJ_MASS,     { offsetof(particles_block_t, mass) }, 1 },
+};
+
+static const int num_traj_fields = sizeof(traj_fields)/sizeof(traj_fields[0]);
+
+/* Same staging scheme as the checkpoints: the compute threads copy the fields,
+ * the writer thread encodes and writes them */
+static struct {
+   pthread_t       writer;
+   pthread_mutex_t lock;
+   pthread_cond_t  cond;
+   int             pending;
+   int             quit;
+   int             fd;
+   traj_header_t   header;
+   size_t          values;     /* per frame */
+   float           *staging;
+   int32_t         step;
+   char            fname[1024];
+   uint32_t        *previous;  /* symbols of the previous frame */
+   int             lossless;   /* kind of the previous frame */
+   uint32_t        fallbacks;  /* lossy frames stored lossless */
+   uint8_t         *encoded;
+   traj_index_t    *index;
+   uint32_t        frames;
+   uint32_t        max_frames;
+   uint64_t        offset;
+   double          stalled;
+} traj = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+int nbody_trajectory_fields(const char * list)
+{
+   int fields = 0, i;
+   while (*list != '\0') {
+      const size_t len = strcspn(list, ",");
+      for (i = 0; i < num_traj_fields; i++) {
+         if (strlen(traj_fields[i].name) == len && strncmp(list, traj_fields[i].name, len) == 0) break;
+      }
+      if (i == num_traj_fields) return -1;
+      fields |= traj_fields[i].field;
+      list += len + (list[len] == ',');
+   }
+   return fields;
+}
+
+static size_t traj_values(const int fields, const size_t particles)
+{
+   size_t values = 0;
+   int i;
+   for (i = 0; i < num_traj_fields; i++) {
+      if (fields & traj_fields[i].field) values += traj_fields[i].count*particles;
+   }
+   return values;
+}
+
+static inline uint32_t traj_symbol(const float value, const float quantum)
+{
+   union { float f; uint32_t u; } bits = { value };
+   if (quantum == 0.0f) return bits.u;
+
+   return (uint32_t)(int32_t)rint((double)value/quantum);
+}
+
+static inline float traj_value(const uint32_t symbol, const float quantum)
+{
+   union { uint32_t u; float f; } bits = { symbol };
+   return quantum == 0.0f ? bits.f : (float)((double)(int32_t)symbol*quantum);
+}
+
+/* Difference to the previous symbol, small for slowly moving particles */
+static inline uint32_t traj_delta(const uint32_t symbol, const uint32_t previous, const int lossless)
+{
+   if (lossless) return symbol ^ previous;
+   const int32_t d = (int32_t)(symbol - previous);
+   return ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+}
+
+static inline uint32_t traj_undelta(const uint32_t delta, const uint32_t previous, const int lossless)
+{
+   if (lossless) return delta ^ previous;
+   const int32_t d = (int32_t)(delta >> 1) ^ -(int32_t)(delta & 1);
+   return previous + (uint32_t)d;
+}
+
+static size_t traj_encode(uint8_t * out, const float * values, uint32_t * previous, const size_t n,
+      const float quantum, const int keyframe)
+{
+   const int lossless = quantum == 0.0f;
+   uint8_t * const start = out;
+   size_t i;
+   for (i = 0; i < n; i++) {
+      const uint32_t symbol = traj_symbol(values[i], quantum);
+      uint32_t delta = traj_delta(symbol, keyframe ? 0 : previous[i], lossless);
+      previous[i] = symbol;
+      while (delta >= 0x80) {
+         *out++ = (uint8_t)(delta | 0x80);
+         delta >>= 7;
+      }
+      *out++ = (uint8_t)delta;
+   }
+   return out - start;
+}
+
+static const uint8_t * traj_decode(const uint8_t * in, uint32_t * symbols, const size_t n,
+      const float quantum, const int keyframe)
+{
+   const int lossless = quantum == 0.0f;
+   size_t i;
+   for (i = 0; i < n; i++) {
+      uint32_t delta = 0;
+      int shift = 0;
+      do {
+         delta |= (uint32_t)(*in & 0x7f) << shift;
+         shift += 7;
+      } while (*in++ & 0x80);
+      symbols[i] = traj_undelta(delta, keyframe ? 0 : symbols[i], lossless);
+   }
+   return in;
+}
+
+static void traj_write_all(const void * data, size_t size)
+{
+   const char * p = data;
+   while (size > 0) {
+      const ssize_t n = write(traj.fd, p, size);
+      assert(n > 0);
+      p += n; size -= n;
+   }
+}
+
+/* Whether every value of the frame quantizes to a symbol within TRAJ_SYMBOL_MAX */
+static int traj_quantizable(const float * values, const size_t n, const float quantum)
+{
+   const double limit = TRAJ_SYMBOL_MAX*quantum;
+   size_t i;
+   for (i = 0; i < n; i++) {
+      if (!(fabs((double)values[i]) < limit)) return 0;
+   }
+   return 1;
+}
+
+static void traj_write_frame(void)
+{
+   float quantum = 2.0f*traj.header.tolerance;
+   if (quantum != 0.0f && !traj_quantizable(traj.staging, traj.values, quantum)) {
+      quantum = 0.0f;
+      traj.fallbacks++;
+   }
+   const int lossless = quantum == 0.0f;
+   const int keyframe = traj.frames%TRAJ_KEYFRAME == 0 || lossless != traj.lossless;
+   traj.lossless = lossless;
+
+   const size_t size = traj_encode(traj.encoded, traj.staging, traj.previous, traj.values, quantum, keyframe);
+   traj_write_all(traj.encoded, size);
+
+   if (traj.frames == traj.max_frames) {
+      traj.max_frames = 2*traj.max_frames + 16;
+      traj.index = realloc(traj.index, traj.max_frames*sizeof(traj_index_t));
+      assert(traj.index != NULL);
+   }
+   traj_index_t * const entry = &traj.index[traj.frames++];
+   entry->step     = traj.step;
+   entry->flags    = (keyframe ? TRAJ_FLAG_KEYFRAME : 0) | (lossless ? TRAJ_FLAG_LOSSLESS : 0);
+   entry->offset   = traj.offset;
+   entry->size     = size;
+   traj.offset += size;
+}
+
+static void * traj_writer(void * arg)
+{
+   pthread_mutex_lock(&traj.lock);
+   for (;;) {
+      while (!traj.pending && !traj.quit) pthread_cond_wait(&traj.cond, &traj.lock);
+      if (!traj.pending) break;
+
+      pthread_mutex_unlock(&traj.lock);
+      traj_write_frame();
+      pthread_mutex_lock(&traj.lock);
+
+      traj.pending = 0;
+      pthread_cond_broadcast(&traj.cond);
+   }
+   pthread_mutex_unlock(&traj.lock);
+   return NULL;
+}
+
+void nbody_trajectory_init(nbody_t * const nbody, const nbody_opts_t * const opts)
+{
+   snprintf(traj.fname, sizeof(traj.fname), "%s.%d.traj", nbody->file.name, nbody_comm_rank());
+
+   traj.fd = open(traj.fname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+   assert(traj.fd >= 0);
+
+   memset(&traj.header, 0, sizeof(traj.header));
+   memcpy(traj.header.magic, TRAJ_MAGIC, sizeof(traj.header.magic));
+   traj.header.particles = nbody->num_particles*BLOCK_SIZE;
+   traj.header.fields    = opts->traj_fields;
+   traj.header.tolerance = opts->traj_tolerance;
+   traj.header.interval  = opts->trajectory;
+   traj.header.keyframe  = TRAJ_KEYFRAME;
+   traj_write_all(&traj.header, sizeof(traj.header));
+
+   traj.values     = traj_values(opts->traj_fields, traj.header.particles);
+   traj.staging    = malloc(traj.values*sizeof(float));
+   traj.previous   = calloc(traj.values, sizeof(uint32_t));
+   traj.encoded    = malloc(traj.values*5);
+   traj.index      = NULL;
+   traj.frames     = 0;
+   traj.max_frames = 0;
+   traj.lossless   = traj.header.tolerance == 0.0f;
+   traj.fallbacks  = 0;
+   traj.offset     = sizeof(traj_header_t);
+   traj.pending    = 0;
+   traj.quit       = 0;
+   traj.stalled    = 0.0;
+   assert(traj.staging != NULL && traj.previous != NULL && traj.encoded != NULL);
+
+   assert(pthread_create(&traj.writer, NULL, traj_writer, NULL) == 0);
+}
+
+void nbody_trajectory_frame(nbody_t * const nbody, const int step)
+{
+   const double start = wall_time();
+   int i, f, c;
+
+   pthread_mutex_lock(&traj.lock);
+   while (traj.pending) pthread_cond_wait(&traj.cond, &traj.lock);
+
+   float * out = traj.staging;
+   for (f = 0; f < num_traj_fields; f++) {
+      if (!(traj.header.fields & traj_fields[f].field)) continue;
+      for (c = 0; c < traj_fields[f].count; c++) {
+         for (i = 0; i < nbody->num_particles; i++) {
+            memcpy(out, (const char *)&nbody->local[i] + traj_fields[f].offset[c], BLOCK_SIZE*sizeof(float));
+            out += BLOCK_SIZE;
+         }
+      }
+   }
+   traj.step    = step;
+   traj.pending = 1;
+
+   pthread_cond_broadcast(&traj.cond);
+   pthread_mutex_unlock(&traj.lock);
+
+   traj.stalled += wall_time() - start;
+}
+
+void nbody_trajectory_fini(void)
+{
+   pthread_mutex_lock(&traj.lock);
+   traj.quit = 1;
+   pthread_cond_broadcast(&traj.cond);
+   pthread_mutex_unlock(&traj.lock);
+   assert(pthread_join(traj.writer, NULL) == 0);
+
+   traj_trailer_t trailer = { traj.offset, traj.frames, 0, TRAJ_INDEX_MAGIC };
+   traj_write_all(traj.index, traj.frames*sizeof(traj_index_t));
+   traj_write_all(&trailer, sizeof(trailer));
+   assert(close(traj.fd) == 0);
+
+   const double raw = (double)traj.frames*traj.values*sizeof(float);
+   silent?:printf("> Trajectory frames: %u, compression ratio %.2f, compute stalled (secs): %f\n",
+         traj.frames, traj.offset > sizeof(traj_header_t) ? raw/(traj.offset - sizeof(traj_header_t)) : 0.0,
+         traj.stalled);
+   if (traj.fallbacks > 0) {
+      silent?:printf("> Trajectory frames stored lossless, out of range of the tolerance: %u\n", traj.fallbacks);
+   }
+
+   /* The staging buffer still has the last frame, read it back through the file */
+   if (traj.frames > 0) {
+      float * const decoded = malloc(traj.values*sizeof(float));
+      size_t i, bad = 0;
+      assert(decoded != NULL);
+      assert(nbody_trajectory_read(traj.fname, traj.frames - 1, decoded, NULL) == (int)traj.values);
+      for (i = 0; i < traj.values; i++) {
+         const float bound = traj.header.tolerance + fabsf(traj.staging[i])*FLT_EPSILON;
+         bad += !(fabsf(decoded[i] - traj.staging[i]) <= bound) &&
+            memcmp(&decoded[i], &traj.staging[i], sizeof(float)) != 0;
+      }
+      if (bad > 0) {
+         fprintf(stderr, "> Error: %zu values of the last trajectory frame of %s decode out of the tolerance\n",
+               bad, traj.fname);
+         exit(1);
+      }
+      free(decoded);
+   }
+
+   free(traj.staging); free(traj.previous); free(traj.encoded); free(traj.index);
+}
+
+int nbody_trajectory_read(const char * fname, const int frame, float * values, int * step)
+{
+   struct stat st;
+   const int fd = open(fname, O_RDONLY, 0);
+   if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(traj_header_t) + sizeof(traj_trailer_t)) {
+      if (fd >= 0) close(fd);
+      return -1;
+   }
+
+   const uint8_t * const data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   assert(close(fd) == 0);
+   if (data == MAP_FAILED) return -1;
+
+   const traj_header_t * const header   = (const traj_header_t *)data;
+   const traj_trailer_t * const trailer = (const traj_trailer_t *)(data + st.st_size - sizeof(traj_trailer_t));
+   const traj_index_t * const index     = (const traj_index_t *)(data + trailer->index_offset);
+
+   int result = -1;
+   if (memcmp(header->magic, TRAJ_MAGIC, sizeof(header->magic)) == 0 &&
+         memcmp(trailer->magic, TRAJ_INDEX_MAGIC, sizeof(trailer->magic)) == 0 &&
+         frame >= 0 && (uint32_t)frame < trailer->frames) {
+      const size_t n = traj_values(header->fields, header->particles);
+      const float quantum = 2.0f*header->tolerance;
+      uint32_t * const symbols = malloc(n*sizeof(uint32_t));
+      size_t i;
+      int f;
+
+      /* Only the frames since the last keyframe are decoded */
+      for (f = frame; !(index[f].flags & TRAJ_FLAG_KEYFRAME); f--);
+      for (; f <= frame; f++) {
+         traj_decode(data + index[f].offset, symbols, n, index[f].flags & TRAJ_FLAG_LOSSLESS ? 0.0f : quantum,
+               index[f].flags & TRAJ_FLAG_KEYFRAME);
+      }
+
+      const float frame_quantum = index[frame].flags & TRAJ_FLAG_LOSSLESS ? 0.0f : quantum;
+      for (i = 0; i < n; i++) values[i] = traj_value(symbols[i], frame_quantum);
+      if (step != NULL) *step = index[frame].step;
+      result = (int)n;
+      free(symbols);
+   }
+   assert(munmap((void *)data, st.st_size) == 0);
+   return result;
+}
@@ -0,0 +1,220 @@
+/*
+* Copyright (c) 2020-2022, Barcelona Supercomputing Center
+*                          Centro Nacional de Supercomputacion
+*
+* This program is free software: you can redistribute it and/or modify  
+* it under the terms of the GNU General Public License as published by  
+* the Free Software Foundation, version 3.
+*
+* This program is distributed in the hope that it will be useful, but 
+* WITHOUT ANY WARRANTY; without even the implied warranty of 
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+* General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License 
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "engine.h"
+
+extern int silent;
+
+/* Parameters swept by the tuning mode. Tiles bigger than BLOCK_SIZE or
+ * ISAs the CPU lacks are rejected by nbody_simd_select and skipped. */
+static const char * const tune_isas[]   = { "avx512", "avx2", "sse", "scalar" };
+static const int          tune_tiles[]  = { 256, 512, 1024, 2048 };
+
+static const int num_tune_isas   = sizeof(tune_isas)/sizeof(tune_isas[0]);
+static const int num_tune_tiles  = sizeof(tune_tiles)/sizeof(tune_tiles[0]);
+
+typedef struct {
+   int         threads;
+   const char* isa;
+   int         tile;
+   double      times[4];
+   double      throughput;
+   double      effective;
+   int         result;
+} tune_point_t;
+
+static const char * tune_result(const int result)
+{
+   return result < 0 ? "fail" : (result == 0 ? "n/a" : "successful");
+}
+
+static void tune_run(const nbody_engine_t * const engine, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, tune_point_t * const point)
+{
+   nbody_t nbody = nbody_setup(conf, opts);
+   const double n = (double)conf->num_particles*BLOCK_SIZE;
+
+   const double pairs = engine->solve(&nbody, conf, opts, point->times);
+   point->result = nbody_check(&nbody, opts);
+   nbody_free(&nbody);
+
+   const double elapsed = point->times[2] - point->times[1];
+   point->throughput = pairs/1.0E9/elapsed;
+   point->effective  = n*n*conf->timesteps/1.0E9/elapsed;
+}
+
+static void tune_write_csv(const char * prefix, const char * engine, const tune_point_t * const points, const int n)
+{
+   char fname[1024];
+   int i;
+   snprintf(fname, sizeof(fname), "%s.csv", prefix);
+
+   FILE * const f = fopen(fname, "w");
+   assert(f != NULL);
+
+   fprintf(f, "engine,threads,isa,tile,warmup_s,execution_s,flush_s,gpairs_s,effective_gpairs_s,verification\n");
+   for (i = 0; i < n; i++) {
+      const tune_point_t * const p = &points[i];
+      fprintf(f, "%s,%d,%s,%d,%f,%f,%f,%f,%f,%s\n", engine, p->threads, p->isa, p->tile,
+            p->times[1] - p->times[0], p->times[2] - p->times[1], p->times[3] - p->times[2],
+            p->throughput, p->effective, tune_result(p->result));
+   }
+   assert(fclose(f) == 0);
+}
+
+static void tune_write_point_json(FILE * const f, const tune_point_t * const p)
+{
+   fprintf(f, "{ \"threads\": %d, \"isa\": \"%s\", \"tile\": %d, \"warmup_s\": %f, \"execution_s\": %f, "
+         "\"flush_s\": %f, \"gpairs_s\": %f, \"effective_gpairs_s\": %f, \"verification\": \"%s\" }",
+         p->threads, p->isa, p->tile, p->times[1] - p->times[0], p->times[2] - p->times[1],
+         p->times[3] - p->times[2], p->throughput, p->effective, tune_result(p->result));
+}
+
+static void tune_write_json(const char * prefix, const char * engine, nbody_conf_t * const conf,
+      const tune_point_t * const points, const int n, const int best)
+{
+   char fname[1024];
+   int i;
+   snprintf(fname, sizeof(fname), "%s.json", prefix);
+
+   FILE * const f = fopen(fname, "w");
+   assert(f != NULL);
+
+   fprintf(f, "{\n  \"engine\": \"%s\",\n  \"particles\": %zu,\n  \"timesteps\": %d,\n  \"points\": [\n",
+         engine, conf->particles, conf->timesteps);
+   for (i = 0; i < n; i++) {
+      fprintf(f, "    ");
+      tune_write_point_json(f, &points[i]);
+      fprintf(f, "%s\n", i + 1 < n ? "," : "");
+   }
+   fprintf(f, "  ],\n  \"best\": ");
+   tune_write_point_json(f, &points[best]);
+   fprintf(f, "\n}\n");
+   assert(fclose(f) == 0);
+}
+
+/* The tuning file keeps one line per engine, the other engines' lines are kept */
+static void tune_save(const char * engine, const tune_point_t * const best)
+{
+   char line[256], name[64], tmp[1024];
+   snprintf(tmp, sizeof(tmp), "%s.tmp", NBODY_TUNE_FILE);
+
+   FILE * const out = fopen(tmp, "w");
+   assert(out != NULL);
+
+   FILE * const in = fopen(NBODY_TUNE_FILE, "r");
+   if (in != NULL) {
+      while (fgets(line, sizeof(line), in) != NULL) {
+         if (sscanf(line, "%63s", name) == 1 && strcmp(name, engine) == 0) continue;
+         fputs(line, out);
+      }
+      fclose(in);
+   }
+   fprintf(out, "%s threads=%d isa=%s tile=%d\n", engine, best->threads, best->isa, best->tile);
+   assert(fclose(out) == 0);
+   assert(rename(tmp, NBODY_TUNE_FILE) == 0);
+}
+
+int nbody_tune_load(const char * engine, nbody_opts_t * const opts, const int given)
+{
+   static char isa[16];
+   char line[256], name[64];
+   int threads, tile;
+
+   FILE * const in = fopen(NBODY_TUNE_FILE, "r");
+   if (in == NULL) return 0;
+
+   int found = 0;
+   while (!found && fgets(line, sizeof(line), in) != NULL) {
+      found = sscanf(line, "%63s threads=%d isa=%15s tile=%d", name, &threads, isa, &tile) == 4 &&
+         strcmp(name, engine) == 0;
+   }
+   fclose(in);
+   if (!found) return 0;
+
+   if (!(given & NBODY_TUNE_THREADS)) opts->threads = threads;
+   if (!(given & NBODY_TUNE_ISA))     opts->isa     = isa;
+   if (!(given & NBODY_TUNE_TILE))    opts->tile    = tile;
+   return 1;
+}
+
+int nbody_tune(const nbody_engine_t * const engine, nbody_conf_t * const conf,
+      const nbody_opts_t * const opts, const char * prefix)
+{
+   const int max_threads = opts->threads;
+   const int max_points  = 64*num_tune_isas*num_tune_tiles;
+   tune_point_t * const points = malloc(max_points*sizeof(tune_point_t));
+   assert(points != NULL);
+
+   const int was_silent = silent;
+   int threads, i, b, n = 0, best = -1;
+
+   /* Powers of two up to the requested threads, plus that count itself */
+   for (threads = 1; threads <= max_threads; threads = threads < max_threads && 2*threads > max_threads ?
+         max_threads : 2*threads) {
+      for (i = 0; i < num_tune_isas; i++) {
+         for (b = 0; b < num_tune_tiles; b++) {
+            /* The scalar kernel has a single variant */
+            if (strcmp(tune_isas[i], "scalar") == 0 && tune_tiles[b] != BLOCK_SIZE) continue;
+            if (nbody_simd_select(tune_isas[i], opts->newton, tune_tiles[b]) != 0) continue;
+            if (n == max_points) break;
+
+            nbody_opts_t point_opts = *opts;
+            point_opts.threads = threads;
+            point_opts.isa     = tune_isas[i];
+            point_opts.tile    = tune_tiles[b];
+
+            tune_point_t * const p = &points[n];
+            p->threads = threads;
+            p->isa     = tune_isas[i];
+            p->tile    = tune_tiles[b];
+
+            silent = 1;
+            tune_run(engine, conf, &point_opts, p);
+            silent = was_silent;
+
+            silent?:printf("> Tuning threads %d, %s, tile %d: %f gpairs/s, verification %s\n",
+                  p->threads, p->isa, p->tile, p->effective, tune_result(p->result));
+
+            /* Only configurations that did not fail validation can win */
+            if (p->result >= 0 && (best < 0 || p->effective > points[best].effective)) best = n;
+            n++;
+         }
+      }
+      if (threads == max_threads) break;
+   }
+
+   if (best < 0) {
+      fprintf(stderr, "No valid configuration found while tuning\n");
+      free(points);
+      return -1;
+   }
+
+   tune_write_csv(prefix, engine->name, points, n);
+   tune_write_json(prefix, engine->name, conf, points, n, best);
+   tune_save(engine->name, &points[best]);
+
+   silent?:printf("> Best configuration: threads %d, %s, tile %d (%f gpairs/s), saved to %s\n",
+         points[best].threads, points[best].isa, points[best].tile, points[best].effective, NBODY_TUNE_FILE);
+   free(points);
+   return 0;
+}